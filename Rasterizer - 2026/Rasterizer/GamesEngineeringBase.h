@@ -24,6 +24,11 @@ SOFTWARE.
 
 #pragma once
 
+#if !defined(_WIN32)
+// Without Windows and Direct3D the window is a back buffer only, see headless.h
+#include "headless.h"
+#else
+
 // Include necessary Windows and DirectX headers
 #define NOMINMAX
 #include <Windows.h>
@@ -1370,4 +1375,6 @@ namespace GamesEngineeringBase
 		}
 	};
 
-}
\ No newline at end of file
+}
+
+#endif
@@ -21,6 +21,13 @@ public:
         return distribution(rng);
     }
 
+    // Restart the sequence, e.g. so a test scene is the same on every run
+    // Input Variables:
+    // - value: Seed
+    void seed(unsigned int value) {
+        rng.seed(value);
+    }
+
     // Generate a random integer within a range
     float getRandomFloat(float min, float max) {
         std::uniform_real_distribution<float> distribution(min, max);
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+#include "simd.h"
+#include "vec4.h"
+#include "matrix.h"
+#include "quaternion.h"
+
+// Affine transform stored as the top three rows of a 4x4 matrix; the last row is always (0, 0, 0, 1).
+// Used for object placement (translation, rotation, scale). Composing two affine transforms needs
+// 36 multiplies instead of the 64 of a full matrix product, and the factories write the final
+// elements directly instead of multiplying single-axis matrices together.
+// Convert to a full matrix only where a projection is applied.
+class alignas(16) affine {
+    float a[12];   // Rows 0-2 of the matrix, row-major
+
+public:
+    // Default constructor initializes the identity transform
+    affine() {
+        for (unsigned int i = 0; i < 12; i++)
+            a[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+    }
+
+    // Access elements by row (0-2) and column (0-3)
+    float& operator()(unsigned int row, unsigned int col) { return a[row * 4 + col]; }
+
+    // Access elements by row and column (const version); row 3 reads the implicit (0, 0, 0, 1)
+    float operator()(unsigned int row, unsigned int col) const {
+        if (row == 3) return col == 3 ? 1.0f : 0.0f;
+        return a[row * 4 + col];
+    }
+
+    // Set one of the three stored rows
+    // Input Variables:
+    // - row: Row index, 0 to 2
+    // - r: Row elements
+    void setRow(unsigned int row, const vec4& r) {
+#if RASTER_SIMD
+        _mm_store_ps(a + row * 4, r.simd());
+#else
+        for (unsigned int col = 0; col < 4; col++)
+            a[row * 4 + col] = r[col];
+#endif
+    }
+
+    // Transform a 4D vector; points (w = 1) are translated, directions (w = 0) are not
+    // Input Variables:
+    // - v: vec4 object to transform
+    // Returns the transformed vec4, with w unchanged
+    vec4 operator * (const vec4& v) const {
+        return vec4(
+            a[0] * v[0] + a[1] * v[1] + a[2] * v[2] + a[3] * v[3],
+            a[4] * v[0] + a[5] * v[1] + a[6] * v[2] + a[7] * v[3],
+            a[8] * v[0] + a[9] * v[1] + a[10] * v[2] + a[11] * v[3],
+            v[3]);
+    }
+
+    // Compose with another affine transform, which is applied first
+    // Input Variables:
+    // - b: Transform to apply before this one
+    // Returns the combined transform
+    affine operator * (const affine& b) const {
+        affine ret;
+#if RASTER_SIMD
+        __m128 b0 = _mm_load_ps(b.a), b1 = _mm_load_ps(b.a + 4), b2 = _mm_load_ps(b.a + 8);
+        __m128 b3 = _mm_setr_ps(0.f, 0.f, 0.f, 1.f);
+        for (int row = 0; row < 3; ++row) {
+            __m128 r = _mm_mul_ps(_mm_set1_ps(a[row * 4 + 0]), b0);
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[row * 4 + 1]), b1));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[row * 4 + 2]), b2));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[row * 4 + 3]), b3));
+            _mm_store_ps(ret.a + row * 4, r);
+        }
+#else
+        for (int row = 0; row < 3; ++row) {
+            const float* r = a + row * 4;
+            for (int col = 0; col < 3; ++col) {
+                ret.a[row * 4 + col] = r[0] * b.a[col] + r[1] * b.a[4 + col] + r[2] * b.a[8 + col];
+            }
+            ret.a[row * 4 + 3] = r[0] * b.a[3] + r[1] * b.a[7] + r[2] * b.a[11] + r[3];
+        }
+#endif
+        return ret;
+    }
+
+    // Apply a full matrix after an affine transform, e.g. camera or projection * world
+    // Input Variables:
+    // - m: Matrix applied last
+    // - b: Affine transform applied first
+    // Returns the combined matrix
+    friend matrix operator * (const matrix& m, const affine& b) {
+        matrix ret;
+        for (int row = 0; row < 4; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                float sum = m(row, 0) * b.a[col] + m(row, 1) * b.a[4 + col] + m(row, 2) * b.a[8 + col];
+                ret(row, col) = col == 3 ? sum + m(row, 3) : sum;
+            }
+        }
+        return ret;
+    }
+
+    // Expand to a full 4x4 matrix
+    matrix toMatrix() const {
+        matrix m;
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                m(row, col) = a[row * 4 + col];
+            }
+        }
+        return m;
+    }
+
+    // Create a translation
+    // Input Variables:
+    // - tx, ty, tz: Translation amounts along the X, Y, and Z axes
+    static affine makeTranslation(float tx, float ty, float tz) {
+        affine t;
+        t.a[3] = tx;
+        t.a[7] = ty;
+        t.a[11] = tz;
+        return t;
+    }
+
+    // Create a rotation around the X-axis
+    // Input Variables:
+    // - aRad: Rotation angle in radians
+    static affine makeRotateX(float aRad) {
+        return makeRotateXYZ(aRad, 0.f, 0.f);
+    }
+
+    // Create a rotation around the Y-axis
+    // Input Variables:
+    // - aRad: Rotation angle in radians
+    static affine makeRotateY(float aRad) {
+        return makeRotateXYZ(0.f, aRad, 0.f);
+    }
+
+    // Create a rotation around the Z-axis
+    // Input Variables:
+    // - aRad: Rotation angle in radians
+    static affine makeRotateZ(float aRad) {
+        return makeRotateXYZ(0.f, 0.f, aRad);
+    }
+
+    // Create the rotation matrix::makeRotateXYZ builds (X * Y * Z) directly from one sine and
+    // cosine per axis. The products are grouped as in the matrix version, so the elements match it.
+    // Input Variables:
+    // - x, y, z: Rotation angles in radians around each axis
+    static affine makeRotateXYZ(float x, float y, float z) {
+        float sx = std::sin(x), cx = std::cos(x);
+        float sy = std::sin(y), cy = std::cos(y);
+        float sz = std::sin(z), cz = std::cos(z);
+        float sxsy = sx * sy, cxsy = cx * sy;
+
+        affine r;
+        r.a[0] = cy * cz;                r.a[1] = -(cy * sz);             r.a[2] = sy;
+        r.a[4] = sxsy * cz + cx * sz;    r.a[5] = cx * cz - sxsy * sz;    r.a[6] = -(sx * cy);
+        r.a[8] = sx * sz - cxsy * cz;    r.a[9] = cxsy * sz + sx * cz;    r.a[10] = cx * cy;
+        return r;
+    }
+
+    // Create a uniform scale
+    // Input Variables:
+    // - s: Scaling factor, clamped like matrix::makeScale
+    static affine makeScale(float s) {
+        s = std::max(s, 0.01f);
+        affine m;
+        m.a[0] = s;
+        m.a[5] = s;
+        m.a[10] = s;
+        return m;
+    }
+
+    // Create translation * rotation * scale in one step from a unit quaternion
+    // Input Variables:
+    // - t: Translation (x, y, z)
+    // - q: Rotation, assumed to be of unit length
+    // - s: Scale along each local axis (x, y, z)
+    static affine makeTRS(const vec4& t, const quaternion& q, const vec4& s) {
+        float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+        float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+        float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+        affine m;
+        m.a[0] = (1.f - 2.f * (yy + zz)) * s[0]; m.a[1] = 2.f * (xy - wz) * s[1];         m.a[2] = 2.f * (xz + wy) * s[2];         m.a[3] = t[0];
+        m.a[4] = 2.f * (xy + wz) * s[0];         m.a[5] = (1.f - 2.f * (xx + zz)) * s[1]; m.a[6] = 2.f * (yz - wx) * s[2];         m.a[7] = t[1];
+        m.a[8] = 2.f * (xz - wy) * s[0];         m.a[9] = 2.f * (yz + wx) * s[1];         m.a[10] = (1.f - 2.f * (xx + yy)) * s[2]; m.a[11] = t[2];
+        return m;
+    }
+
+    // Create translation * rotation * scale in one step from Euler angles
+    // Input Variables:
+    // - t: Translation (x, y, z)
+    // - rx, ry, rz: Rotation angles in radians, applied as in makeRotateXYZ
+    // - s: Uniform scale
+    static affine makeTRS(const vec4& t, float rx, float ry, float rz, float s = 1.f) {
+        affine m = makeRotateXYZ(rx, ry, rz);
+        for (int row = 0; row < 3; ++row) {
+            m.a[row * 4 + 0] *= s;
+            m.a[row * 4 + 1] *= s;
+            m.a[row * 4 + 2] *= s;
+            m.a[row * 4 + 3] = t[row];
+        }
+        return m;
+    }
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
+
+// Linear (bump) allocator for data that lives for one frame or less.
+// Allocation is a pointer increment inside one pre-reserved block; nothing is freed individually.
+// reset() at the start of a frame makes the whole block available again. If a frame needs more
+// than the block holds, the extra requests are served from separate heap chunks and the block is
+// regrown to last frame's peak on the next reset(), so steady-state frames never touch the heap.
+class FrameArena {
+    std::byte* block = nullptr;       // Pre-reserved storage
+    size_t capacity = 0;              // Size of block in bytes
+    size_t offset = 0;                // Next free byte in block
+    size_t overflowBytes = 0;         // Bytes served from overflow chunks this frame
+    size_t peak = 0;                  // Most bytes needed by any frame since the last regrow
+    std::vector<std::byte*> overflow; // Heap chunks used this frame after the block ran out
+
+public:
+    // Constructor reserves the block
+    // Input Variables:
+    // - bytes: Initial capacity in bytes
+    explicit FrameArena(size_t bytes = 1 << 20) {
+        capacity = bytes;
+        block = capacity ? new std::byte[capacity] : nullptr;
+    }
+
+    ~FrameArena() {
+        release();
+        delete[] block;
+    }
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    // Storage for count objects of type T, aligned for T and to at least 16 bytes.
+    // No constructors run: the caller writes every element (or placement-news it) before reading it.
+    // Input Variables:
+    // - count: Number of elements
+    template<typename T>
+    T* allocate(size_t count = 1) {
+        static_assert(std::is_trivially_destructible_v<T>, "FrameArena never runs destructors");
+        return static_cast<T*>(allocateBytes(count * sizeof(T), std::max<size_t>(alignof(T), 16)));
+    }
+
+    // Current position, to be passed to rewind() to free everything allocated after it
+    size_t mark() const { return offset; }
+
+    // Free everything allocated from the block since mark() returned m
+    void rewind(size_t m) { offset = m; }
+
+    // Start a new frame. All earlier allocations become invalid.
+    // Returns true when the block had to be regrown, i.e. the previous frame overflowed it
+    bool reset() {
+        peak = std::max(peak, offset + overflowBytes);
+        bool grow = !overflow.empty();
+        release();
+        if (grow) {
+            delete[] block;
+            capacity = std::max(peak + peak / 2, capacity * 2);
+            block = new std::byte[capacity];
+        }
+        offset = 0;
+        return grow;
+    }
+
+    size_t getUsed() const { return offset + overflowBytes; }   // Bytes allocated this frame
+    size_t getCapacity() const { return capacity; }             // Bytes reserved in the block
+    bool overflowed() const { return !overflow.empty(); }       // True when this frame outgrew the block
+
+    // Arena of the calling thread, as installed by setLocal(). Threads that never installed one
+    // get a small arena of their own on first use.
+    static FrameArena& local() {
+        FrameArena*& current = localSlot();
+        if (!current) {
+            thread_local FrameArena own(64 * 1024);
+            current = &own;
+        }
+        return *current;
+    }
+
+    // Install the arena returned by local() on the calling thread
+    // Input Variables:
+    // - arena: Arena owned by the caller, must outlive the thread's use of it
+    static void setLocal(FrameArena* arena) { localSlot() = arena; }
+
+private:
+    static FrameArena*& localSlot() {
+        thread_local FrameArena* current = nullptr;
+        return current;
+    }
+
+    void* allocateBytes(size_t bytes, size_t align) {
+        size_t start = (offset + align - 1) & ~(align - 1);
+        if (start + bytes <= capacity) {
+            offset = start + bytes;
+            return block + start;
+        }
+        // Out of space: serve from the heap for the rest of the frame and grow at the next reset
+        std::byte* chunk = new std::byte[bytes + align];
+        overflow.push_back(chunk);
+        overflowBytes += bytes + align;
+        uintptr_t address = reinterpret_cast<uintptr_t>(chunk);
+        return chunk + (((address + align - 1) & ~uintptr_t(align - 1)) - address);
+    }
+
+    void release() {
+        for (std::byte* chunk : overflow) delete[] chunk;
+        overflow.clear();
+        overflowBytes = 0;
+    }
+};
+
+// Heap allocation counter, incremented by the global operator new when raster.cpp is built with
+// RASTER_TRACK_ALLOCATIONS (on by default in debug builds). Only the threads that render count:
+// those of the job system and the one calling render(). A thread of the application allocating
+// meanwhile, like the I/O thread of StreamingWorld, leaves the count of a frame alone.
+struct HeapStats {
+    inline static std::atomic<size_t> allocations{ 0 };
+    inline static thread_local bool counted = false;    // The calling thread renders
+};
@@ -0,0 +1,266 @@
+// Micro-benchmarks of the rasterizer's building blocks: triangle set-up and drawing at several
+// sizes, the matrix and vector operations of the vertex stage, buffer clears, the binning of
+// render() and mesh generation.
+// The file is not part of the Visual Studio project, because it compiles raster.cpp in to measure
+// the renderer's own code. Build it on its own; on Linux it runs headless (see headless.h):
+//     g++ -std=c++20 -O2 -pthread bench.cpp -o bench
+//     cl /std:c++20 /O2 /EHsc bench.cpp
+// Usage: bench [filter] [--json file] [--threads n]
+// - filter: Run only the benchmarks whose name contains this text
+// - --json: Also save the results to a file, for tracking them over time
+// - --threads: Threads of the job system for the binning benchmark, 1 by default
+// Every benchmark first runs until one batch of iterations takes about two milliseconds, then
+// times Repetitions such batches and reports the median, the fastest and the median absolute
+// deviation per iteration, and the median per unit of work (pixel, triangle, ...).
+
+#define RASTER_NO_MAIN
+#include "raster.cpp"
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <fstream>
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Keeps the compiler from dropping a computation whose result is otherwise unused
+template<typename T>
+void keep(const T& value) {
+#if defined(_MSC_VER)
+    static const void* volatile escape;
+    escape = &value;
+    _ReadWriteBarrier();
+#else
+    asm volatile("" : : "r"(&value) : "memory");
+#endif
+}
+
+struct Benchmark {
+    std::string name;
+    const char* unit;               // Unit of work, e.g. "pixel"
+    double unitsPerIteration;
+    std::function<void()> iteration;
+};
+
+struct BenchmarkResult {
+    std::string name;
+    const char* unit;
+    double unitsPerIteration;
+    long long batch;                // Iterations per timed batch
+    double medianNs, minNs, madNs;  // Per iteration
+
+    double nsPerUnit() const { return unitsPerIteration > 0 ? medianNs / unitsPerIteration : 0.0; }
+};
+
+static const int Repetitions = 21;
+
+// Warms up, sizes the batch and times the repetitions
+// Input Variables:
+// - benchmark: Benchmark to run
+BenchmarkResult measure(const Benchmark& benchmark) {
+    using Clock = std::chrono::steady_clock;
+    auto time = [&benchmark](long long iterations) {
+        Clock::time_point start = Clock::now();
+        for (long long i = 0; i < iterations; i++) benchmark.iteration();
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    };
+
+    long long batch = 1;
+    while (time(batch) < 2e6) batch *= 2;
+
+    double samples[Repetitions];
+    for (int r = 0; r < Repetitions; r++) samples[r] = time(batch) / batch;
+    std::sort(samples, samples + Repetitions);
+    double median = samples[Repetitions / 2];
+    double deviations[Repetitions];
+    for (int r = 0; r < Repetitions; r++) deviations[r] = std::fabs(samples[r] - median);
+    std::sort(deviations, deviations + Repetitions);
+
+    return { benchmark.name, benchmark.unit, benchmark.unitsPerIteration, batch, median, samples[0], deviations[Repetitions / 2] };
+}
+
+// Saves results as JSON
+// Input Variables:
+// - path: File to write
+// - results: Results to save
+// - threads: Threads the job system ran with
+bool writeJson(const char* path, const std::vector<BenchmarkResult>& results, int threads) {
+    std::ofstream file(path);
+    file << "{\n  \"simd\": " << (RASTER_SIMD ? "true" : "false") << ",\n  \"threads\": " << threads
+        << ",\n  \"repetitions\": " << Repetitions << ",\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult& r = results[i];
+        file << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\", \"unit\": \"" << r.unit
+            << "\", \"units_per_iteration\": " << r.unitsPerIteration << ", \"batch\": " << r.batch
+            << ", \"median_ns\": " << r.medianNs << ", \"min_ns\": " << r.minNs << ", \"mad_ns\": " << r.madNs
+            << ", \"ns_per_unit\": " << r.nsPerUnit() << "}";
+    }
+    file << "\n  ]\n}\n";
+    return static_cast<bool>(file);
+}
+
+// Screen-space vertex for triangle benchmarks
+Vertex screenVertex(float x, float y, float depth, float nx, float ny) {
+    Vertex v;
+    v.p = vec4(x, y, depth, 1.f);
+    v.normal = vec4(nx, ny, 1.f, 0.f);
+    v.normal.normalise();
+    v.rgb.set(0.8f, 0.6f, 0.4f);
+    return v;
+}
+
+int main(int argc, char** argv) {
+    const char* filter = "";
+    const char* jsonPath = nullptr;
+    int threads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json") && i + 1 < argc) jsonPath = argv[++i];
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) threads = std::max(atoi(argv[++i]), 1);
+        else filter = argv[i];
+    }
+    setThreadCount(threads);
+
+    Renderer renderer;
+    Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+    L.omega_i.normalise();
+    int width = static_cast<int>(renderer.canvas.getWidth());
+    int height = static_cast<int>(renderer.canvas.getHeight());
+    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+    rng.seed(1);
+
+    std::vector<Benchmark> benchmarks;
+
+    // Triangles: set up and drawn exactly as the shading pass does, over the whole canvas.
+    // The Z pre-pass tolerance lets every repetition pass the depth test against its own depth,
+    // so every covered pixel is shaded every time.
+    struct TriangleCase { const char* name; float size; };
+    static Vertex triangles[3][3];
+    const TriangleCase triangleCases[] = { { "small", 4.f }, { "medium", 60.f }, { "huge", 700.f } };
+    for (int t = 0; t < 3; t++) {
+        float s = triangleCases[t].size;
+        float cx = width * 0.5f, cy = height * 0.5f;
+        // Front-facing winding, as the geometry pass hands triangles to the rasterizer
+        triangles[t][0] = screenVertex(cx - s * 0.5f, cy + s * 0.4f, 0.5f, -0.3f, 0.2f);
+        triangles[t][1] = screenVertex(cx + s * 0.1f, cy - s * 0.5f, 0.55f, 0.f, -0.3f);
+        triangles[t][2] = screenVertex(cx + s * 0.5f, cy + s * 0.3f, 0.6f, 0.3f, 0.1f);
+
+        // Count the covered pixels once
+        renderer.zPrepass = false;
+        renderer.clear();
+        triangle(triangles[t][0], triangles[t][1], triangles[t][2]).draw(renderer, L, 0.75f, 0.75f, 0, height);
+        const unsigned char* pixels = renderer.canvas.getBackBuffer();
+        double covered = 0;
+        for (int i = 0; i < width * height; i++) covered += (pixels[i * 3] | pixels[i * 3 + 1] | pixels[i * 3 + 2]) != 0;
+
+        const Vertex* v = triangles[t];
+        benchmarks.push_back({ std::string("triangle::draw ") + triangleCases[t].name, "pixel", covered, [&renderer, &L, v, height] {
+            triangle tri(v[0], v[1], v[2]);
+            tri.draw(renderer, L, 0.75f, 0.75f, 0, height);
+        } });
+        benchmarks.push_back({ std::string("triangle::draw ") + triangleCases[t].name + " 2x2 shading", "pixel", covered, [&renderer, &L, v, height] {
+            triangle tri(v[0], v[1], v[2]);
+            tri.draw(renderer, L, 0.75f, 0.75f, 0, height, ShadingRate::Rate2x2);
+        } });
+        benchmarks.push_back({ std::string("depthTriangle::draw ") + triangleCases[t].name, "pixel", covered, [&renderer, v, height] {
+            depthTriangle tri(v[0].p, v[1].p, v[2].p);
+            tri.draw(renderer.zbuffer, 0.f, 0.f, 0, height);
+        } });
+    }
+
+    // Vertex stage math over arrays, as the geometry pass runs it
+    const int Count = 1024;
+    static matrix matrices[Count], products[Count];
+    static vec4 points[Count], transformed[Count], normals[Count];
+    for (int i = 0; i < Count; i++) {
+        matrices[i] = matrix::makeRotateXYZ(rng.getRandomFloat(0.f, 3.f), rng.getRandomFloat(0.f, 3.f), rng.getRandomFloat(0.f, 3.f));
+        points[i] = vec4(rng.getRandomFloat(-1.f, 1.f), rng.getRandomFloat(-1.f, 1.f), rng.getRandomFloat(-1.f, 1.f));
+        normals[i] = vec4(rng.getRandomFloat(-1.f, 1.f), rng.getRandomFloat(-1.f, 1.f), rng.getRandomFloat(0.1f, 1.f), 0.f);
+    }
+    matrix view = matrix::makeTranslation(0.f, 0.f, -5.f) * matrices[0];
+    benchmarks.push_back({ "matrix * matrix", "multiply", Count, [view] {
+        for (int i = 0; i < Count; i++) products[i] = view * matrices[i];
+        keep(products);
+    } });
+    matrix projection = renderer.perspective;
+    benchmarks.push_back({ "matrixColumns * vec4", "vertex", Count, [view, projection] {
+        matrixColumns columns(projection * view);
+        for (int i = 0; i < Count; i++) transformed[i] = columns * points[i];
+        keep(transformed);
+    } });
+    benchmarks.push_back({ "matrix * vec4", "vertex", Count, [view] {
+        for (int i = 0; i < Count; i++) transformed[i] = view * points[i];
+        keep(transformed);
+    } });
+    benchmarks.push_back({ "vec4::normalise", "vector", Count, [] {
+        for (int i = 0; i < Count; i++) {
+            transformed[i] = normals[i];
+            transformed[i].normalise();
+        }
+        keep(transformed);
+    } });
+    benchmarks.push_back({ "vec4::normaliseFast", "vector", Count, [] {
+        for (int i = 0; i < Count; i++) {
+            transformed[i] = normals[i];
+            transformed[i].normaliseFast();
+        }
+        keep(transformed);
+    } });
+    benchmarks.push_back({ "vec4::cross", "vector", Count, [] {
+        for (int i = 0; i < Count; i++) transformed[i] = vec4::cross(points[i], normals[i]);
+        keep(transformed);
+    } });
+
+    // Clears of the full-size buffers
+    double pixels = static_cast<double>(width) * height;
+    benchmarks.push_back({ "Zbuffer::clear", "pixel", pixels, [&renderer] {
+        renderer.zbuffer.clear();
+        keep(renderer.zbuffer);
+    } });
+    benchmarks.push_back({ "framebuffer clear", "pixel", pixels, [&renderer] {
+        renderer.canvas.clear();
+        keep(renderer.canvas);
+    } });
+
+    // Binning of render(): triangles of typical heights spread over the canvas strips
+    const unsigned int BinTriangles = 100000;
+    static StripLayout strips;
+    strips.uniform(height, jobs().getThreadCount() * StripsPerThread);
+    static std::vector<BinRange> ranges(BinTriangles);
+    for (BinRange& range : ranges) {
+        float top = rng.getRandomFloat(0.f, static_cast<float>(height));
+        range = binRange(top, top + std::pow(10.f, rng.getRandomFloat(0.f, 2.5f)), strips);
+    }
+    static FrameArena binArena(16 << 20);
+    benchmarks.push_back({ "buildBins", "triangle", BinTriangles, [] {
+        binArena.reset();
+        Bins bins;
+        buildBins(binArena, ranges.data(), BinTriangles, strips.getCount(), bins);
+        keep(bins);
+    } });
+
+    // Mesh generation, allocation included
+    Mesh probe = Mesh::makeSphere(1.0f, 40, 80);
+    benchmarks.push_back({ "Mesh::makeSphere 40x80", "triangle", static_cast<double>(probe.triangles.size()), [] {
+        Mesh sphere = Mesh::makeSphere(1.0f, 40, 80);
+        keep(sphere);
+    } });
+
+    renderer.zPrepass = true;
+    renderer.clear();
+    std::cout << "SIMD " << (RASTER_SIMD ? "on" : "off") << ", " << jobs().getThreadCount() << " thread(s), median of " << Repetitions << " batches\n";
+    std::vector<BenchmarkResult> results;
+    for (const Benchmark& benchmark : benchmarks) {
+        if (benchmark.name.find(filter) == std::string::npos) continue;
+        BenchmarkResult r = measure(benchmark);
+        results.push_back(r);
+        std::cout << r.name << ": " << r.medianNs << " ns (min " << r.minNs << ", mad " << r.madNs << "), "
+            << r.nsPerUnit() << " ns/" << r.unit << std::endl;
+    }
+    if (jsonPath && !writeJson(jsonPath, results, jobs().getThreadCount())) {
+        std::cout << "Could not write " << jsonPath << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "vec4.h"
+#include "matrix.h"
+
+// View volume as six planes, for culling bounds before any vertex is transformed
+struct Frustum {
+    enum class Result { Outside, Intersects, Inside };
+
+    vec4 planes[6];     // (a, b, c, d) with a*x + b*y + c*z + d >= 0 inside and (a, b, c) of unit length
+
+    // Extracts the planes of a projection * view matrix. Clip space is that of makePerspective and
+    // makeOrthographic: -w <= x, y <= w and 0 <= z <= w.
+    // Input Variables:
+    // - m: World to clip space transform
+    static Frustum fromMatrix(const matrix& m) {
+        Frustum f;
+        for (unsigned int c = 0; c < 4; c++) {
+            f.planes[0][c] = m(3, c) + m(0, c);     // Left
+            f.planes[1][c] = m(3, c) - m(0, c);     // Right
+            f.planes[2][c] = m(3, c) + m(1, c);     // Bottom
+            f.planes[3][c] = m(3, c) - m(1, c);     // Top
+            f.planes[4][c] = m(2, c);               // Near
+            f.planes[5][c] = m(3, c) - m(2, c);     // Far
+        }
+        for (vec4& p : f.planes) {
+            float length = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+            for (unsigned int c = 0; c < 4; c++) p[c] /= length;
+        }
+        return f;
+    }
+
+    // Tests an axis-aligned box
+    // Input Variables:
+    // - lo, hi: Corners of the box
+    // Returns whether the box is wholly outside, wholly inside or crosses a plane
+    Result testBox(const float lo[3], const float hi[3]) const {
+        Result result = Result::Inside;
+        for (const vec4& p : planes) {
+            // Distances of the corners furthest along and against the plane normal
+            float far = p[3], near = p[3];
+            for (unsigned int c = 0; c < 3; c++) {
+                far += p[c] * (p[c] >= 0.f ? hi[c] : lo[c]);
+                near += p[c] * (p[c] >= 0.f ? lo[c] : hi[c]);
+            }
+            if (far < 0.f) return Result::Outside;
+            if (near < 0.f) result = Result::Intersects;
+        }
+        return result;
+    }
+
+    // Tests whether a sphere lies wholly outside
+    bool outside(const vec4& centre, float radius) const {
+        for (const vec4& p : planes) {
+            if (p[0] * centre[0] + p[1] * centre[1] + p[2] * centre[2] + p[3] < -radius) return true;
+        }
+        return false;
+    }
+};
+
+// Bounding volume hierarchy over objects given as bounding spheres, built for objects that move
+// every frame. refit() updates the boxes bottom-up in one pass over the nodes, and then rebuilds
+// the subtrees whose split has worn out, a few each call, so the tree stays tight without a full
+// rebuild. Every subtree splits its objects at the median, so the nodes a subtree takes up depend
+// only on how many objects it has and a subtree can be rebuilt in place.
+class ObjectBVH {
+public:
+    static const int LeafSize = 4;              // Most objects in a leaf
+    static constexpr float RebuildRatio = 1.3f; // Growth of a node's split cost that marks it worn out
+
+private:
+    struct Node {
+        float lo[3], hi[3];     // Bounds of the objects below
+        int first;              // First entry of items below the node, a subtree's entries are contiguous
+        int count;              // Objects below; the node is a leaf when count <= LeafSize
+        int skip;               // Index of the next node after the subtree; the left child is the next node
+        float builtCost;        // Split cost when the subtree was last built, see splitCost()
+    };
+
+    std::vector<Node> nodes;    // In depth-first order, parents before children
+    std::vector<int> items;     // Object indices, grouped by leaf
+    std::vector<vec4> spheres;  // Centre and radius (in w) of every object
+
+    static float area(const Node& n) {
+        float dx = n.hi[0] - n.lo[0], dy = n.hi[1] - n.lo[1], dz = n.hi[2] - n.lo[2];
+        return dx * dy + dy * dz + dz * dx;
+    }
+
+    // Surface area of the children relative to their parent: about 1 for a clean split, up to 2
+    // when the children overlap completely
+    float splitCost(int node) const {
+        const Node& n = nodes[node];
+        float a = area(n);
+        return a > 0.f ? (area(nodes[node + 1]) + area(nodes[nodes[node + 1].skip])) / a : 1.f;
+    }
+
+    // Sets a node's bounds to its objects' or its children's
+    void fit(int node) {
+        Node& n = nodes[node];
+        if (n.count <= LeafSize) {
+            for (int c = 0; c < 3; c++) {
+                n.lo[c] = n.count ? INFINITY : 0.f;
+                n.hi[c] = n.count ? -INFINITY : 0.f;
+            }
+            for (int i = n.first; i < n.first + n.count; i++) {
+                const vec4& s = spheres[items[i]];
+                for (int c = 0; c < 3; c++) {
+                    n.lo[c] = std::min(n.lo[c], s[c] - s[3]);
+                    n.hi[c] = std::max(n.hi[c], s[c] + s[3]);
+                }
+            }
+            return;
+        }
+        const Node& l = nodes[node + 1];
+        const Node& r = nodes[l.skip];
+        for (int c = 0; c < 3; c++) {
+            n.lo[c] = std::min(l.lo[c], r.lo[c]);
+            n.hi[c] = std::max(l.hi[c], r.hi[c]);
+        }
+    }
+
+    // Builds the subtree of count objects from items[first] at nodes[node]
+    // Returns the index after the subtree
+    int build(int node, int first, int count) {
+        Node& n = nodes[node];
+        n.first = first;
+        n.count = count;
+        if (count <= LeafSize) {
+            n.skip = node + 1;
+            fit(node);
+            n.builtCost = 1.f;
+            return n.skip;
+        }
+
+        // Split at the median along the longest axis of the centres
+        float lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+        for (int i = first; i < first + count; i++) {
+            for (int c = 0; c < 3; c++) {
+                lo[c] = std::min(lo[c], spheres[items[i]][c]);
+                hi[c] = std::max(hi[c], spheres[items[i]][c]);
+            }
+        }
+        int axis = 0;
+        for (int c = 1; c < 3; c++) {
+            if (hi[c] - lo[c] > hi[axis] - lo[axis]) axis = c;
+        }
+        int half = count / 2;
+        std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count,
+            [this, axis](int a, int b) { return spheres[a][axis] < spheres[b][axis]; });
+
+        int right = build(node + 1, first, half);
+        int end = build(right, first + half, count - half);
+        nodes[node].skip = end;
+        fit(node);
+        nodes[node].builtCost = splitCost(node);
+        return end;
+    }
+
+    // Nodes taken up by a subtree of count objects
+    static int nodesFor(int count) {
+        return count <= LeafSize ? 1 : 1 + nodesFor(count / 2) + nodesFor(count - count / 2);
+    }
+
+public:
+    // Builds the hierarchy from scratch
+    // Input Variables:
+    // - bounds: Bounding sphere of every object, centre in x, y, z and radius in w
+    // - count: Number of objects
+    void build(const vec4* bounds, int count) {
+        spheres.assign(bounds, bounds + count);
+        items.resize(count);
+        for (int i = 0; i < count; i++) items[i] = i;
+        nodes.resize(nodesFor(count));
+        build(0, 0, count);
+    }
+
+    // Moves the objects: refits every box, then rebuilds worn-out subtrees, the largest first,
+    // until about a quarter of the objects have been resorted
+    // Input Variables:
+    // - bounds: New bounding sphere of every object, in the order given to build()
+    void refit(const vec4* bounds) {
+        std::copy(bounds, bounds + spheres.size(), spheres.begin());
+        for (int node = static_cast<int>(nodes.size()) - 1; node >= 0; node--) fit(node);
+
+        int budget = std::max(static_cast<int>(spheres.size()) / 4, 64 * LeafSize);
+        for (int node = 0; node < static_cast<int>(nodes.size());) {
+            const Node& n = nodes[node];
+            if (n.count > LeafSize && n.count <= budget && splitCost(node) > n.builtCost * RebuildRatio) {
+                budget -= n.count;
+                node = build(node, n.first, n.count); // Same objects, so the same bounds as the refit gave
+            }
+            else node++;
+        }
+    }
+
+    // Lists the objects whose spheres are not wholly outside a frustum. Subtrees wholly inside
+    // are listed without further tests, so the cost follows the nodes crossing the frustum's
+    // planes rather than the number of objects.
+    // Input Variables:
+    // - frustum: View volume
+    // - visible: Called with the index of every object found
+    template <typename F>
+    void cull(const Frustum& frustum, F&& visible) const {
+        if (nodes.empty() || spheres.empty()) return;
+        int stack[64];      // Median splits keep the depth to log2 of the object count
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& n = nodes[stack[--top]];
+            Frustum::Result result = frustum.testBox(n.lo, n.hi);
+            if (result == Frustum::Result::Outside) continue;
+            if (result == Frustum::Result::Inside) {
+                for (int i = n.first; i < n.first + n.count; i++) visible(items[i]);
+                continue;
+            }
+            if (n.count <= LeafSize) {
+                for (int i = n.first; i < n.first + n.count; i++) {
+                    const vec4& s = spheres[items[i]];
+                    if (!frustum.outside(s, s[3])) visible(items[i]);
+                }
+                continue;
+            }
+            int node = static_cast<int>(&n - nodes.data());
+            stack[top++] = nodes[node + 1].skip;
+            stack[top++] = node + 1;
+        }
+    }
+
+    // Lists the objects whose spheres are not wholly outside a frustum and whose bounds are not
+    // hidden by a further test, e.g. against an occlusion buffer. Subtrees wholly inside the
+    // frustum skip its planes but are still descended into for the test.
+    // Input Variables:
+    // - frustum: View volume
+    // - hidden: Called with the corners of a box, returns true when everything in it is hidden
+    // - visible: Called with the index of every object found
+    template <typename H, typename F>
+    void cull(const Frustum& frustum, H&& hidden, F&& visible) const {
+        if (nodes.empty() || spheres.empty()) return;
+        int stack[64];
+        bool inside[64];    // Whether the entry's parent was wholly inside the frustum
+        int top = 0;
+        stack[top] = 0;
+        inside[top++] = false;
+        while (top > 0) {
+            --top;
+            const Node& n = nodes[stack[top]];
+            bool within = inside[top];
+            if (!within) {
+                Frustum::Result result = frustum.testBox(n.lo, n.hi);
+                if (result == Frustum::Result::Outside) continue;
+                within = result == Frustum::Result::Inside;
+            }
+            if (hidden(n.lo, n.hi)) continue;
+            if (n.count <= LeafSize) {
+                for (int i = n.first; i < n.first + n.count; i++) {
+                    const vec4& s = spheres[items[i]];
+                    if (!within && frustum.outside(s, s[3])) continue;
+                    float lo[3] = { s[0] - s[3], s[1] - s[3], s[2] - s[3] };
+                    float hi[3] = { s[0] + s[3], s[1] + s[3], s[2] + s[3] };
+                    if (n.count == 1 || !hidden(lo, hi)) visible(items[i]);
+                }
+                continue;
+            }
+            int node = static_cast<int>(&n - nodes.data());
+            stack[top] = nodes[node + 1].skip;
+            inside[top++] = within;
+            stack[top] = node + 1;
+            inside[top++] = within;
+        }
+    }
+
+    // Bounding sphere of an object as last given to build() or refit(), radius in w
+    const vec4& bounds(int object) const { return spheres[object]; }
+
+    int size() const { return static_cast<int>(spheres.size()); }
+};
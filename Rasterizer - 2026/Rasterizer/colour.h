@@ -2,17 +2,27 @@
 
 #include <cmath>
 #include <cstdint>
+#include "simd.h"
 
 // The `colour` class represents an RGB colour with floating-point precision.
 // It provides various utilities for manipulating and converting colours.
-class colour {
+// With RASTER_SIMD the components are padded to one 16-byte aligned SSE register.
+class alignas(16) colour {
     union {
         struct {
             float r, g, b; // Red, Green, and Blue components of the colour
         };
         float rgb[3];     // Array representation of the RGB components
+#if RASTER_SIMD
+        __m128 m;         // SSE register view, the fourth lane is padding kept at 0
+#endif
     };
 
+#if RASTER_SIMD
+    // Constructor wrapping an SSE register
+    explicit colour(__m128 _m) : m(_m) {}
+#endif
+
 public:
     // Enum for indexing the RGB components
     enum Colour { RED = 0, GREEN = 1, BLUE = 2 };
@@ -23,7 +33,11 @@ public:
     // - _r: Red component (default 0.0f)
     // - _g: Green component (default 0.0f)
     // - _b: Blue component (default 0.0f)
+#if RASTER_SIMD
+    colour(float _r = 0, float _g = 0, float _b = 0) : m(_mm_setr_ps(_r, _g, _b, 0.f)) {}
+#else
     colour(float _r = 0, float _g = 0, float _b = 0) : r(_r), g(_g), b(_b) {}
+#endif
 
     // Sets the RGB components of the colour.
     // Input Variables:
@@ -42,16 +56,24 @@ public:
     // Input Variables:
     // - c: The source color
     void operator = (colour c) {
+#if RASTER_SIMD
+        m = c.m;
+#else
         r = c.r;
         g = c.g;
         b = c.b;
+#endif
     }
 
     // Clamps the RGB components of the colour to the range [0, 1].
     void clampColour() {
+#if RASTER_SIMD
+        m = _mm_min_ps(m, _mm_set1_ps(1.0f));
+#else
         r = std::min(r, 1.0f);
         g = std::min(g, 1.0f);
         b = std::min(b, 1.0f);
+#endif
     }
 
     // Converts the floating-point RGB values to integer values (0-255).
@@ -70,11 +92,15 @@ public:
     // - scalar: The scaling factor
     // Returns a new `colour` object with scaled components.
     colour operator * (const float scalar) {
+#if RASTER_SIMD
+        return colour(_mm_mul_ps(m, _mm_set1_ps(scalar)));
+#else
         colour c;
         c.r = r * scalar;
         c.g = g * scalar;
         c.b = b * scalar;
         return c;
+#endif
     }
 
     // Multiplies the RGB components of this colour with another colour.
@@ -82,11 +108,15 @@ public:
     // - col: The other color to multiply with
     // Returns a new `colour` object with multiplied components.
     colour operator * (const colour& col) {
+#if RASTER_SIMD
+        return colour(_mm_mul_ps(m, col.m));
+#else
         colour c;
         c.r = r * col.r;
         c.g = g * col.g;
         c.b = b * col.b;
         return c;
+#endif
     }
 
     // Adds the RGB components of another colour to this one.
@@ -94,10 +124,14 @@ public:
     // - _c: The other colour to add
     // Returns a new `colour` object with added components.
     colour operator + (const colour& _c) {
+#if RASTER_SIMD
+        return colour(_mm_add_ps(m, _c.m));
+#else
         colour c;
         c.r = r + _c.r;
         c.g = g + _c.g;
         c.b = b + _c.b;
         return c;
+#endif
     }
 };
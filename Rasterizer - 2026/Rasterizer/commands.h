@@ -0,0 +1,124 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "mesh.h"
+#include "affine.h"
+#include "arena.h"
+#include "jobs.h"
+
+// Passes a draw takes part in, combined as bits
+enum DrawPass : unsigned char {
+    PassMain = 1 << 0,      // Shaded into the canvas
+    PassShadow = 1 << 1,    // Casts shadows into the light's shadow map
+    PassAll = PassMain | PassShadow
+};
+
+// Surface parameters of a draw, taken from the mesh unless the caller overrides them
+struct Material {
+    float ka;               // Ambient reflection coefficient
+    float kd;               // Diffuse reflection coefficient
+    ShadingRate rate;       // Rate at which lighting is evaluated
+
+    // Parameters the mesh itself carries
+    static Material of(const Mesh& mesh) { return { mesh.ka, mesh.kd, mesh.shadingRate }; }
+};
+
+// One recorded draw: a mesh placed in the world with a material. The mesh and transform are
+// referenced, not copied, so recording a draw writes a few dozen bytes whatever the mesh size.
+struct DrawCommand {
+    const Mesh* mesh;       // Geometry; may be shared by many draws
+    const affine* world;    // Object to world transform, valid until render() returns
+    vec4* motion;           // Screen position last frame for ShadingRate::Auto, nullptr to judge by distance only
+    float ka, kd;
+    unsigned int key;       // Draws run in increasing key order
+    ShadingRate rate;
+    unsigned char passes;   // DrawPass bits
+};
+
+// Draws of one frame, sorted, as the passes consume them
+struct DrawList {
+    const DrawCommand* draws = nullptr;
+    size_t count = 0;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const DrawCommand& operator[](size_t i) const { return draws[i]; }
+    const DrawCommand* begin() const { return draws; }
+    const DrawCommand* end() const { return draws + count; }
+};
+
+// Draws recorded by one thread. Storage is kept between frames, so recording allocates only
+// while a buffer grows to its largest frame.
+class CommandBuffer {
+    std::vector<DrawCommand> commands;
+    FrameArena transforms{ 64 << 10 };  // Copies of transforms recorded by value
+
+public:
+    // Records a draw whose transform is kept by the caller, e.g. Mesh::world
+    // Input Variables:
+    // - mesh: Mesh to draw, must stay alive and unchanged until render() returns
+    // - world: Object to world transform, must stay valid until render() returns
+    // - material: Surface parameters
+    // - key: Sort key; distinct keys (e.g. object indices) make the frame independent of which
+    //        thread recorded which draw
+    // - passes: DrawPass bits
+    // - motion: Per-object state for ShadingRate::Auto, updated by render(); nullptr if there is none.
+    //   No two draws of a frame may share it, as their set-up runs in parallel
+    void draw(const Mesh& mesh, const affine* world, const Material& material, unsigned int key, unsigned char passes = PassAll, vec4* motion = nullptr) {
+        commands.push_back({ &mesh, world, motion, material.ka, material.kd, key, material.rate, passes });
+    }
+
+    // Records a draw with a transform computed while recording; the transform is copied
+    // Input Variables:
+    // - mesh: Mesh to draw, must stay alive and unchanged until render() returns
+    // - world: Object to world transform
+    // - material, key, passes: As above
+    void draw(const Mesh& mesh, const affine& world, const Material& material, unsigned int key, unsigned char passes = PassAll) {
+        affine* copy = transforms.allocate<affine>();
+        *copy = world;
+        draw(mesh, copy, material, key, passes);
+    }
+
+    // Forgets every draw
+    void reset() {
+        commands.clear();
+        transforms.reset();
+    }
+
+    size_t size() const { return commands.size(); }
+    const DrawCommand* data() const { return commands.data(); }
+};
+
+// Command buffers of every job system thread, so any number of threads record at once without
+// synchronising. render() merges the buffers and sorts the draws by key.
+class CommandQueue {
+    std::vector<std::unique_ptr<CommandBuffer>> buffers;
+
+public:
+    // Starts a frame: forgets the last frame's draws and makes sure every thread has a buffer.
+    // Call from the main thread before recording.
+    // Input Variables:
+    // - threads: Number of job system threads
+    void begin(int threads) {
+        while (static_cast<int>(buffers.size()) < threads) buffers.push_back(std::make_unique<CommandBuffer>());
+        for (std::unique_ptr<CommandBuffer>& buffer : buffers) buffer->reset();
+    }
+
+    // Buffer of the calling job system thread; threads outside the job system share the main
+    // thread's buffer and must not record while it does
+    CommandBuffer& local() {
+        return *buffers[std::max(JobSystem::currentThread(), 0)];
+    }
+
+    int getBufferCount() const { return static_cast<int>(buffers.size()); }
+    const CommandBuffer& buffer(int i) const { return *buffers[i]; }
+
+    // Number of draws recorded since begin()
+    size_t size() const {
+        size_t n = 0;
+        for (const std::unique_ptr<CommandBuffer>& buffer : buffers) n += buffer->size();
+        return n;
+    }
+};
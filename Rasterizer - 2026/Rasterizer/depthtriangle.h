@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include "vec4.h"
+#include "zbuffer.h"
+
+// Triangle that only carries screen-space positions, used by depth-only passes
+// (Z pre-pass, shadow maps). No colours or normals are interpolated; the only output is depth.
+// The edge and depth stepping mirrors triangle::draw exactly so a pre-pass produces the
+// same depth values as the shading pass that follows it.
+class depthTriangle {
+    vec4 p[3];         // Screen-space positions (x, y in pixels, z in [0, 1])
+    float area;        // Signed 2D area; positive for triangles that face the viewer
+
+public:
+    // Constructor initializes the triangle from three screen-space positions
+    // Input Variables:
+    // - p0, p1, p2: Positions after projection, perspective divide and viewport mapping
+    depthTriangle(const vec4& p0, const vec4& p1, const vec4& p2) {
+        p[0] = p0;
+        p[1] = p1;
+        p[2] = p2;
+
+        float e1x = p[1][0] - p[0][0], e1y = p[1][1] - p[0][1];
+        float e2x = p[2][0] - p[0][0], e2y = p[2][1] - p[0][1];
+        area = e1x * e2y - e1y * e2x;
+    }
+
+    // Smallest and largest row covered by the triangle, used for binning into strips
+    float minY() const { return std::min({ p[0][1], p[1][1], p[2][1] }); }
+    float maxY() const { return std::max({ p[0][1], p[1][1], p[2][1] }); }
+
+    // Rasterize the triangle into a depth buffer
+    // Input Variables:
+    // - zb: Depth buffer to test against and write to, its size defines the viewport
+    // - constantBias: Offset added to every depth value written
+    // - slopeBias: Offset scaled by the depth change across one diagonal pixel, to fight acne on sloped surfaces
+    // - minY, maxY: Rows of the buffer this call may write to
+    void draw(Zbuffer<float>& zb, float constantBias, float slopeBias, int minY, int maxY) const {
+        // Back-facing triangles have negative area and never pass the coverage test in
+        // triangle::draw, so they are skipped here too
+        if (area < 1.f) return;
+
+        float minX = std::max(std::min({ p[0][0], p[1][0], p[2][0] }), 0.f);
+        float maxX = std::min(std::max({ p[0][0], p[1][0], p[2][0] }), static_cast<float>(zb.getWidth()));
+        float minYf = std::max(this->minY(), 0.f);
+        float maxYf = std::min(this->maxY(), static_cast<float>(zb.getHeight()));
+
+        int startY = std::max((int)std::floor(minYf), minY);
+        int endY = std::min((int)std::ceil(maxYf), maxY);
+        int startX = (int)std::floor(minX);
+        int endX = (int)std::ceil(maxX);
+
+        float invArea = 1.0f / area;
+
+        float da_dx = (p[0][1] - p[1][1]) * invArea;
+        float da_dy = (p[1][0] - p[0][0]) * invArea;
+
+        float db_dx = (p[1][1] - p[2][1]) * invArea;
+        float db_dy = (p[2][0] - p[1][0]) * invArea;
+
+        float dg_dx = (p[2][1] - p[0][1]) * invArea;
+        float dg_dy = (p[0][0] - p[2][0]) * invArea;
+
+        float dDepth_dx = db_dx * p[0][2] + dg_dx * p[1][2] + da_dx * p[2][2];
+        float dDepth_dy = db_dy * p[0][2] + dg_dy * p[1][2] + da_dy * p[2][2];
+        float bias = constantBias + slopeBias * (std::fabs(dDepth_dx) + std::fabs(dDepth_dy));
+
+        for (int y = startY; y < endY; y++) {
+            // Exact coordinates per row, as in triangle::draw
+            float alpha = edge(p[0], p[1], (float)startX, (float)y) / area;
+            float beta = edge(p[1], p[2], (float)startX, (float)y) / area;
+            float gamma = edge(p[2], p[0], (float)startX, (float)y) / area;
+            float depth = beta * p[0][2] + gamma * p[1][2] + alpha * p[2][2];
+
+            for (int x = startX; x < endX; x++) {
+                if (alpha >= 0.f && beta >= 0.f && gamma >= 0.f) {
+                    float z = depth + bias;
+                    if (zb(x, y) > z && depth > 0.001f) {
+                        zb(x, y) = z;
+                    }
+                }
+                alpha += da_dx; beta += db_dx; gamma += dg_dx;
+                depth += dDepth_dx;
+            }
+        }
+    }
+
+private:
+    // Edge function matching triangle::getC
+    static float edge(const vec4& v1, const vec4& v2, float px, float py) {
+        float ex = v2[0] - v1[0], ey = v2[1] - v1[1];
+        float qx = px - v1[0], qy = py - v1[1];
+        return qy * ex - qx * ey;
+    }
+};
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <new>
+#include <cassert>
+#include <algorithm>
+#include <type_traits>
+#include <initializer_list>
+#include "arena.h"
+#include "jobs.h"
+#include "profiler.h"
+
+// Declarative scheduling of the passes of one frame.
+// Every pass names the resources it reads and writes. Resources are either imported (buffers that
+// outlive the frame, such as a depth buffer or the canvas) or transient (scratch memory that only
+// this frame's passes use, provided by the graph). execute() orders passes that touch the same
+// resource the way they were added: a reader runs after the last writer, a writer after the last
+// writer and every reader since. Passes without a path between them run at the same time on the
+// job system, each started as soon as the passes it depends on have finished. Transient resources
+// share memory when every pass using one finishes before any pass using the other starts.
+// The graph is declared again every frame into fixed-size tables, so it never allocates.
+class FrameGraph {
+public:
+    using Resource = int;
+    using PassId = int;
+
+    static const int MaxPasses = 32;
+    static const int MaxResources = 32;
+    static const int MaxAccesses = 8;       // Reads or writes per pass
+    static const int PassStorage = 64;      // Bytes available for each pass's callable
+    static const Resource None = -1;        // Placeholder for a resource that is not used this frame
+
+private:
+    using Mask = uint32_t;                  // One bit per pass
+    static_assert(MaxPasses <= 32, "pass masks are 32 bits");
+
+    struct ResourceInfo {
+        const char* name;
+        size_t bytes;                       // Size of a transient, 0 for imported resources
+        size_t offset;                      // Position of a transient in the frame's block
+        Mask users;                         // Passes that read or write it
+    };
+
+    struct Pass {
+        const char* name;
+        void (*call)(void*);
+        alignas(16) std::byte storage[PassStorage];    // The callable, copied in by addPass()
+        Resource reads[MaxAccesses];
+        Resource writes[MaxAccesses];
+        int readCount, writeCount;
+        Mask dependents;                    // Passes that wait for this one
+        Mask ancestors;                     // Passes that finish before this one starts
+        int dependencies;                   // Number of passes this one waits for
+        std::atomic<int> remaining;         // Dependencies still running during execute()
+        float seconds;                      // Wall time of the last run
+        FrameGraph* graph;
+
+        void operator()() { graph->runPass(*this); }
+    };
+
+    Pass passes[MaxPasses];
+    ResourceInfo resources[MaxResources];
+    int passCount = 0;
+    int resourceCount = 0;
+    std::byte* transientBlock = nullptr;
+    size_t transientBytes = 0;
+    JobSystem* jobs = nullptr;
+    JobSystem::Group group;
+
+public:
+    FrameGraph() = default;
+    FrameGraph(const FrameGraph&) = delete;
+    FrameGraph& operator=(const FrameGraph&) = delete;
+
+    // Declares a buffer owned outside the graph
+    // Input Variables:
+    // - name: Label used in diagnostics, must outlive the graph
+    Resource importResource(const char* name) {
+        return addResource(name, 0);
+    }
+
+    // Declares scratch memory that lives only while this frame's passes run
+    // Input Variables:
+    // - name: Label used in diagnostics, must outlive the graph
+    // - bytes: Size of the memory
+    Resource createTransient(const char* name, size_t bytes) {
+        return addResource(name, bytes);
+    }
+
+    // Memory of a transient resource, valid inside the passes that declared it
+    // Input Variables:
+    // - resource: Transient returned by createTransient()
+    template<typename T>
+    T* get(Resource resource) const {
+        return reinterpret_cast<T*>(transientBlock + resources[resource].offset);
+    }
+
+    // Adds a pass. Passes are ordered by the resources they share, in the order they are added.
+    // Input Variables:
+    // - name: Label used in diagnostics and timings, must outlive the graph
+    // - reads: Resources the pass reads; None entries are ignored
+    // - writes: Resources the pass writes; None entries are ignored
+    // - execute: Callable taking no arguments, copied into the graph. It must be trivially
+    //            destructible (e.g. a lambda capturing references and pointers) and runs on any thread.
+    // Returns the pass id, for passSeconds()
+    template<typename F>
+    PassId addPass(const char* name, std::initializer_list<Resource> reads, std::initializer_list<Resource> writes, F&& execute) {
+        using Body = std::decay_t<F>;
+        static_assert(sizeof(Body) <= PassStorage && alignof(Body) <= 16, "pass callable too large, capture by reference");
+        static_assert(std::is_trivially_destructible_v<Body>, "pass callable is never destroyed");
+        assert(passCount < MaxPasses && reads.size() <= MaxAccesses && writes.size() <= MaxAccesses);
+
+        Pass& pass = passes[passCount];
+        pass.name = name;
+        new (pass.storage) Body(static_cast<F&&>(execute));
+        pass.call = [](void* body) { (*static_cast<Body*>(body))(); };
+        pass.readCount = pass.writeCount = 0;
+        for (Resource r : reads) if (r != None) pass.reads[pass.readCount++] = r;
+        for (Resource r : writes) if (r != None) pass.writes[pass.writeCount++] = r;
+        pass.seconds = 0.f;
+        pass.graph = this;
+        return passCount++;
+    }
+
+    // Orders the passes, places the transients in one block from the arena and runs every pass,
+    // returning when all have finished. The calling thread helps with the work.
+    // Input Variables:
+    // - jobSystem: Job system the passes run on
+    // - arena: Arena holding the transient memory, which is not released by the graph
+    void execute(JobSystem& jobSystem, FrameArena& arena) {
+        jobs = &jobSystem;
+        buildDependencies();
+        placeTransients();
+        transientBlock = transientBytes ? arena.allocate<std::byte>(transientBytes) : nullptr;
+
+        for (int p = 0; p < passCount; p++) {
+            passes[p].remaining.store(passes[p].dependencies, std::memory_order_relaxed);
+        }
+        for (int p = 0; p < passCount; p++) {
+            if (passes[p].dependencies == 0) jobs->run(group, passes[p]);
+        }
+        jobs->wait(group);
+    }
+
+    int getPassCount() const { return passCount; }
+    const char* passName(PassId pass) const { return passes[pass].name; }
+    float passSeconds(PassId pass) const { return passes[pass].seconds; }   // Wall time of the pass in the last execute()
+    size_t getTransientBytes() const { return transientBytes; }             // Size of the aliased transient block
+
+    // True when pass a always finishes before pass b starts
+    bool before(PassId a, PassId b) const { return (passes[b].ancestors >> a) & 1u; }
+
+private:
+    Resource addResource(const char* name, size_t bytes) {
+        assert(resourceCount < MaxResources);
+        resources[resourceCount] = { name, bytes, 0, 0 };
+        return resourceCount++;
+    }
+
+    // Derives the edges from the access lists, in the order the passes were added
+    void buildDependencies() {
+        int lastWriter[MaxResources];
+        Mask readers[MaxResources];
+        std::fill(lastWriter, lastWriter + resourceCount, -1);
+        std::fill(readers, readers + resourceCount, Mask(0));
+
+        for (int p = 0; p < passCount; p++) {
+            passes[p].dependents = 0;
+            passes[p].ancestors = 0;
+            passes[p].dependencies = 0;
+        }
+        for (int p = 0; p < passCount; p++) {
+            Pass& pass = passes[p];
+            Mask waitFor = 0;
+            for (int i = 0; i < pass.readCount; i++) {
+                Resource r = pass.reads[i];
+                if (lastWriter[r] >= 0) waitFor |= Mask(1) << lastWriter[r];
+                readers[r] |= Mask(1) << p;
+                resources[r].users |= Mask(1) << p;
+            }
+            for (int i = 0; i < pass.writeCount; i++) {
+                Resource r = pass.writes[i];
+                if (lastWriter[r] >= 0) waitFor |= Mask(1) << lastWriter[r];
+                waitFor |= readers[r];
+                lastWriter[r] = p;
+                readers[r] = 0;
+                resources[r].users |= Mask(1) << p;
+            }
+            waitFor &= ~(Mask(1) << p);
+
+            for (int d = 0; d < p; d++) {
+                if (!((waitFor >> d) & 1u)) continue;
+                passes[d].dependents |= Mask(1) << p;
+                pass.ancestors |= passes[d].ancestors | (Mask(1) << d);
+                pass.dependencies++;
+            }
+        }
+    }
+
+    // True when every pass using resource a is an ancestor of every pass using resource b
+    bool finishesBefore(const ResourceInfo& a, const ResourceInfo& b) const {
+        for (int p = 0; p < passCount; p++) {
+            if (((b.users >> p) & 1u) && (passes[p].ancestors & a.users) != a.users) return false;
+        }
+        return true;
+    }
+
+    // First-fit placement of the transients: a transient may overlap the memory of earlier ones
+    // only when their lifetimes can never overlap in any order the job system runs the passes
+    void placeTransients() {
+        const size_t Align = 16;
+        transientBytes = 0;
+        int placed[MaxResources];
+        int placedCount = 0;
+        for (int r = 0; r < resourceCount; r++) {
+            ResourceInfo& res = resources[r];
+            if (res.bytes == 0 || res.users == 0) continue;
+            size_t bytes = (res.bytes + Align - 1) & ~(Align - 1);
+
+            // Candidate offsets: the start of the block and the end of every placed transient
+            size_t best = SIZE_MAX;
+            for (int c = -1; c < placedCount; c++) {
+                size_t offset = c < 0 ? 0 : resources[placed[c]].offset + ((resources[placed[c]].bytes + Align - 1) & ~(Align - 1));
+                if (offset >= best) continue;
+                bool fits = true;
+                for (int k = 0; k < placedCount && fits; k++) {
+                    const ResourceInfo& other = resources[placed[k]];
+                    size_t otherEnd = other.offset + ((other.bytes + Align - 1) & ~(Align - 1));
+                    bool overlaps = offset < otherEnd && other.offset < offset + bytes;
+                    if (overlaps && !finishesBefore(other, res)) fits = false;
+                }
+                if (fits) best = offset;
+            }
+            res.offset = best;
+            placed[placedCount++] = r;
+            transientBytes = std::max(transientBytes, best + bytes);
+        }
+    }
+
+    // Job body of a pass: runs it, then starts every dependent whose inputs are now all ready
+    void runPass(Pass& pass) {
+        long long start = Profiler::now();
+        pass.call(pass.storage);
+        long long end = Profiler::now();
+        pass.seconds = 1e-9f * static_cast<float>(end - start);
+#if RASTER_PROFILE
+        Profiler::record(pass.name, start, end);
+#endif
+
+        for (int d = 0; d < passCount; d++) {
+            if (!((pass.dependents >> d) & 1u)) continue;
+            if (passes[d].remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) jobs->run(group, passes[d]);
+        }
+    }
+};
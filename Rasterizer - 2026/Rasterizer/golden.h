@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdlib>
+#include <algorithm>
+#include "GamesEngineeringBase.h"
+
+// RGB image held in memory, for comparing rendered frames with stored references
+struct Image {
+    int width = 0, height = 0;
+    std::vector<unsigned char> rgb;     // 3 bytes per pixel, rows top to bottom
+
+    // Copies the back buffer of a canvas
+    // Input Variables:
+    // - canvas: Window whose back buffer holds the frame
+    static Image capture(const GamesEngineeringBase::Window& canvas) {
+        Image image;
+        image.width = static_cast<int>(canvas.getWidth());
+        image.height = static_cast<int>(canvas.getHeight());
+        const unsigned char* pixels = canvas.getBackBuffer();
+        image.rgb.assign(pixels, pixels + static_cast<size_t>(image.width) * image.height * 3);
+        return image;
+    }
+
+    // Reads a binary PPM (P6, 8 bits per channel)
+    // Input Variables:
+    // - path: File to read
+    // Returns false when the file is missing or not such a PPM
+    bool load(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        std::string magic;
+        int maxValue = 0;
+        if (!(file >> magic >> width >> height >> maxValue) || magic != "P6" || maxValue != 255 || width <= 0 || height <= 0) return false;
+        file.get(); // Single whitespace before the pixels
+        rgb.resize(static_cast<size_t>(width) * height * 3);
+        return static_cast<bool>(file.read(reinterpret_cast<char*>(rgb.data()), rgb.size()));
+    }
+
+    // Writes a binary PPM
+    // Input Variables:
+    // - path: File to write
+    // Returns false when the file could not be written
+    bool save(const std::string& path) const {
+        std::ofstream file(path, std::ios::binary);
+        file << "P6\n" << width << " " << height << "\n255\n";
+        file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+        return static_cast<bool>(file);
+    }
+};
+
+// Outcome of compareImages()
+struct ImageComparison {
+    bool sameSize = true;
+    size_t differing = 0;       // Pixels where a channel differs by more than the tolerance
+    int maxDifference = 0;      // Largest difference of any channel
+
+    bool matches() const { return sameSize && differing == 0; }
+};
+
+// Compares two images pixel by pixel
+// Input Variables:
+// - expected: Reference image
+// - actual: Rendered image
+// - tolerance: Largest channel difference still counted as equal
+// Output Variables:
+// - diff: Optional image of the differences: the reference darkened, with every differing pixel in red
+inline ImageComparison compareImages(const Image& expected, const Image& actual, int tolerance, Image* diff = nullptr) {
+    ImageComparison result;
+    if (expected.width != actual.width || expected.height != actual.height) {
+        result.sameSize = false;
+        return result;
+    }
+    if (diff) *diff = expected;
+
+    size_t pixels = static_cast<size_t>(expected.width) * expected.height;
+    for (size_t i = 0; i < pixels; i++) {
+        const unsigned char* a = &expected.rgb[i * 3];
+        const unsigned char* b = &actual.rgb[i * 3];
+        int d = std::max({ std::abs(a[0] - b[0]), std::abs(a[1] - b[1]), std::abs(a[2] - b[2]) });
+        result.maxDifference = std::max(result.maxDifference, d);
+        if (d > tolerance) result.differing++;
+
+        if (diff) {
+            unsigned char* out = &diff->rgb[i * 3];
+            if (d > tolerance) {
+                out[0] = 255; out[1] = 0; out[2] = 0;
+            }
+            else {
+                for (int c = 0; c < 3; c++) out[c] = static_cast<unsigned char>(out[c] / 4);
+            }
+        }
+    }
+    return result;
+}
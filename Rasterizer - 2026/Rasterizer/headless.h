@@ -0,0 +1,86 @@
+#pragma once
+
+// Stand-in for GamesEngineeringBase on platforms without Windows and Direct3D, so the renderer,
+// the regression tests and the benchmarks build and run headless, e.g. on a Linux build server.
+// A window is only its back buffer: present() shows nothing and no key is ever pressed.
+// GamesEngineeringBase.h includes this instead of its Windows code when _WIN32 is not defined.
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+
+#if !defined(VK_ESCAPE)
+#define VK_ESCAPE 0x1B
+#endif
+
+namespace GamesEngineeringBase
+{
+    class Window
+    {
+        std::vector<unsigned char> image;   // Back buffer, 3 bytes per pixel
+        unsigned int width = 0;
+        unsigned int height = 0;
+
+    public:
+        // Allocates the back buffer; the name and placement are ignored
+        void create(unsigned int window_width, unsigned int window_height, const std::string /*window_name*/, bool /*window_fullscreen*/ = false, int /*window_x*/ = 0, int /*window_y*/ = 0)
+        {
+            width = window_width;
+            height = window_height;
+            image.assign(static_cast<size_t>(width) * height * 3, 0);
+        }
+
+        void checkInput() {}
+        bool keyPressed(int /*key*/) const { return false; }
+        void present() {}
+
+        unsigned char* backBuffer() const { return const_cast<unsigned char*>(image.data()); }
+        unsigned char* getBackBuffer() const { return backBuffer(); }
+        unsigned int getWidth() const { return width; }
+        unsigned int getHeight() const { return height; }
+
+        void draw(int x, int y, unsigned char r, unsigned char g, unsigned char b)
+        {
+            draw(y * static_cast<int>(width) + x, r, g, b);
+        }
+
+        void draw(int pixelIndex, unsigned char r, unsigned char g, unsigned char b)
+        {
+            unsigned char* pixel = &image[static_cast<size_t>(pixelIndex) * 3];
+            pixel[0] = r;
+            pixel[1] = g;
+            pixel[2] = b;
+        }
+
+        void draw(int x, int y, unsigned char* pixel)
+        {
+            draw(x, y, pixel[0], pixel[1], pixel[2]);
+        }
+
+        void clear()
+        {
+            memset(image.data(), 0, image.size());
+        }
+    };
+
+    // Timer on the steady clock, with the interface of the Windows one
+    class Timer
+    {
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        Timer() { reset(); }
+
+        void reset() { start = std::chrono::steady_clock::now(); }
+
+        // Returns the seconds since the last reset or call, and restarts from now
+        float dt()
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            float value = std::chrono::duration<float>(now - start).count();
+            start = now;
+            return value;
+        }
+    };
+}
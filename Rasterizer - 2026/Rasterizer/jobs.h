@@ -0,0 +1,271 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include "sync.h"
+#include "profiler.h"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Work-stealing job system.
+// Every thread owns a deque of jobs: it pushes and pops at the back (newest first, good for
+// cache reuse) while idle threads steal from the front of other threads' deques (oldest first,
+// usually the biggest remaining pieces). The thread that creates the system is thread 0 and
+// takes part in the work whenever it waits for a group, so a system of N threads starts N - 1.
+// Jobs are a function pointer plus a context pointer, so submitting work never allocates.
+// Waking idle workers and joining a group use atomics only: waiters spin briefly and then park
+// on an Epoch, and nobody takes a lock to signal them. The deques themselves are guarded by a
+// short lock each.
+class JobSystem {
+public:
+    // Jobs that are waited for together (fork/join). A group must outlive wait() on it.
+    class Group {
+        std::atomic<int> pending{ 0 };
+        std::atomic<bool> started{ false };                 // Set when another thread first takes one of its jobs
+        std::chrono::steady_clock::time_point submitted;    // When the first job was queued
+        friend class JobSystem;
+    public:
+        bool done() const { return pending.load(std::memory_order_acquire) == 0; }
+    };
+
+    // Time spent synchronising since the last takeSyncStats()
+    struct SyncStats {
+        double start = 0.0;     // Seconds from queuing work until another thread starts on it, summed over groups
+        double end = 0.0;       // Seconds joining threads waited with nothing left to help with
+    };
+
+private:
+    struct Job {
+        void (*call)(void*, int, int);  // Runs the job on the range [begin, end)
+        void* context;                  // Callable owned by the submitter
+        int begin, end;
+        Group* group;
+    };
+
+    // Fixed-size deque; when it is full the submitter runs the job itself. Pushing, popping and
+    // stealing take the queue's own lock for a few instructions; only waking and joining are
+    // lock-free.
+    struct Queue {
+        static const int Capacity = 1024;
+        std::mutex lock;
+        Job jobs[Capacity];
+        int head = 0;                   // Oldest job, taken by thieves
+        int tail = 0;                   // One past the newest job, used by the owner
+
+        bool push(const Job& job) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tail - head == Capacity) return false;
+            jobs[tail++ % Capacity] = job;
+            return true;
+        }
+
+        bool pop(Job& job) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tail == head) return false;
+            job = jobs[--tail % Capacity];
+            if (tail == head) head = tail = 0;
+            return true;
+        }
+
+        bool steal(Job& job) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tail == head) return false;
+            job = jobs[head++ % Capacity];
+            if (tail == head) head = tail = 0;
+            return true;
+        }
+    };
+
+    int threadCount;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    Epoch work;                         // Advanced whenever jobs are queued, idle workers wait on it
+    Epoch finished;                     // Advanced whenever a group completes, joining threads wait on it
+    std::atomic<bool> stop{ false };
+    std::atomic<long long> startNanoseconds{ 0 };
+    std::atomic<long long> endNanoseconds{ 0 };
+
+    static int& threadIndex() {
+        thread_local int index = -1;
+        return index;
+    }
+
+public:
+    // Starts the worker threads
+    // Input Variables:
+    // - threads: Total number of threads including the calling one, 0 for one per hardware thread
+    // - threadStart: Optional function run once on each new worker with its index (1 to threads - 1)
+    // - pinThreads: Pin thread i to logical core i (modulo the core count), the calling thread to core 0
+    explicit JobSystem(int threads, std::function<void(int)> threadStart = nullptr, bool pinThreads = false) {
+        threadCount = threads > 0 ? threads : defaultThreadCount();
+        for (int i = 0; i < threadCount; i++) queues.push_back(std::make_unique<Queue>());
+        threadIndex() = 0;
+        if (pinThreads) pinCurrentThread(0);
+        for (int i = 1; i < threadCount; i++) {
+            this->threads.emplace_back([this, i, threadStart, pinThreads] {
+                threadIndex() = i;
+                if (pinThreads) pinCurrentThread(i);
+                if (threadStart) threadStart(i);
+                workerLoop(i);
+            });
+        }
+    }
+
+    // Stops and joins every worker. Work still queued must have been waited for.
+    ~JobSystem() {
+        stop.store(true);
+        work.advance();
+        for (std::thread& t : threads) t.join();
+    }
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    int getThreadCount() const { return threadCount; }
+
+    // Index of the calling thread in the system, -1 for threads it does not own
+    static int currentThread() { return threadIndex(); }
+
+    // One thread per hardware thread, or 1 when the count is unknown
+    static int defaultThreadCount() {
+        return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+
+    // Restricts the calling thread to one logical core, where the platform supports it
+    // Input Variables:
+    // - core: Core index, wrapped to the number of cores
+    static void pinCurrentThread(int core) {
+        core %= defaultThreadCount();
+#if defined(_WIN32)
+        if (core < 64) SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core);
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+    // Returns the synchronisation time accumulated since the last call and starts again from zero
+    SyncStats takeSyncStats() {
+        SyncStats stats;
+        stats.start = startNanoseconds.exchange(0) * 1e-9;
+        stats.end = endNanoseconds.exchange(0) * 1e-9;
+        return stats;
+    }
+
+    // Fork: queue f() to run on any thread. f is called in place and must stay alive until
+    // wait(group) returns.
+    // Input Variables:
+    // - group: Group to add the job to
+    // - f: Callable taking no arguments
+    template<typename F>
+    void run(Group& group, F& f) {
+        submit(group, [](void* context, int, int) { (*static_cast<F*>(context))(); }, &f, 0, 0);
+        work.advance();
+    }
+
+    // Join: help with queued jobs until every job of the group has finished
+    // Input Variables:
+    // - group: Group to wait for
+    void wait(Group& group) {
+        int self = std::max(currentThread(), 0);
+        while (!group.done()) {
+            unsigned int seen = finished.current();
+            if (runOne(self) || group.done()) continue;
+
+            // The remaining jobs are running on other threads
+            long long waitStart = Profiler::now();
+            finished.wait(seen);
+            long long waitEnd = Profiler::now();
+            endNanoseconds.fetch_add(waitEnd - waitStart, std::memory_order_relaxed);
+#if RASTER_PROFILE
+            Profiler::record("join wait", waitStart, waitEnd);
+#endif
+        }
+    }
+
+    // Calls f(begin, end) over [0, count) in chunks of at most grain items, spread over every
+    // thread, and returns when all chunks have finished
+    // Input Variables:
+    // - count: Number of items
+    // - grain: Largest number of items per job
+    // - f: Callable taking (first item, one past the last item)
+    template<typename F>
+    void parallelFor(int count, int grain, F&& f) {
+        if (count <= 0) return;
+        grain = std::max(grain, 1);
+        using Body = std::remove_reference_t<F>;
+        auto call = [](void* context, int begin, int end) { (*static_cast<Body*>(context))(begin, end); };
+
+        Group group;
+        // Queue every chunk but the first, which the caller runs itself straight away
+        for (int begin = grain; begin < count; begin += grain) {
+            submit(group, call, &f, begin, std::min(begin + grain, count));
+        }
+        if (grain < count) work.advance();
+        f(0, std::min(grain, count));
+        wait(group);
+    }
+
+private:
+    // Queues a job on the calling thread's deque; the caller advances work once it has queued a batch
+    void submit(Group& group, void (*call)(void*, int, int), void* context, int begin, int end) {
+        Job job{ call, context, begin, end, &group };
+        if (group.pending.fetch_add(1, std::memory_order_relaxed) == 0) {
+            group.submitted = std::chrono::steady_clock::now();
+        }
+        int self = std::max(currentThread(), 0);
+        if (!queues[self]->push(job)) execute(job);
+    }
+
+    void execute(const Job& job) {
+        Group* group = job.group;
+        job.call(job.context, job.begin, job.end);
+        if (group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) finished.advance();
+    }
+
+    // Runs one job from the thread's own deque, or else one stolen from another thread
+    // Returns false when no job was found
+    bool runOne(int self) {
+        Job job;
+        if (queues[self]->pop(job)) {
+            execute(job);
+            return true;
+        }
+        for (int k = 1; k < threadCount; k++) {
+            if (queues[(self + k) % threadCount]->steal(job)) {
+                if (!job.group->started.exchange(true, std::memory_order_relaxed)) {
+                    auto latency = std::chrono::steady_clock::now() - job.group->submitted;
+                    startNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count(), std::memory_order_relaxed);
+                }
+                execute(job);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(int self) {
+        while (!stop.load(std::memory_order_relaxed)) {
+            unsigned int seen = work.current();
+            if (runOne(self)) continue;
+            work.wait(seen);
+        }
+    }
+};
@@ -3,10 +3,22 @@
 #include "vec4.h"
 #include "colour.h"
 
+class ShadowMap;
+
 // keep light straightforward - struct for storing information
 struct Light {
     vec4 omega_i; // light direction
     colour L; // light colour
     colour ambient; // ambient light component 
+    ShadowMap* shadowMap = nullptr; // optional shadow map, rendered by render() each frame when set
 };
 
+// point or spot light with a limited range, gathered per screen tile by LightGrid
+struct LocalLight {
+    vec4 position = vec4(0.f, 0.f, 0.f, 1.f); // world-space position
+    colour L = colour(1.f, 1.f, 1.f); // light colour
+    float range = 1.f; // distance at which the contribution fades to zero
+    vec4 direction = vec4(0.f, 0.f, -1.f, 0.f); // spot direction, the way the light points
+    float cosOuter = -1.f; // cosine of the spot cone's outer half-angle, -1 makes it a point light
+    float cosInner = -1.f; // cosine of the half-angle where the spot falloff begins
+};
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "vec4.h"
+#include "matrix.h"
+#include "colour.h"
+#include "light.h"
+#include "arena.h"
+
+// Screen-space tile grid of local (point and spot) lights.
+// Each light's range sphere is projected to a screen rectangle and the light's index is added
+// to every tile that rectangle touches. The lists are stored back to back in one array, so
+// shading a pixel only walks the lights of its own tile and the cost follows the number of
+// lights per pixel rather than the number of lights in the scene.
+class LightGrid {
+public:
+    static const int TileSize = 16;     // Width and height of a tile in pixels
+
+private:
+    int width = 0, height = 0;          // Size of the target in pixels
+    int tilesX = 0, tilesY = 0;         // Number of tiles in each direction
+    int tileCount = 0;                  // tilesX * tilesY
+    int total = 0;                      // Number of entries in indices
+    // Per-frame arrays, allocated from the frame arena passed to build()
+    LocalLight* lights = nullptr;       // Copy of this frame's lights, spot directions normalised
+    int* offsets = nullptr;             // First entry of each tile's list in indices
+    int* counts = nullptr;              // Number of lights in each tile
+    int* indices = nullptr;             // Light indices of every tile, back to back
+
+public:
+    // Cull this frame's lights into tiles
+    // The grid stays valid until the arena is reset or rewound past this call.
+    // Input Variables:
+    // - arena: Frame arena holding the tile lists
+    // - sceneLights: Point and spot lights in world space
+    // - camera: World to view matrix
+    // - projection: Perspective matrix of the camera
+    // - _width, _height: Size of the target in pixels
+    void build(FrameArena& arena, const std::vector<LocalLight>& sceneLights, const matrix& camera, const matrix& projection, int _width, int _height) {
+        width = _width;
+        height = _height;
+        tilesX = (width + TileSize - 1) / TileSize;
+        tilesY = (height + TileSize - 1) / TileSize;
+        tileCount = tilesX * tilesY;
+
+        size_t lightCount = sceneLights.size();
+        lights = arena.allocate<LocalLight>(lightCount);
+        std::copy(sceneLights.begin(), sceneLights.end(), lights);
+        offsets = arena.allocate<int>(tileCount);
+        counts = arena.allocate<int>(tileCount);
+        std::fill(counts, counts + tileCount, 0);
+        int* rects = arena.allocate<int>(lightCount * 4);   // Tile rectangle of each light (x0, y0, x1, y1), x1 < x0 when culled
+
+        for (size_t l = 0; l < lightCount; l++) {
+            LocalLight& light = lights[l];
+            light.direction[3] = 0.f;
+            light.direction.normalise();
+            int* r = &rects[l * 4];
+            if (!screenRect(light, camera, projection, r)) {
+                r[0] = 0; r[2] = -1;
+                continue;
+            }
+            for (int ty = r[1]; ty <= r[3]; ty++) {
+                for (int tx = r[0]; tx <= r[2]; tx++) {
+                    counts[ty * tilesX + tx]++;
+                }
+            }
+        }
+
+        // Prefix sum gives each tile its slice of the index array
+        total = 0;
+        for (int t = 0; t < tileCount; t++) {
+            offsets[t] = total;
+            total += counts[t];
+        }
+        indices = arena.allocate<int>(total);
+
+        int* fill = counts;
+        std::fill(fill, fill + tileCount, 0);
+        for (size_t l = 0; l < lightCount; l++) {
+            const int* r = &rects[l * 4];
+            for (int ty = r[1]; ty <= r[3]; ty++) {
+                for (int tx = r[0]; tx <= r[2]; tx++) {
+                    int t = ty * tilesX + tx;
+                    indices[offsets[t] + fill[t]++] = static_cast<int>(l);
+                }
+            }
+        }
+    }
+
+    // True when no light touches any tile
+    bool empty() const { return total == 0; }
+
+    int getTilesX() const { return tilesX; }
+    int getTilesY() const { return tilesY; }
+
+    // Number of lights in a tile
+    // Input Variables:
+    // - tx, ty: Tile coordinates
+    int count(int tx, int ty) const { return counts[ty * tilesX + tx]; }
+
+    // Largest number of lights in any tile
+    int maxCount() const {
+        return tileCount == 0 ? 0 : *std::max_element(counts, counts + tileCount);
+    }
+
+    // Mean number of lights per tile
+    float averageCount() const {
+        return tileCount == 0 ? 0.f : static_cast<float>(total) / tileCount;
+    }
+
+    // Sum the light of every local light in the pixel's tile
+    // Input Variables:
+    // - x, y: Pixel coordinates, selecting the tile
+    // - world: Position being shaded in world space
+    // - normal: Normalised surface normal in world space
+    // Returns the diffuse light reaching the point, before the surface colour is applied
+    colour shade(int x, int y, const vec4& world, const vec4& normal) const {
+        float lr = 0.f, lg = 0.f, lb = 0.f;
+        int t = std::min(y / TileSize, tilesY - 1) * tilesX + std::min(x / TileSize, tilesX - 1);
+        const int* list = indices + offsets[t];
+        for (int i = 0; i < counts[t]; i++) {
+            const LocalLight& light = lights[list[i]];
+            float dx = light.position[0] - world[0];
+            float dy = light.position[1] - world[1];
+            float dz = light.position[2] - world[2];
+            float dist2 = dx * dx + dy * dy + dz * dz;
+            float range2 = light.range * light.range;
+            if (dist2 >= range2) continue;
+
+            float invDist = 1.f / std::sqrt(std::max(dist2, 1e-8f));
+            dx *= invDist; dy *= invDist; dz *= invDist;
+            float ndotl = dx * normal[0] + dy * normal[1] + dz * normal[2];
+            if (ndotl <= 0.f) continue;
+
+            // Windowed falloff reaches exactly zero at the range, so culling by range is lossless
+            float fade = 1.f - dist2 / range2;
+            float intensity = ndotl * fade * fade;
+
+            if (light.cosOuter > -1.f) {
+                float cd = -(dx * light.direction[0] + dy * light.direction[1] + dz * light.direction[2]);
+                if (cd <= light.cosOuter) continue;
+                float s = std::min((cd - light.cosOuter) / std::max(light.cosInner - light.cosOuter, 1e-4f), 1.f);
+                intensity *= s * s * (3.f - 2.f * s);
+            }
+
+            colour c = light.L;
+            lr += c[colour::RED] * intensity;
+            lg += c[colour::GREEN] * intensity;
+            lb += c[colour::BLUE] * intensity;
+        }
+        return colour(lr, lg, lb);
+    }
+
+private:
+    // Conservative tile rectangle of a light's range sphere
+    // The corners of the sphere's view-space bounding box are projected and their screen bounds taken.
+    // Spheres crossing the near plane cover the whole screen.
+    // Output Variables:
+    // - r: Tile rectangle (x0, y0, x1, y1), inclusive
+    // Returns false when the light cannot affect anything on screen
+    bool screenRect(const LocalLight& light, const matrix& camera, const matrix& projection, int* r) const {
+        const float nearPlane = 0.1f;
+        vec4 c = camera * vec4(light.position[0], light.position[1], light.position[2], 1.f);
+        float rad = light.range;
+        if (c[2] - rad > -nearPlane) return false;
+
+        float minX = 0.f, minY = 0.f, maxX = (float)width, maxY = (float)height;
+        if (c[2] + rad < -nearPlane) {
+            minX = 1e30f; minY = 1e30f; maxX = -1e30f; maxY = -1e30f;
+            for (int k = 0; k < 8; k++) {
+                vec4 p(c[0] + ((k & 1) ? rad : -rad), c[1] + ((k & 2) ? rad : -rad), c[2] + ((k & 4) ? rad : -rad), 1.f);
+                p = projection * p;
+                p.W();
+                float sx = (p[0] + 1.f) * 0.5f * (float)width;
+                float sy = (1.f - (p[1] + 1.f) * 0.5f) * (float)height;
+                minX = std::min(minX, sx); maxX = std::max(maxX, sx);
+                minY = std::min(minY, sy); maxY = std::max(maxY, sy);
+            }
+            if (maxX < 0.f || maxY < 0.f || minX >= width || minY >= height) return false;
+        }
+
+        r[0] = std::clamp((int)std::floor(minX) / TileSize, 0, tilesX - 1);
+        r[1] = std::clamp((int)std::floor(minY) / TileSize, 0, tilesY - 1);
+        r[2] = std::clamp((int)std::floor(maxX) / TileSize, 0, tilesX - 1);
+        r[3] = std::clamp((int)std::floor(maxY) / TileSize, 0, tilesY - 1);
+        return true;
+    }
+};
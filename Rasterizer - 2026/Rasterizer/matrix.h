@@ -2,10 +2,12 @@
 
 #include <iostream>
 #include <vector>
+#include <cmath>
 #include "vec4.h"
 
 // Matrix class for 4x4 transformation matrices
-class matrix {
+// Rows are 16-byte aligned so each one loads into a single SSE register with RASTER_SIMD.
+class alignas(16) matrix {
     union {
         float m[4][4]; // 2D array representation of the matrix
         float a[16];   // 1D array representation of the matrix for linear access
@@ -20,6 +22,9 @@ public:
     // Access matrix elements by row and column
     float& operator()(unsigned int row, unsigned int col) { return m[row][col]; }
 
+    // Access matrix elements by row and column (const version)
+    float operator()(unsigned int row, unsigned int col) const { return m[row][col]; }
+
     // Display the matrix elements in a readable format
     void display() {
         for (unsigned int i = 0; i < 4; i++) {
@@ -33,6 +38,8 @@ public:
     // Input Variables:
     // - v: vec4 object to multiply with the matrix
     // Returns the resulting transformed vec4
+    // A single product stays scalar: the rows are stored row-major, and transposing them into
+    // SIMD columns costs more than it saves. Use matrixColumns to transform many vectors.
     vec4 operator * (const vec4& v) const {
         vec4 result;
         result[0] = a[0] * v[0] + a[1] * v[1] + a[2] * v[2] + a[3] * v[3];
@@ -48,6 +55,17 @@ public:
     // Returns the resulting matrix
     matrix operator * (const matrix& mx) const {
         matrix ret;
+#if RASTER_SIMD
+        // Each result row is a combination of mx's rows weighted by this row's elements
+        __m128 b0 = _mm_load_ps(mx.a), b1 = _mm_load_ps(mx.a + 4), b2 = _mm_load_ps(mx.a + 8), b3 = _mm_load_ps(mx.a + 12);
+        for (int row = 0; row < 4; ++row) {
+            __m128 r = _mm_mul_ps(_mm_set1_ps(a[row * 4 + 0]), b0);
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[row * 4 + 1]), b1));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[row * 4 + 2]), b2));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[row * 4 + 3]), b3));
+            _mm_store_ps(ret.a + row * 4, r);
+        }
+#else
         for (int row = 0; row < 4; ++row) {
             for (int col = 0; col < 4; ++col) {
                 ret.a[row * 4 + col] =
@@ -57,6 +75,7 @@ public:
                     a[row * 4 + 3] * mx.a[3 * 4 + col];
             }
         }
+#endif
         return ret;
     }
 
@@ -80,6 +99,75 @@ public:
         return m;
     }
 
+    // Create an orthographic projection matrix
+    // Depth is mapped to [0, 1] between the near and far planes, matching makePerspective.
+    // Input Variables:
+    // - l, r: Left and right planes
+    // - b, t: Bottom and top planes
+    // - n, f: Near and far plane distances along -Z
+    // Returns the orthographic matrix
+    static matrix makeOrthographic(float l, float r, float b, float t, float n, float f) {
+        matrix m;
+        m.a[0] = 2.0f / (r - l);
+        m.a[3] = -(r + l) / (r - l);
+        m.a[5] = 2.0f / (t - b);
+        m.a[7] = -(t + b) / (t - b);
+        m.a[10] = -1.0f / (f - n);
+        m.a[11] = -n / (f - n);
+        return m;
+    }
+
+    // Create a view matrix looking from eye towards target, with the view direction along -Z
+    // Input Variables:
+    // - eye: Position of the viewer
+    // - target: Point being looked at
+    // - up: Approximate up direction, must not be parallel to the view direction
+    // Returns the world to view matrix
+    static matrix makeLookAt(const vec4& eye, const vec4& target, const vec4& up) {
+        vec4 zaxis = eye - target;
+        zaxis.normalise();
+        vec4 xaxis = vec4::cross(up, zaxis);
+        xaxis.normalise();
+        vec4 yaxis = vec4::cross(zaxis, xaxis);
+
+        matrix m;
+        m.a[0] = xaxis[0]; m.a[1] = xaxis[1]; m.a[2] = xaxis[2]; m.a[3] = -vec4::dot(xaxis, eye);
+        m.a[4] = yaxis[0]; m.a[5] = yaxis[1]; m.a[6] = yaxis[2]; m.a[7] = -vec4::dot(yaxis, eye);
+        m.a[8] = zaxis[0]; m.a[9] = zaxis[1]; m.a[10] = zaxis[2]; m.a[11] = -vec4::dot(zaxis, eye);
+        return m;
+    }
+
+    // Compute the inverse of the matrix using cofactor expansion
+    // Returns the inverse, or the identity if the matrix is singular
+    matrix invert() const {
+        matrix inv;
+        float* o = inv.a;
+        o[0] = a[5] * a[10] * a[15] - a[5] * a[11] * a[14] - a[9] * a[6] * a[15] + a[9] * a[7] * a[14] + a[13] * a[6] * a[11] - a[13] * a[7] * a[10];
+        o[4] = -a[4] * a[10] * a[15] + a[4] * a[11] * a[14] + a[8] * a[6] * a[15] - a[8] * a[7] * a[14] - a[12] * a[6] * a[11] + a[12] * a[7] * a[10];
+        o[8] = a[4] * a[9] * a[15] - a[4] * a[11] * a[13] - a[8] * a[5] * a[15] + a[8] * a[7] * a[13] + a[12] * a[5] * a[11] - a[12] * a[7] * a[9];
+        o[12] = -a[4] * a[9] * a[14] + a[4] * a[10] * a[13] + a[8] * a[5] * a[14] - a[8] * a[6] * a[13] - a[12] * a[5] * a[10] + a[12] * a[6] * a[9];
+        o[1] = -a[1] * a[10] * a[15] + a[1] * a[11] * a[14] + a[9] * a[2] * a[15] - a[9] * a[3] * a[14] - a[13] * a[2] * a[11] + a[13] * a[3] * a[10];
+        o[5] = a[0] * a[10] * a[15] - a[0] * a[11] * a[14] - a[8] * a[2] * a[15] + a[8] * a[3] * a[14] + a[12] * a[2] * a[11] - a[12] * a[3] * a[10];
+        o[9] = -a[0] * a[9] * a[15] + a[0] * a[11] * a[13] + a[8] * a[1] * a[15] - a[8] * a[3] * a[13] - a[12] * a[1] * a[11] + a[12] * a[3] * a[9];
+        o[13] = a[0] * a[9] * a[14] - a[0] * a[10] * a[13] - a[8] * a[1] * a[14] + a[8] * a[2] * a[13] + a[12] * a[1] * a[10] - a[12] * a[2] * a[9];
+        o[2] = a[1] * a[6] * a[15] - a[1] * a[7] * a[14] - a[5] * a[2] * a[15] + a[5] * a[3] * a[14] + a[13] * a[2] * a[7] - a[13] * a[3] * a[6];
+        o[6] = -a[0] * a[6] * a[15] + a[0] * a[7] * a[14] + a[4] * a[2] * a[15] - a[4] * a[3] * a[14] - a[12] * a[2] * a[7] + a[12] * a[3] * a[6];
+        o[10] = a[0] * a[5] * a[15] - a[0] * a[7] * a[13] - a[4] * a[1] * a[15] + a[4] * a[3] * a[13] + a[12] * a[1] * a[7] - a[12] * a[3] * a[5];
+        o[14] = -a[0] * a[5] * a[14] + a[0] * a[6] * a[13] + a[4] * a[1] * a[14] - a[4] * a[2] * a[13] - a[12] * a[1] * a[6] + a[12] * a[2] * a[5];
+        o[3] = -a[1] * a[6] * a[11] + a[1] * a[7] * a[10] + a[5] * a[2] * a[11] - a[5] * a[3] * a[10] - a[9] * a[2] * a[7] + a[9] * a[3] * a[6];
+        o[7] = a[0] * a[6] * a[11] - a[0] * a[7] * a[10] - a[4] * a[2] * a[11] + a[4] * a[3] * a[10] + a[8] * a[2] * a[7] - a[8] * a[3] * a[6];
+        o[11] = -a[0] * a[5] * a[11] + a[0] * a[7] * a[9] + a[4] * a[1] * a[11] - a[4] * a[3] * a[9] - a[8] * a[1] * a[7] + a[8] * a[3] * a[5];
+        o[15] = a[0] * a[5] * a[10] - a[0] * a[6] * a[9] - a[4] * a[1] * a[10] + a[4] * a[2] * a[9] + a[8] * a[1] * a[6] - a[8] * a[2] * a[5];
+
+        float det = a[0] * o[0] + a[1] * o[4] + a[2] * o[8] + a[3] * o[12];
+        if (std::fabs(det) < 1e-12f) return matrix::makeIdentity();
+
+        float invDet = 1.0f / det;
+        for (unsigned int i = 0; i < 16; i++)
+            o[i] *= invDet;
+        return inv;
+    }
+
     // Create a translation matrix
     // Input Variables:
     // - tx, ty, tz: Translation amounts along the X, Y, and Z axes
@@ -186,4 +274,48 @@ private:
     }
 };
 
+// Matrix prepared for transforming many vectors, e.g. every vertex of a mesh.
+// With RASTER_SIMD the matrix is transposed once into four column registers; each product is then
+// four broadcasts, four multiplies and three adds, summed in the same order as matrix::operator*.
+class matrixColumns {
+#if RASTER_SIMD
+    __m128 c[4];       // Columns of the matrix
+#else
+    matrix mat;        // Scalar fallback keeps the matrix itself
+#endif
+
+public:
+    // Default constructor prepares the identity matrix
+    matrixColumns() : matrixColumns(matrix()) {}
+
+    // Constructor prepares a matrix
+    // Input Variables:
+    // - mx: Matrix to transform by
+    explicit matrixColumns(const matrix& mx) {
+#if RASTER_SIMD
+        c[0] = _mm_setr_ps(mx(0, 0), mx(1, 0), mx(2, 0), mx(3, 0));
+        c[1] = _mm_setr_ps(mx(0, 1), mx(1, 1), mx(2, 1), mx(3, 1));
+        c[2] = _mm_setr_ps(mx(0, 2), mx(1, 2), mx(2, 2), mx(3, 2));
+        c[3] = _mm_setr_ps(mx(0, 3), mx(1, 3), mx(2, 3), mx(3, 3));
+#else
+        mat = mx;
+#endif
+    }
 
+    // Multiply the matrix by a 4D vector
+    // Input Variables:
+    // - v: vec4 object to transform
+    // Returns the transformed vec4, identical to matrix::operator*
+    vec4 operator * (const vec4& v) const {
+#if RASTER_SIMD
+        __m128 p = v.simd();
+        __m128 r = _mm_mul_ps(c[0], RASTER_SPLAT(p, 0));
+        r = _mm_add_ps(r, _mm_mul_ps(c[1], RASTER_SPLAT(p, 1)));
+        r = _mm_add_ps(r, _mm_mul_ps(c[2], RASTER_SPLAT(p, 2)));
+        r = _mm_add_ps(r, _mm_mul_ps(c[3], RASTER_SPLAT(p, 3)));
+        return vec4(r);
+#else
+        return mat * v;
+#endif
+    }
+};
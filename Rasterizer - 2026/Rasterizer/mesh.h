@@ -1,9 +1,13 @@
 ﻿#pragma once
 
 #include <vector>
+#include <memory>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 #include "vec4.h"
 #include "matrix.h"
+#include "affine.h"
 #include "colour.h"
 
 // Represents a vertex in a 3D mesh, including its position, normal, and color
@@ -13,6 +17,11 @@ struct Vertex {
     colour rgb;     // Color of the vertex
 };
 
+// Rate at which lighting is evaluated for a mesh, written as pixels wide x pixels high.
+// Depth and coverage are always evaluated per pixel; only the shading is shared across the block.
+// Auto lets the renderer pick a rate each frame from distance and screen-space motion.
+enum class ShadingRate : unsigned char { Rate1x1, Rate2x1, Rate1x2, Rate2x2, Auto };
+
 // Stores indices of vertices that form a triangle in a mesh
 struct triIndices {
     unsigned int v[3]; // Indices into the vertex array
@@ -25,15 +34,36 @@ struct triIndices {
     }
 };
 
+class MappedFile;
+
+// Vertex and index data of a mesh file used in place, see meshfile.h
+struct MappedMeshData {
+    std::shared_ptr<const MappedFile> file;     // Keeps the mapping alive while any mesh uses it
+    const Vertex* vertices = nullptr;
+    size_t vertexCount = 0;
+    const triIndices* triangles = nullptr;
+    size_t triangleCount = 0;
+    vec4 centre;                                // Bounding sphere in object space, stored by the file
+    float radius = 0.f;
+};
+
 // Class representing a 3D mesh made up of vertices and triangles
 class Mesh {
 public:
     colour col;       // Uniform color for the mesh
     float kd;         // Diffuse reflection coefficient
     float ka;         // Ambient reflection coefficient
-    matrix world;     // Transformation matrix for the mesh
+    affine world;     // Object to world transform for the mesh
+    ShadingRate shadingRate;            // Rate at which lighting is evaluated for this mesh
     std::vector<Vertex> vertices;       // List of vertices in the mesh
     std::vector<triIndices> triangles;  // List of triangles in the mesh
+    MappedMeshData mapped;              // Data of a mesh file drawn instead of the vectors when mapped.file is set
+
+    // Vertices and triangles to draw: those of the mapped file if there is one, else the vectors
+    const Vertex* vertexData() const { return mapped.file ? mapped.vertices : vertices.data(); }
+    size_t vertexCount() const { return mapped.file ? mapped.vertexCount : vertices.size(); }
+    const triIndices* triangleData() const { return mapped.file ? mapped.triangles : triangles.data(); }
+    size_t triangleCount() const { return mapped.file ? mapped.triangleCount : triangles.size(); }
 
     // Set the uniform color and reflection coefficients for the mesh
     // Input Variables:
@@ -50,6 +80,7 @@ public:
     Mesh() {
         col.set(1.0f, 1.0f, 1.0f);
         ka = kd = 0.75f;
+        shadingRate = ShadingRate::Rate1x1;
     }
 
     // Add a vertex and its normal to the mesh
@@ -68,6 +99,72 @@ public:
         triangles.emplace_back(v1, v2, v3);
     }
 
+    // Compute a bounding sphere of the mesh in world space
+    // Output Variables:
+    // - centre: Centre of the sphere (the transformed centre of the vertex bounding box)
+    // - radius: Radius of the sphere, scaled by the largest axis scale of the world matrix
+    void getWorldBounds(vec4& centre, float& radius) const {
+        getWorldBounds(world, centre, radius);
+    }
+
+    // Compute a bounding sphere of the mesh placed by another transform, e.g. one instance of it
+    // Input Variables:
+    // - transform: Object to world transform to use instead of world
+    // Output Variables:
+    // - centre, radius: As for getWorldBounds(centre, radius)
+    void getWorldBounds(const affine& transform, vec4& centre, float& radius) const {
+        vec4 local, lo, hi;
+        float localRadius;
+        if (mapped.file) {
+            // Stored by the file, so bounding a mapped mesh does not touch its vertex pages
+            local = mapped.centre;
+            localRadius = mapped.radius;
+        }
+        else {
+            getLocalBounds(lo, hi, local, localRadius);
+        }
+
+        float scale = 0.f;
+        for (unsigned int c = 0; c < 3; c++) {
+            scale = std::max(scale, std::sqrt(transform(0, c) * transform(0, c) + transform(1, c) * transform(1, c) + transform(2, c) * transform(2, c)));
+        }
+
+        centre = transform * local;
+        radius = localRadius * scale;
+    }
+
+    // Compute the bounds of the vertices in object space
+    // Output Variables:
+    // - lo, hi: Corners of the bounding box
+    // - centre: Centre of the bounding box, also the centre of the sphere
+    // - radius: Radius of the bounding sphere; 0 for a mesh without vertices
+    void getLocalBounds(vec4& lo, vec4& hi, vec4& centre, float& radius) const {
+        const Vertex* data = vertexData();
+        size_t count = vertexCount();
+        if (count == 0) {
+            lo = hi = centre = vec4(0.f, 0.f, 0.f, 1.f);
+            radius = 0.f;
+            return;
+        }
+
+        lo = data[0].p;
+        hi = data[0].p;
+        for (size_t v = 0; v < count; v++) {
+            for (unsigned int i = 0; i < 3; i++) {
+                lo[i] = std::min(lo[i], data[v].p[i]);
+                hi[i] = std::max(hi[i], data[v].p[i]);
+            }
+        }
+        centre = vec4((lo[0] + hi[0]) * 0.5f, (lo[1] + hi[1]) * 0.5f, (lo[2] + hi[2]) * 0.5f, 1.f);
+
+        float r2 = 0.f;
+        for (size_t v = 0; v < count; v++) {
+            vec4 d = data[v].p - centre;
+            r2 = std::max(r2, vec4::dot(d, d));
+        }
+        radius = std::sqrt(r2);
+    }
+
     // Display the vertices and triangles of the mesh
     void display() const {
         std::cout << "Vertices and Normals:\n";
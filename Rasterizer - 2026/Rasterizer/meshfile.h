@@ -0,0 +1,186 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include "mesh.h"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Binary mesh files: a header, the vertices exactly as Mesh holds them in memory, the triangle
+// indices and the object-space bounds. loadMeshFile() maps a file read-only and points the mesh
+// at it, so loading is a header check and the cost of a mesh is paid in page faults on first
+// draw, with nothing parsed or copied. convertToMeshFile() in meshimport.h writes such files from
+// OBJ and PLY.
+//
+// Layout, in the byte order and Vertex layout of the machine that wrote it:
+//     MeshFileHeader
+//     Vertex[vertexCount]         at vertexOffset, a multiple of MeshFileAlignment
+//     triIndices[triangleCount]   at triangleOffset, a multiple of MeshFileAlignment
+// A file written by a build whose Vertex or triIndices differ in size is refused, not misread.
+
+static const uint32_t MeshFileVersion = 1;
+static const uint64_t MeshFileAlignment = 64;   // Streams start on a cache line; mappings start on a page
+
+struct MeshFileHeader {
+    char magic[4];              // "RMSH"
+    uint32_t version;           // MeshFileVersion
+    uint32_t vertexSize;        // sizeof(Vertex) of the writer
+    uint32_t indexSize;         // sizeof(triIndices) of the writer
+    uint64_t vertexCount;
+    uint64_t triangleCount;
+    uint64_t vertexOffset;      // Byte offset of the vertices from the start of the file
+    uint64_t triangleOffset;    // Byte offset of the triangle indices
+    uint64_t fileSize;          // Total size, so truncated files are caught before use
+    float boundsMin[3];         // Bounding box in object space
+    float boundsMax[3];
+    float centre[3];            // Bounding sphere in object space
+    float radius;
+};
+
+// Read-only view of a whole file in memory, unmapped when the last user lets go of it
+class MappedFile {
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#if defined(_WIN32)
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (bytes) munmap(const_cast<unsigned char*>(bytes), length);
+#endif
+    }
+
+    // Maps a file
+    // Input Variables:
+    // - path: File to map
+    // Returns false when the file is missing, empty or cannot be mapped
+    bool open(const std::string& path) {
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) return false;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) return false;
+        bytes = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!bytes) return false;
+        length = static_cast<size_t>(size.QuadPart);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);     // The mapping keeps the file open
+        if (view == MAP_FAILED) return false;
+        bytes = static_cast<const unsigned char*>(view);
+        length = static_cast<size_t>(info.st_size);
+#endif
+        return true;
+    }
+
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Rounds a file offset up to the stream alignment
+inline uint64_t alignMeshFileOffset(uint64_t offset) {
+    return (offset + MeshFileAlignment - 1) & ~(MeshFileAlignment - 1);
+}
+
+// Writes the vertices and triangles a mesh draws as a mesh file
+// Input Variables:
+// - mesh: Mesh to save; its colour, coefficients and transform are not part of the file
+// - path: File to write
+// Returns false when the file could not be written
+inline bool saveMeshFile(const Mesh& mesh, const std::string& path) {
+    MeshFileHeader header = {};
+    memcpy(header.magic, "RMSH", 4);
+    header.version = MeshFileVersion;
+    header.vertexSize = sizeof(Vertex);
+    header.indexSize = sizeof(triIndices);
+    header.vertexCount = mesh.vertexCount();
+    header.triangleCount = mesh.triangleCount();
+    header.vertexOffset = alignMeshFileOffset(sizeof(MeshFileHeader));
+    header.triangleOffset = alignMeshFileOffset(header.vertexOffset + header.vertexCount * sizeof(Vertex));
+    header.fileSize = header.triangleOffset + header.triangleCount * sizeof(triIndices);
+
+    vec4 lo, hi, centre;
+    mesh.getLocalBounds(lo, hi, centre, header.radius);
+    for (int i = 0; i < 3; i++) {
+        header.boundsMin[i] = lo[i];
+        header.boundsMax[i] = hi[i];
+        header.centre[i] = centre[i];
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) return false;
+    static const char padding[MeshFileAlignment] = {};
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(padding, header.vertexOffset - sizeof(header));
+    file.write(reinterpret_cast<const char*>(mesh.vertexData()), header.vertexCount * sizeof(Vertex));
+    file.write(padding, header.triangleOffset - (header.vertexOffset + header.vertexCount * sizeof(Vertex)));
+    file.write(reinterpret_cast<const char*>(mesh.triangleData()), header.triangleCount * sizeof(triIndices));
+    return static_cast<bool>(file);
+}
+
+// Maps a mesh file and makes a mesh draw its data in place. The mesh's own vectors are left
+// alone and unused; its colour, coefficients and transform are kept. Copies of the mesh share
+// the mapping, which is released with the last of them.
+// Input Variables:
+// - path: Mesh file written by saveMeshFile() or convertToMeshFile()
+// Output Variables:
+// - mesh: Mesh to point at the file
+// Returns false, leaving the mesh unchanged, when the file is missing, truncated, not a mesh
+// file, from another version or written with another vertex layout. Indices are not checked:
+// the file is trusted as written by saveMeshFile().
+inline bool loadMeshFile(const std::string& path, Mesh& mesh) {
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(path) || file->size() < sizeof(MeshFileHeader)) return false;
+
+    MeshFileHeader header;
+    memcpy(&header, file->data(), sizeof(header));
+    if (memcmp(header.magic, "RMSH", 4) != 0 || header.version != MeshFileVersion) return false;
+    if (header.vertexSize != sizeof(Vertex) || header.indexSize != sizeof(triIndices)) return false;
+    if (header.fileSize != file->size() || header.vertexOffset % MeshFileAlignment || header.triangleOffset % MeshFileAlignment) return false;
+    if (header.vertexOffset + header.vertexCount * sizeof(Vertex) > header.triangleOffset
+        || header.triangleOffset + header.triangleCount * sizeof(triIndices) > header.fileSize) return false;
+
+    MappedMeshData& mapped = mesh.mapped;
+    mapped.vertices = reinterpret_cast<const Vertex*>(file->data() + header.vertexOffset);
+    mapped.vertexCount = static_cast<size_t>(header.vertexCount);
+    mapped.triangles = reinterpret_cast<const triIndices*>(file->data() + header.triangleOffset);
+    mapped.triangleCount = static_cast<size_t>(header.triangleCount);
+    mapped.centre = vec4(header.centre[0], header.centre[1], header.centre[2], 1.f);
+    mapped.radius = header.radius;
+    mapped.file = std::move(file);
+    return true;
+}
@@ -0,0 +1,1040 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+#include <algorithm>
+#include "mesh.h"
+#include "jobs.h"
+#include "meshfile.h"
+
+// Importer for Wavefront OBJ and Stanford PLY (ASCII and binary) files.
+// The file is read in blocks of ImportOptions::blockSize bytes, so only one block of the source
+// is held at a time however large it is. Every block is cut at line (or record) boundaries and
+// its chunks are parsed by all threads with the locale-independent parsers below. The chunks'
+// elements are merged in file order, and vertices are welded: OBJ corners sharing a position and
+// normal always become one vertex and, with ImportOptions::weld, vertices with the same position,
+// normal and colour are merged too. Vertices left without a normal get the area-weighted normal
+// of the triangles around them. Both formats wind front faces counter-clockwise and this renderer
+// clockwise, so every triangle is reversed.
+
+struct ImportOptions {
+    bool weld = true;                   // Merge vertices with identical position, normal and colour
+    size_t blockSize = 32 << 20;        // Bytes of the source read and parsed at a time
+};
+
+// Parses a decimal number such as "-1.25e-3" without the C locale, so a decimal comma setting
+// cannot break files. Leading blanks are skipped.
+// Input Variables:
+// - p: First character; moved past the number when one is read
+// - end: End of the text
+// Output Variables:
+// - value: The number
+// Returns false, leaving p alone, when no number starts at p
+inline bool parseFloat(const char*& p, const char* end, float& value) {
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char* s = p;
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+    bool negative = s < end && *s == '-';
+    if (s < end && (*s == '-' || *s == '+')) s++;
+
+    // Up to 19 significant digits fit the mantissa; later ones only scale it
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; s < end && *s >= '0' && *s <= '9'; s++, any = true) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+            if (mantissa) digits++;
+        }
+        else exponent++;
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && *s >= '0' && *s <= '9'; s++, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                if (mantissa) digits++;
+                exponent--;
+            }
+        }
+    }
+    if (!any) return false;
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        const char* e = s + 1;
+        bool negativeExponent = e < end && *e == '-';
+        if (e < end && (*e == '-' || *e == '+')) e++;
+        if (e < end && *e >= '0' && *e <= '9') {
+            int x = 0;
+            for (; e < end && *e >= '0' && *e <= '9'; e++) x = std::min(x * 10 + (*e - '0'), 100000);
+            exponent += negativeExponent ? -x : x;
+            s = e;
+        }
+    }
+
+    double v = static_cast<double>(mantissa);
+    if (exponent >= 0) v = exponent <= 22 ? v * powers[exponent] : v * std::pow(10.0, exponent);
+    else v = exponent >= -22 ? v / powers[-exponent] : v * std::pow(10.0, exponent);
+    value = static_cast<float>(negative ? -v : v);
+    p = s;
+    return true;
+}
+
+// Parses a decimal integer, skipping leading blanks
+// Input Variables:
+// - p: First character; moved past the number when one is read
+// - end: End of the text
+// Output Variables:
+// - value: The number
+// Returns false, leaving p alone, when no number starts at p
+inline bool parseInt(const char*& p, const char* end, int64_t& value) {
+    const char* s = p;
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+    bool negative = s < end && *s == '-';
+    if (s < end && (*s == '-' || *s == '+')) s++;
+    if (s >= end || *s < '0' || *s > '9') return false;
+    int64_t v = 0;
+    for (; s < end && *s >= '0' && *s <= '9'; s++) v = v * 10 + (*s - '0');
+    value = negative ? -v : v;
+    p = s;
+    return true;
+}
+
+// Reads a file a block at a time. The caller consumes whole lines or records from the front of
+// the data; what it leaves is kept in front of the next block.
+class BlockReader {
+    std::ifstream file;
+    std::vector<char> buffer;
+    size_t begin = 0, end = 0;      // Unconsumed bytes
+    size_t blockSize;
+    bool eof = false;
+
+public:
+    BlockReader(const std::string& path, size_t _blockSize) : file(path, std::ios::binary), blockSize(std::max<size_t>(_blockSize, 4096)) {}
+
+    bool isOpen() const { return static_cast<bool>(file.is_open()); }
+
+    // Reads the next block after what is left; the data grows when nothing was consumed, so
+    // a line longer than a block still arrives whole
+    // Returns false when the file is exhausted and nothing is left
+    bool fill() {
+        if (eof) return end > begin;
+        size_t left = end - begin;
+        if (begin > 0) memmove(buffer.data(), buffer.data() + begin, left);
+        begin = 0;
+        end = left;
+        buffer.resize(left + blockSize);
+        file.read(buffer.data() + left, blockSize);
+        end += static_cast<size_t>(file.gcount());
+        if (!file) eof = true;
+        return end > begin;
+    }
+
+    const char* data() const { return buffer.data() + begin; }
+    size_t size() const { return end - begin; }
+    bool atEnd() const { return eof; }
+    void consume(size_t bytes) { begin += std::min(bytes, end - begin); }
+
+    // Length of the complete lines at the front of the data; everything once the file is exhausted
+    size_t completeLines() const {
+        if (eof) return size();
+        for (size_t i = size(); i > 0; i--) {
+            if (data()[i - 1] == '\n') return i;
+        }
+        return 0;
+    }
+};
+
+// Splits text into about `parts` pieces that each end after a newline
+// Input Variables:
+// - text, length: Text of whole lines
+// - parts: Pieces wanted
+// Output Variables:
+// - cuts: Start of every piece followed by the end of the last one
+inline void splitLines(const char* text, size_t length, int parts, std::vector<size_t>& cuts) {
+    cuts.assign(1, 0);
+    for (int i = 1; i < parts; i++) {
+        size_t at = std::max(length * i / parts, cuts.back());
+        const char* newline = at < length ? static_cast<const char*>(memchr(text + at, '\n', length - at)) : nullptr;
+        if (!newline) break;
+        size_t cut = static_cast<size_t>(newline - text) + 1;
+        if (cut > cuts.back() && cut < length) cuts.push_back(cut);
+    }
+    cuts.push_back(length);
+}
+
+// Finds, for every element, the first element equal to it. The elements are scattered by hash
+// into partitions, keeping their order, and every partition is searched with its own
+// open-addressing table, so no table is shared and the result does not depend on the threads.
+// Input Variables:
+// - jobSystem: Threads to use
+// - hashes: Hash of every element
+// - equal: Callable taking two element indices, true when the elements are equal
+// Output Variables:
+// - first: For every element, the smallest index of an element equal to it
+template<typename Equal>
+void findFirstEqual(JobSystem& jobSystem, const std::vector<uint64_t>& hashes, Equal&& equal, std::vector<unsigned int>& first) {
+    const int PartitionBits = 6;
+    const int Partitions = 1 << PartitionBits;
+    size_t count = hashes.size();
+    first.resize(count);
+    auto partitionOf = [](uint64_t hash) { return static_cast<int>(hash >> (64 - PartitionBits)); };
+
+    // Count every chunk's elements per partition, then scatter them to where a prefix sum puts them
+    int chunks = jobSystem.getThreadCount() * 4;
+    std::vector<size_t> offsets(static_cast<size_t>(chunks) * Partitions + 1, 0);
+    auto chunkRange = [count, chunks](int c, size_t& begin, size_t& end) {
+        begin = count * c / chunks;
+        end = count * (c + 1) / chunks;
+    };
+    jobSystem.parallelFor(chunks, 1, [&](int cBegin, int cEnd) {
+        for (int c = cBegin; c < cEnd; c++) {
+            size_t begin, end;
+            chunkRange(c, begin, end);
+            for (size_t i = begin; i < end; i++) offsets[static_cast<size_t>(partitionOf(hashes[i])) * chunks + c + 1]++;
+        }
+    });
+    for (size_t i = 1; i < offsets.size(); i++) offsets[i] += offsets[i - 1];
+    std::vector<unsigned int> order(count);
+    jobSystem.parallelFor(chunks, 1, [&](int cBegin, int cEnd) {
+        for (int c = cBegin; c < cEnd; c++) {
+            size_t begin, end;
+            chunkRange(c, begin, end);
+            for (size_t i = begin; i < end; i++) order[offsets[static_cast<size_t>(partitionOf(hashes[i])) * chunks + c]++] = static_cast<unsigned int>(i);
+        }
+    });
+    // The scatter advanced every offset to the start of the next chunk's run; the first partition starts at 0
+
+    // Slots hold the hash beside the index, so a probe reads one cache line
+    struct Slot { uint64_t hash; unsigned int index; };
+    jobSystem.parallelFor(Partitions, 1, [&](int pBegin, int pEnd) {
+        std::vector<Slot> slots;
+        for (int part = pBegin; part < pEnd; part++) {
+            size_t begin = part == 0 ? 0 : offsets[static_cast<size_t>(part) * chunks - 1];
+            size_t end = offsets[static_cast<size_t>(part + 1) * chunks - 1];
+            size_t capacity = 16;
+            while (capacity < (end - begin) * 2) capacity *= 2;
+            slots.assign(capacity, Slot{ 0, UINT32_MAX });
+
+            for (size_t k = begin; k < end; k++) {
+                unsigned int i = order[k];
+                uint64_t hash = hashes[i];
+                size_t s = hash & (capacity - 1);
+                while (true) {
+                    Slot& slot = slots[s];
+                    if (slot.index == UINT32_MAX) {
+                        slot = { hash, i };
+                        first[i] = i;
+                        break;
+                    }
+                    if (slot.hash == hash && equal(slot.index, i)) {
+                        first[i] = slot.index;
+                        break;
+                    }
+                    s = (s + 1) & (capacity - 1);
+                }
+            }
+        }
+    });
+}
+
+// Mixes the bits of a 64-bit value into a well-spread hash
+inline uint64_t mixHash(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+// Merges vertices with the same position, normal and colour (compared bit for bit) and points
+// the triangles at the survivors, which keep the order of their first appearance
+// Input Variables:
+// - jobSystem: Threads to use
+// Output Variables:
+// - mesh: Mesh whose vertex and triangle vectors are welded
+inline void weldVertices(JobSystem& jobSystem, Mesh& mesh) {
+    std::vector<Vertex>& vertices = mesh.vertices;
+    int count = static_cast<int>(vertices.size());
+    auto key = [&vertices](unsigned int i, float* out) {
+        const Vertex& v = vertices[i];
+        out[0] = v.p[0]; out[1] = v.p[1]; out[2] = v.p[2];
+        out[3] = v.normal[0]; out[4] = v.normal[1]; out[5] = v.normal[2];
+        colour rgb = v.rgb;
+        out[6] = rgb[colour::RED]; out[7] = rgb[colour::GREEN]; out[8] = rgb[colour::BLUE];
+    };
+
+    std::vector<uint64_t> hashes(count);
+    jobSystem.parallelFor(count, 1 << 14, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            float k[9];
+            key(i, k);
+            uint64_t h = 0;
+            for (int c = 0; c < 9; c++) {
+                uint32_t bits;
+                memcpy(&bits, &k[c], 4);
+                h = mixHash(h ^ bits);
+            }
+            hashes[i] = h;
+        }
+    });
+    std::vector<unsigned int> first;
+    findFirstEqual(jobSystem, hashes, [&key](unsigned int a, unsigned int b) {
+        float ka[9], kb[9];
+        key(a, ka);
+        key(b, kb);
+        return memcmp(ka, kb, sizeof(ka)) == 0;
+    }, first);
+
+    // Survivors move down in order; first[i] <= i, so it is renumbered before i is reached
+    std::vector<unsigned int> remap(count);
+    unsigned int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (first[i] == static_cast<unsigned int>(i)) {
+            if (kept != static_cast<unsigned int>(i)) vertices[kept] = vertices[i];
+            remap[i] = kept++;
+        }
+        else remap[i] = remap[first[i]];
+    }
+    vertices.resize(kept);
+
+    std::vector<triIndices>& triangles = mesh.triangles;
+    jobSystem.parallelFor(static_cast<int>(triangles.size()), 1 << 14, [&](int begin, int end) {
+        for (int t = begin; t < end; t++) {
+            for (int c = 0; c < 3; c++) triangles[t].v[c] = remap[triangles[t].v[c]];
+        }
+    });
+}
+
+// Gives every vertex whose normal is zero the area-weighted sum of the normals of the faces
+// around its position, whichever vertices of that position the faces use
+// Input Variables:
+// - jobSystem: Threads to use
+// Output Variables:
+// - mesh: Mesh whose missing normals are filled in
+inline void fillMissingNormals(JobSystem& jobSystem, Mesh& mesh) {
+    std::vector<Vertex>& vertices = mesh.vertices;
+    const std::vector<triIndices>& triangles = mesh.triangles;
+    int count = static_cast<int>(vertices.size());
+    std::vector<char> missing(count);
+    bool any = false;
+    for (int i = 0; i < count; i++) {
+        missing[i] = vertices[i].normal[0] == 0.f && vertices[i].normal[1] == 0.f && vertices[i].normal[2] == 0.f;
+        any |= missing[i] != 0;
+    }
+    if (!any) return;
+
+    // Vertices at the same position share the first of them as their position
+    std::vector<uint64_t> hashes(count);
+    jobSystem.parallelFor(count, 1 << 14, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            uint64_t h = 0;
+            for (int c = 0; c < 3; c++) {
+                uint32_t bits;
+                float x = vertices[i].p[c];
+                memcpy(&bits, &x, 4);
+                h = mixHash(h ^ bits);
+            }
+            hashes[i] = h;
+        }
+    });
+    std::vector<unsigned int> position;
+    findFirstEqual(jobSystem, hashes, [&vertices](unsigned int a, unsigned int b) {
+        return vertices[a].p[0] == vertices[b].p[0] && vertices[a].p[1] == vertices[b].p[1] && vertices[a].p[2] == vertices[b].p[2];
+    }, position);
+
+    // Face normals once, from the clockwise (this renderer's front) winding
+    std::vector<vec4> faces(triangles.size());
+    jobSystem.parallelFor(static_cast<int>(triangles.size()), 1 << 14, [&](int begin, int end) {
+        for (int t = begin; t < end; t++) {
+            const vec4& a = vertices[triangles[t].v[0]].p;
+            const vec4& b = vertices[triangles[t].v[1]].p;
+            const vec4& c = vertices[triangles[t].v[2]].p;
+            faces[t] = vec4::cross(c - a, b - a);
+        }
+    });
+
+    // One pass adds them up: a scatter to random positions, which threads would only contend on
+    std::vector<vec4> sums(count, vec4(0.f, 0.f, 0.f, 0.f));
+    for (size_t t = 0; t < triangles.size(); t++) {
+        for (int c = 0; c < 3; c++) {
+            vec4& sum = sums[position[triangles[t].v[c]]];
+            sum = vec4(sum[0] + faces[t][0], sum[1] + faces[t][1], sum[2] + faces[t][2], 0.f);
+        }
+    }
+    jobSystem.parallelFor(count, 1 << 14, [&](int begin, int end) {
+        for (int v = begin; v < end; v++) {
+            if (!missing[v]) continue;
+            vec4 n = sums[position[v]];
+            if (vec4::dot(n, n) > 0.f) n.normalise();
+            n[3] = 0.f;
+            vertices[v].normal = n;
+        }
+    });
+}
+
+// Elements of one chunk of an OBJ, in file order
+struct ObjChunk {
+    struct Corner {
+        int64_t v, n;               // Position and normal indices, n = -1 for none
+        unsigned char relative;     // Bit 0: v counts from the chunk's first position, bit 1: n from its first normal
+    };
+    std::vector<float> positions;   // x, y, z
+    std::vector<float> colours;     // r, g, b per position, once a position of the chunk has a colour
+    std::vector<float> normals;     // x, y, z
+    std::vector<Corner> corners;
+    std::vector<unsigned int> faceSizes;
+    bool valid = true;
+
+    // Parses the lines of the chunk
+    // Input Variables:
+    // - c, end: Text of whole lines
+    // - fill: Colour of positions without one
+    void parse(const char* c, const char* end, const float* fill) {
+        while (c < end) {
+            const char* lineEnd = static_cast<const char*>(memchr(c, '\n', end - c));
+            if (!lineEnd) lineEnd = end;
+            while (c < lineEnd && (*c == ' ' || *c == '\t')) c++;
+
+            if (lineEnd - c > 1 && c[0] == 'v' && (c[1] == ' ' || c[1] == '\t')) {
+                const char* p = c + 2;
+                float xyz[3] = { 0.f, 0.f, 0.f };
+                for (float& x : xyz) parseFloat(p, lineEnd, x);
+                positions.insert(positions.end(), xyz, xyz + 3);
+                // Optional colour after the position
+                float rgb[3];
+                bool coloured = parseFloat(p, lineEnd, rgb[0]) && parseFloat(p, lineEnd, rgb[1]) && parseFloat(p, lineEnd, rgb[2]);
+                if (coloured || !colours.empty()) {
+                    while (colours.size() + 3 < positions.size()) colours.insert(colours.end(), fill, fill + 3);
+                    colours.insert(colours.end(), coloured ? rgb : fill, coloured ? rgb + 3 : fill + 3);
+                }
+            }
+            else if (lineEnd - c > 2 && c[0] == 'v' && c[1] == 'n' && (c[2] == ' ' || c[2] == '\t')) {
+                const char* p = c + 3;
+                float xyz[3] = { 0.f, 0.f, 0.f };
+                for (float& x : xyz) parseFloat(p, lineEnd, x);
+                normals.insert(normals.end(), xyz, xyz + 3);
+            }
+            else if (lineEnd - c > 1 && c[0] == 'f' && (c[1] == ' ' || c[1] == '\t')) {
+                // v, v/vt, v/vt/vn or v//vn; negative indices count back from the latest element
+                const char* p = c + 2;
+                unsigned int size = 0;
+                int64_t v;
+                while (parseInt(p, lineEnd, v)) {
+                    int64_t n = 0, ignored;
+                    if (p < lineEnd && *p == '/') {
+                        p++;
+                        if (p < lineEnd && *p != '/') parseInt(p, lineEnd, ignored);
+                        if (p < lineEnd && *p == '/') {
+                            p++;
+                            parseInt(p, lineEnd, n);
+                        }
+                    }
+                    if (v == 0) valid = false;
+                    Corner corner;
+                    corner.relative = (v < 0 ? 1 : 0) | (n < 0 ? 2 : 0);
+                    corner.v = v < 0 ? static_cast<int64_t>(positions.size() / 3) + v : v - 1;
+                    corner.n = n < 0 ? static_cast<int64_t>(normals.size() / 3) + n : n - 1;
+                    corners.push_back(corner);
+                    size++;
+                }
+                faceSizes.push_back(size);
+            }
+            c = lineEnd + 1;
+        }
+    }
+};
+
+// Reads a Wavefront OBJ: positions (with the optional per-vertex colour some exporters append),
+// normals and polygon faces, split into fans. Texture coordinates, groups and materials are ignored.
+// Input Variables:
+// - jobSystem: Threads to parse with
+// - path: File to read
+// - options: Block size and welding
+// Output Variables:
+// - mesh: Mesh whose vertices and triangles are replaced; the vertex colour is mesh.col unless the file has colours
+// Returns false when the file cannot be read or a face refers to a missing position or normal
+inline bool importObj(JobSystem& jobSystem, const std::string& path, Mesh& mesh, const ImportOptions& options = ImportOptions()) {
+    BlockReader reader(path, options.blockSize);
+    if (!reader.isOpen()) return false;
+    colour col = mesh.col;
+    const float fill[3] = { col[colour::RED], col[colour::GREEN], col[colour::BLUE] };
+
+    // Elements of the whole file, merged in file order block by block. A corner is kept as the
+    // key its vertex is welded by: position index in the high half, normal index + 1 (0 for none)
+    // in the low half.
+    std::vector<float> positions, colours, normals;
+    std::vector<uint64_t> keys;
+    std::vector<unsigned int> faceSizes;
+    std::vector<size_t> cuts;
+    std::vector<ObjChunk> chunks;
+    std::atomic<bool> invalid{ false };
+
+    while (reader.fill()) {
+        size_t length = reader.completeLines();
+        if (length == 0) continue;
+        const char* text = reader.data();
+        splitLines(text, length, jobSystem.getThreadCount() * 4, cuts);
+        int chunkCount = static_cast<int>(cuts.size()) - 1;
+        chunks.assign(chunkCount, ObjChunk());
+        jobSystem.parallelFor(chunkCount, 1, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) chunks[i].parse(text + cuts[i], text + cuts[i + 1], fill);
+        });
+        reader.consume(length);
+
+        // Where every chunk's elements go, then every chunk copies its own in parallel
+        struct Offsets { size_t positions, normals, corners, faces; };
+        std::vector<Offsets> at(chunkCount + 1);
+        at[0] = { positions.size(), normals.size(), keys.size(), faceSizes.size() };
+        bool coloured = !colours.empty();
+        for (int i = 0; i < chunkCount; i++) {
+            if (!chunks[i].valid) return false;
+            at[i + 1] = { at[i].positions + chunks[i].positions.size(), at[i].normals + chunks[i].normals.size(),
+                at[i].corners + chunks[i].corners.size(), at[i].faces + chunks[i].faceSizes.size() };
+            coloured |= !chunks[i].colours.empty();
+        }
+        if (coloured && colours.empty()) {
+            for (size_t i = 0; i < positions.size(); i += 3) colours.insert(colours.end(), fill, fill + 3);
+        }
+        positions.resize(at[chunkCount].positions);
+        normals.resize(at[chunkCount].normals);
+        keys.resize(at[chunkCount].corners);
+        faceSizes.resize(at[chunkCount].faces);
+        if (coloured) colours.resize(positions.size());
+
+        jobSystem.parallelFor(chunkCount, 1, [&](int begin, int end) {
+            bool bad = false;
+            for (int i = begin; i < end; i++) {
+                const ObjChunk& chunk = chunks[i];
+                std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + at[i].positions);
+                std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + at[i].normals);
+                std::copy(chunk.faceSizes.begin(), chunk.faceSizes.end(), faceSizes.begin() + at[i].faces);
+                if (coloured) {
+                    std::copy(chunk.colours.begin(), chunk.colours.end(), colours.begin() + at[i].positions);
+                    for (size_t c = at[i].positions + chunk.colours.size(); c < at[i + 1].positions; c++) colours[c] = fill[c % 3];
+                }
+                int64_t positionBase = static_cast<int64_t>(at[i].positions / 3);
+                int64_t normalBase = static_cast<int64_t>(at[i].normals / 3);
+                uint64_t* out = &keys[at[i].corners];
+                for (const ObjChunk::Corner& corner : chunk.corners) {
+                    int64_t v = corner.v + ((corner.relative & 1) ? positionBase : 0);
+                    int64_t n = corner.n + ((corner.relative & 2) ? normalBase : 0);
+                    bool hasNormal = (corner.relative & 2) || corner.n >= 0;
+                    bad |= v < 0 || v >= UINT32_MAX || (hasNormal && (n < 0 || n + 1 >= UINT32_MAX));
+                    *out++ = (static_cast<uint64_t>(v) << 32) | static_cast<uint64_t>(hasNormal ? n + 1 : 0);
+                }
+            }
+            if (bad) invalid.store(true, std::memory_order_relaxed);
+        });
+        if (invalid.load(std::memory_order_relaxed)) return false;
+    }
+    chunks.clear();
+    if (keys.size() >= UINT32_MAX) return false;
+
+    // Corners with the same position and normal become one vertex; indices are checked now that
+    // the counts are known
+    uint64_t positionCount = positions.size() / 3;
+    uint64_t normalCount = normals.size() / 3;
+    int cornerCount = static_cast<int>(keys.size());
+    std::vector<uint64_t> hashes(cornerCount);
+    jobSystem.parallelFor(cornerCount, 1 << 16, [&](int begin, int end) {
+        bool bad = false;
+        for (int i = begin; i < end; i++) {
+            bad |= (keys[i] >> 32) >= positionCount || (keys[i] & 0xffffffffull) > normalCount;
+            hashes[i] = mixHash(keys[i]);
+        }
+        if (bad) invalid.store(true, std::memory_order_relaxed);
+    });
+    if (invalid.load(std::memory_order_relaxed)) return false;
+    std::vector<unsigned int> first;
+    findFirstEqual(jobSystem, hashes, [&keys](unsigned int a, unsigned int b) { return keys[a] == keys[b]; }, first);
+    hashes = std::vector<uint64_t>();
+
+    std::vector<unsigned int> vertexOf(cornerCount), uniqueCorners;
+    for (int i = 0; i < cornerCount; i++) {
+        if (first[i] == static_cast<unsigned int>(i)) {
+            vertexOf[i] = static_cast<unsigned int>(uniqueCorners.size());
+            uniqueCorners.push_back(i);
+        }
+        else vertexOf[i] = vertexOf[first[i]];
+    }
+    first = std::vector<unsigned int>();
+
+    std::vector<Vertex>& vertices = mesh.vertices;
+    vertices.resize(uniqueCorners.size());
+    mesh.mapped = MappedMeshData();
+    jobSystem.parallelFor(static_cast<int>(uniqueCorners.size()), 1 << 14, [&](int begin, int end) {
+        for (int k = begin; k < end; k++) {
+            uint64_t key = keys[uniqueCorners[k]];
+            size_t v = static_cast<size_t>(key >> 32);
+            size_t n = static_cast<size_t>(key & 0xffffffffull);
+            Vertex& vertex = vertices[k];
+            vertex.p = vec4(positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2]);
+            vertex.normal = n ? vec4(normals[(n - 1) * 3], normals[(n - 1) * 3 + 1], normals[(n - 1) * 3 + 2], 0.f) : vec4(0.f, 0.f, 0.f, 0.f);
+            const float* rgb = colours.empty() ? fill : &colours[v * 3];
+            vertex.rgb = colour(rgb[0], rgb[1], rgb[2]);
+        }
+    });
+
+    // Fans of reversed triangles, each face writing from its own offset
+    std::vector<size_t> faceCorner(faceSizes.size() + 1, 0), faceTriangle(faceSizes.size() + 1, 0);
+    for (size_t f = 0; f < faceSizes.size(); f++) {
+        faceCorner[f + 1] = faceCorner[f] + faceSizes[f];
+        faceTriangle[f + 1] = faceTriangle[f] + (faceSizes[f] > 2 ? faceSizes[f] - 2 : 0);
+    }
+    std::vector<triIndices>& triangles = mesh.triangles;
+    triangles.assign(faceTriangle.back(), triIndices(0, 0, 0));
+    jobSystem.parallelFor(static_cast<int>(faceSizes.size()), 1 << 14, [&](int begin, int end) {
+        for (int f = begin; f < end; f++) {
+            const unsigned int* face = vertexOf.data() + faceCorner[f];
+            size_t t = faceTriangle[f];
+            for (unsigned int i = 2; i < faceSizes[f]; i++) triangles[t++] = triIndices(face[0], face[i], face[i - 1]);
+        }
+    });
+
+    if (options.weld) weldVertices(jobSystem, mesh);
+    fillMissingNormals(jobSystem, mesh);
+    return true;
+}
+
+// Types of PLY properties
+enum class PlyType : unsigned char { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid };
+
+struct PlyProperty {
+    std::string name;
+    PlyType type = PlyType::Invalid;
+    PlyType countType = PlyType::Invalid;   // Type of the item count of a list property
+    bool list = false;
+};
+
+struct PlyElement {
+    std::string name;
+    uint64_t count = 0;
+    std::vector<PlyProperty> properties;
+};
+
+// Type of a PLY type name, Invalid when unknown
+inline PlyType plyType(const std::string& name) {
+    static const char* names[][2] = { { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+        { "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" } };
+    for (int t = 0; t < 8; t++) {
+        if (name == names[t][0] || name == names[t][1]) return static_cast<PlyType>(t);
+    }
+    return PlyType::Invalid;
+}
+
+// Bytes of a binary PLY value
+inline size_t plySize(PlyType type) {
+    static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+    return sizes[static_cast<int>(type)];
+}
+
+// Reads a binary PLY value
+// Input Variables:
+// - p: First byte
+// - type: Type stored
+// - swap: Whether the file's byte order is not the machine's
+inline double readPly(const unsigned char* p, PlyType type, bool swap) {
+    unsigned char b[8];
+    size_t size = plySize(type);
+    for (size_t i = 0; i < size; i++) b[i] = swap ? p[size - 1 - i] : p[i];
+    switch (type) {
+    case PlyType::Int8: { int8_t v; memcpy(&v, b, 1); return v; }
+    case PlyType::UInt8: return b[0];
+    case PlyType::Int16: { int16_t v; memcpy(&v, b, 2); return v; }
+    case PlyType::UInt16: { uint16_t v; memcpy(&v, b, 2); return v; }
+    case PlyType::Int32: { int32_t v; memcpy(&v, b, 4); return v; }
+    case PlyType::UInt32: { uint32_t v; memcpy(&v, b, 4); return v; }
+    case PlyType::Float32: { float v; memcpy(&v, b, 4); return v; }
+    case PlyType::Float64: { double v; memcpy(&v, b, 8); return v; }
+    default: return 0.0;
+    }
+}
+
+// Where the properties of a PLY vertex go: 0-2 position, 3-5 normal, 6-8 colour, -1 nowhere
+struct PlyVertexLayout {
+    std::vector<int> slots;
+    std::vector<float> scales;      // Integer colours are scaled to 0-1
+
+    explicit PlyVertexLayout(const PlyElement& element) {
+        static const char* names[] = { "x", "y", "z", "nx", "ny", "nz", "red", "green", "blue" };
+        for (const PlyProperty& property : element.properties) {
+            int slot = -1;
+            for (int s = 0; s < 9; s++) {
+                if (!property.list && property.name == names[s]) slot = s;
+            }
+            slots.push_back(slot);
+            float scale = 1.f;
+            if (slot >= 6 && property.type == PlyType::UInt8) scale = 1.f / 255.f;
+            if (slot >= 6 && property.type == PlyType::UInt16) scale = 1.f / 65535.f;
+            scales.push_back(scale);
+        }
+    }
+
+    // Builds a vertex from the values of the slots
+    static Vertex vertex(const float* v) {
+        return { vec4(v[0], v[1], v[2]), vec4(v[3], v[4], v[5], 0.f), colour(v[6], v[7], v[8]) };
+    }
+};
+
+// Index of the vertex index list of a PLY face element, -1 if it has none
+inline int plyFaceList(const PlyElement& element) {
+    for (size_t i = 0; i < element.properties.size(); i++) {
+        const PlyProperty& property = element.properties[i];
+        if (property.list && (property.name == "vertex_indices" || property.name == "vertex_index")) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+// Adds the reversed fan of a polygon
+// Returns false when an index is out of range
+inline bool addPlyFace(const int64_t* indices, size_t count, size_t vertexCount, std::vector<triIndices>& triangles) {
+    for (size_t i = 0; i < count; i++) {
+        if (indices[i] < 0 || static_cast<size_t>(indices[i]) >= vertexCount) return false;
+    }
+    for (size_t i = 2; i < count; i++) {
+        triangles.emplace_back(static_cast<unsigned int>(indices[0]), static_cast<unsigned int>(indices[i]), static_cast<unsigned int>(indices[i - 1]));
+    }
+    return true;
+}
+
+// Reads the ASCII body of a PLY: every block's lines are counted per chunk in parallel, so each
+// chunk knows the element of every line and writes vertices straight to their place
+inline bool importPlyAscii(JobSystem& jobSystem, BlockReader& reader, const std::vector<PlyElement>& elements, int vertexElement, int faceElement, Mesh& mesh) {
+    std::vector<uint64_t> firstLine(elements.size() + 1, 0);
+    for (size_t e = 0; e < elements.size(); e++) firstLine[e + 1] = firstLine[e] + elements[e].count;
+    PlyVertexLayout layout(elements[vertexElement]);
+    int faceList = faceElement >= 0 ? plyFaceList(elements[faceElement]) : -1;
+    const uint64_t vertexBegin = firstLine[vertexElement];
+    const uint64_t vertexEnd = firstLine[vertexElement + 1];
+    const uint64_t faceBegin = faceElement >= 0 ? firstLine[faceElement] : 0;
+    const uint64_t faceEnd = faceElement >= 0 ? firstLine[faceElement + 1] : 0;
+    colour col = mesh.col;
+    const float fill[3] = { col[colour::RED], col[colour::GREEN], col[colour::BLUE] };
+    size_t vertexCount = mesh.vertices.size();
+
+    struct Chunk {
+        uint64_t lines = 0;
+        std::vector<triIndices> triangles;
+        bool valid = true;
+    };
+    std::vector<Chunk> chunks;
+    std::vector<size_t> cuts;
+    uint64_t line = 0;
+    while (line < firstLine.back() && reader.fill()) {
+        size_t length = reader.completeLines();
+        if (length == 0) continue;
+        const char* text = reader.data();
+        splitLines(text, length, jobSystem.getThreadCount() * 4, cuts);
+        int chunkCount = static_cast<int>(cuts.size()) - 1;
+        chunks.assign(chunkCount, Chunk());
+        jobSystem.parallelFor(chunkCount, 1, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                const char* c = text + cuts[i];
+                const char* e = text + cuts[i + 1];
+                uint64_t lines = 0;
+                while ((c = static_cast<const char*>(memchr(c, '\n', e - c)))) {
+                    lines++;
+                    c++;
+                }
+                if (cuts[i + 1] == length && length > 0 && text[length - 1] != '\n') lines++;
+                chunks[i].lines = lines;
+            }
+        });
+        std::vector<uint64_t> chunkLine(chunkCount + 1, line);
+        for (int i = 0; i < chunkCount; i++) chunkLine[i + 1] = chunkLine[i] + chunks[i].lines;
+
+        jobSystem.parallelFor(chunkCount, 1, [&](int begin, int end) {
+            std::vector<int64_t> indices;
+            for (int i = begin; i < end; i++) {
+                Chunk& chunk = chunks[i];
+                const char* c = text + cuts[i];
+                const char* e = text + cuts[i + 1];
+                for (uint64_t l = chunkLine[i]; l < chunkLine[i + 1] && c < e; l++) {
+                    const char* lineEnd = static_cast<const char*>(memchr(c, '\n', e - c));
+                    if (!lineEnd) lineEnd = e;
+                    if (l >= vertexBegin && l < vertexEnd) {
+                        float v[9] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, fill[0], fill[1], fill[2] };
+                        const char* p = c;
+                        for (size_t k = 0; k < layout.slots.size(); k++) {
+                            float value = 0.f;
+                            chunk.valid &= parseFloat(p, lineEnd, value);
+                            if (layout.slots[k] >= 0) v[layout.slots[k]] = value * layout.scales[k];
+                        }
+                        mesh.vertices[l - vertexBegin] = PlyVertexLayout::vertex(v);
+                    }
+                    else if (l >= faceBegin && l < faceEnd) {
+                        // Properties before the list are skipped, those after it ignored
+                        const char* p = c;
+                        int64_t count = 0, ignored;
+                        for (int k = 0; k < faceList; k++) {
+                            if (elements[faceElement].properties[k].list && parseInt(p, lineEnd, count)) {
+                                for (int64_t j = 0; j < count; j++) parseInt(p, lineEnd, ignored);
+                            }
+                            else {
+                                float value;
+                                parseFloat(p, lineEnd, value);
+                            }
+                        }
+                        indices.clear();
+                        if (parseInt(p, lineEnd, count)) {
+                            for (int64_t j = 0; j < count && parseInt(p, lineEnd, ignored); j++) indices.push_back(ignored);
+                        }
+                        chunk.valid &= static_cast<int64_t>(indices.size()) == count && addPlyFace(indices.data(), indices.size(), vertexCount, chunk.triangles);
+                    }
+                    c = lineEnd + 1;
+                }
+            }
+        });
+        reader.consume(length);
+        line = chunkLine.back();
+
+        for (Chunk& chunk : chunks) {
+            if (!chunk.valid) return false;
+            mesh.triangles.insert(mesh.triangles.end(), chunk.triangles.begin(), chunk.triangles.end());
+        }
+    }
+    return line >= firstLine.back();
+}
+
+// Reads the binary body of a PLY. Vertices without list properties have a fixed size, so every
+// block's whole records are decoded in parallel; other elements are walked record by record.
+inline bool importPlyBinary(JobSystem& jobSystem, BlockReader& reader, const std::vector<PlyElement>& elements, int vertexElement, int faceElement, bool swap, Mesh& mesh) {
+    PlyVertexLayout layout(elements[vertexElement]);
+    colour col = mesh.col;
+    const float fill[3] = { col[colour::RED], col[colour::GREEN], col[colour::BLUE] };
+    size_t vertexCount = mesh.vertices.size();
+    std::vector<int64_t> indices;
+
+    for (size_t e = 0; e < elements.size(); e++) {
+        const PlyElement& element = elements[e];
+        bool fixed = true;
+        size_t stride = 0;
+        for (const PlyProperty& property : element.properties) {
+            fixed &= !property.list;
+            stride += plySize(property.type);
+        }
+        int faceList = static_cast<int>(e) == faceElement ? plyFaceList(element) : -1;
+
+        uint64_t record = 0;
+        while (record < element.count) {
+            if (reader.size() == 0 || !fixed) {
+                if (!reader.fill() && reader.size() == 0) return false;
+            }
+            const unsigned char* data = reinterpret_cast<const unsigned char*>(reader.data());
+            size_t size = reader.size();
+
+            if (fixed) {
+                uint64_t records = std::min<uint64_t>(element.count - record, size / std::max<size_t>(stride, 1));
+                if (records == 0) {
+                    if (reader.atEnd()) return false;
+                    reader.fill();
+                    continue;
+                }
+                if (static_cast<int>(e) == vertexElement) {
+                    uint64_t base = record;
+                    jobSystem.parallelFor(static_cast<int>(records), 1 << 14, [&](int begin, int end) {
+                        for (int r = begin; r < end; r++) {
+                            float v[9] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, fill[0], fill[1], fill[2] };
+                            const unsigned char* p = data + static_cast<size_t>(r) * stride;
+                            for (size_t k = 0; k < layout.slots.size(); k++) {
+                                PlyType type = element.properties[k].type;
+                                if (layout.slots[k] >= 0) v[layout.slots[k]] = static_cast<float>(readPly(p, type, swap)) * layout.scales[k];
+                                p += plySize(type);
+                            }
+                            mesh.vertices[base + r] = PlyVertexLayout::vertex(v);
+                        }
+                    });
+                }
+                reader.consume(static_cast<size_t>(records * stride));
+                record += records;
+                continue;
+            }
+
+            // Records of variable size, decoded one after another until the block runs out.
+            // Faces that are only a byte count and 32-bit indices in the machine's order, as most
+            // exporters write them, are read without the per-value decoding.
+            bool packedFaces = faceList == 0 && element.properties.size() == 1 && !swap
+                && plySize(element.properties[0].countType) == 1 && plySize(element.properties[0].type) == 4;
+            bool signedIndices = packedFaces && element.properties[0].type == PlyType::Int32;
+            size_t at = 0;
+            while (record < element.count) {
+                size_t p = at;
+                if (packedFaces) {
+                    if (p >= size || p + 1 + data[p] * 4 > size) break;
+                    size_t count = data[p];
+                    indices.resize(count);
+                    for (size_t j = 0; j < count; j++) {
+                        if (signedIndices) {
+                            int32_t index;
+                            memcpy(&index, data + p + 1 + j * 4, 4);
+                            indices[j] = index;
+                        }
+                        else {
+                            uint32_t index;
+                            memcpy(&index, data + p + 1 + j * 4, 4);
+                            indices[j] = index;
+                        }
+                    }
+                    if (!addPlyFace(indices.data(), count, vertexCount, mesh.triangles)) return false;
+                    at = p + 1 + count * 4;
+                    record++;
+                    continue;
+                }
+                bool complete = true;
+                bool vertex = static_cast<int>(e) == vertexElement;
+                float v[9] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, fill[0], fill[1], fill[2] };
+                indices.clear();
+                for (size_t k = 0; k < element.properties.size() && complete; k++) {
+                    const PlyProperty& property = element.properties[k];
+                    if (property.list) {
+                        size_t countSize = plySize(property.countType);
+                        if (p + countSize > size) { complete = false; break; }
+                        size_t count = static_cast<size_t>(readPly(data + p, property.countType, swap));
+                        p += countSize;
+                        size_t itemSize = plySize(property.type);
+                        if (p + count * itemSize > size) { complete = false; break; }
+                        if (static_cast<int>(k) == faceList) {
+                            for (size_t j = 0; j < count; j++) indices.push_back(static_cast<int64_t>(readPly(data + p + j * itemSize, property.type, swap)));
+                        }
+                        p += count * itemSize;
+                    }
+                    else {
+                        size_t itemSize = plySize(property.type);
+                        if (p + itemSize > size) { complete = false; break; }
+                        if (vertex && layout.slots[k] >= 0) v[layout.slots[k]] = static_cast<float>(readPly(data + p, property.type, swap)) * layout.scales[k];
+                        p += itemSize;
+                    }
+                }
+                if (!complete) break;
+                if (vertex) mesh.vertices[record] = PlyVertexLayout::vertex(v);
+                if (faceList >= 0 && !addPlyFace(indices.data(), indices.size(), vertexCount, mesh.triangles)) return false;
+                at = p;
+                record++;
+            }
+            reader.consume(at);
+            if (at == 0 && reader.atEnd() && record < element.count) return false;
+        }
+    }
+    return true;
+}
+
+// Reads a Stanford PLY, ASCII or binary of either byte order: the vertex element's position,
+// normal and colour (integer colours scaled to 0-1) and the face element's vertex index lists,
+// split into fans. Other elements and properties are skipped.
+// Input Variables:
+// - jobSystem: Threads to parse with
+// - path: File to read
+// - options: Block size and welding
+// Output Variables:
+// - mesh: Mesh whose vertices and triangles are replaced; the vertex colour is mesh.col unless the file has colours
+// Returns false when the file cannot be read, has no vertex element or is cut short, or a face
+// refers to a missing vertex
+inline bool importPly(JobSystem& jobSystem, const std::string& path, Mesh& mesh, const ImportOptions& options = ImportOptions()) {
+    BlockReader reader(path, options.blockSize);
+    if (!reader.isOpen()) return false;
+
+    // The header, read whole
+    size_t headerLength = 0;
+    while (headerLength == 0) {
+        if (!reader.fill()) return false;
+        std::string text(reader.data(), reader.size());
+        size_t end = text.find("end_header");
+        if (end != std::string::npos) {
+            size_t newline = text.find('\n', end);
+            if (newline != std::string::npos) headerLength = newline + 1;
+        }
+        if (headerLength == 0 && reader.atEnd()) return false;
+    }
+    std::istringstream header(std::string(reader.data(), headerLength));
+    reader.consume(headerLength);
+
+    std::string line, word, format;
+    std::vector<PlyElement> elements;
+    std::getline(header, line);
+    if (line.compare(0, 3, "ply") != 0) return false;
+    while (std::getline(header, line)) {
+        std::istringstream words(line);
+        words >> word;
+        if (word == "format") words >> format;
+        else if (word == "element") {
+            elements.emplace_back();
+            words >> elements.back().name >> elements.back().count;
+        }
+        else if (word == "property" && !elements.empty()) {
+            PlyProperty property;
+            std::string type;
+            words >> type;
+            if (type == "list") {
+                std::string countType;
+                words >> countType >> type;
+                property.list = true;
+                property.countType = plyType(countType);
+                if (property.countType == PlyType::Invalid) return false;
+            }
+            property.type = plyType(type);
+            words >> property.name;
+            if (property.type == PlyType::Invalid) return false;
+            elements.back().properties.push_back(property);
+        }
+    }
+
+    int vertexElement = -1, faceElement = -1;
+    for (size_t e = 0; e < elements.size(); e++) {
+        if (elements[e].name == "vertex") vertexElement = static_cast<int>(e);
+        if (elements[e].name == "face") faceElement = static_cast<int>(e);
+    }
+    if (vertexElement < 0 || elements[vertexElement].count >= UINT32_MAX) return false;
+
+    mesh.mapped = MappedMeshData();
+    mesh.vertices.assign(static_cast<size_t>(elements[vertexElement].count), Vertex());
+    mesh.triangles.clear();
+    bool read;
+    if (format == "ascii") read = importPlyAscii(jobSystem, reader, elements, vertexElement, faceElement, mesh);
+    else if (format == "binary_little_endian" || format == "binary_big_endian") {
+        const uint16_t one = 1;
+        bool littleEndian = *reinterpret_cast<const unsigned char*>(&one) == 1;
+        read = importPlyBinary(jobSystem, reader, elements, vertexElement, faceElement, littleEndian != (format == "binary_little_endian"), mesh);
+    }
+    else return false;
+    if (!read) return false;
+
+    if (options.weld) weldVertices(jobSystem, mesh);
+    fillMissingNormals(jobSystem, mesh);
+    return true;
+}
+
+// Reads an OBJ or PLY file, told apart by the "ply" line that starts every PLY
+// Input Variables:
+// - jobSystem: Threads to parse with
+// - path: File to read
+// - options: Block size and welding
+// Output Variables:
+// - mesh: Mesh whose vertices and triangles are replaced
+// Returns false when the file cannot be read, see importObj() and importPly()
+inline bool importMesh(JobSystem& jobSystem, const std::string& path, Mesh& mesh, const ImportOptions& options = ImportOptions()) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[4] = {};
+    file.read(magic, 4);
+    bool ply = memcmp(magic, "ply", 3) == 0 && (magic[3] == '\n' || magic[3] == '\r');
+    file.close();
+    return ply ? importPly(jobSystem, path, mesh, options) : importObj(jobSystem, path, mesh, options);
+}
+
+// Converts an OBJ or PLY file into a mesh file for loadMeshFile()
+// Input Variables:
+// - jobSystem: Threads to parse with
+// - sourcePath: OBJ or PLY file to read
+// - meshPath: Mesh file to write
+// - options: Block size and welding
+// Returns false when the source cannot be read or the mesh file written
+inline bool convertToMeshFile(JobSystem& jobSystem, const std::string& sourcePath, const std::string& meshPath, const ImportOptions& options = ImportOptions()) {
+    Mesh mesh;
+    return importMesh(jobSystem, sourcePath, mesh, options) && saveMeshFile(mesh, meshPath);
+}
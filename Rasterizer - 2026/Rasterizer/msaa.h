@@ -0,0 +1,166 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include "GamesEngineeringBase.h"
+#include "arena.h"
+
+// Colour and depth of the four samples of one pixel that is not fully covered by a single triangle
+struct SampleBlock {
+    float depth[4];
+    unsigned char rgb[4][3];
+};
+
+// 4x multisample colour and depth target with per-pixel compression.
+// A pixel starts (and usually stays) compressed: one depth and one colour stand for all four
+// samples. Only when a triangle edge or a partial depth test splits a pixel are its samples
+// expanded into a SampleBlock. Blocks are allocated from the frame arena of the worker thread that
+// expands the pixel, so they stay valid until render() resets the arenas for the next frame;
+// clear() must run before that. resolve() averages the samples into the canvas.
+class MsaaBuffer {
+public:
+    static const int Samples = 4;
+    static const unsigned int FullMask = (1u << Samples) - 1;
+
+    // Rotated-grid sample offsets around the point triangle::draw evaluates for a pixel
+    static constexpr float offsets[Samples][2] = {
+        { -0.125f, -0.375f }, { 0.375f, -0.125f }, { -0.375f, 0.125f }, { 0.125f, 0.375f }
+    };
+
+private:
+    unsigned int width = 0, height = 0;
+    std::vector<float> depth;                   // Depth of each compressed pixel
+    std::vector<unsigned char> rgb;             // Colour of each compressed pixel, 3 bytes
+    std::vector<SampleBlock*> block;            // Expanded samples, nullptr while compressed
+    std::vector<int> expanded;                  // Number of pixels of each row expanded this frame
+    bool resolved = false;                      // True once the canvas holds the samples written since clear()
+
+public:
+    // Allocates the buffer
+    // Input Variables:
+    // - w, h: Size in pixels
+    void create(unsigned int w, unsigned int h) {
+        width = w;
+        height = h;
+        depth.resize(w * h);
+        rgb.resize(w * h * 3);
+        block.resize(w * h);
+        expanded.resize(h);
+        clear();
+    }
+
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+
+    // Resets every pixel to a single far, black sample
+    void clear() {
+        std::fill(depth.begin(), depth.end(), 1.0f);
+        std::fill(rgb.begin(), rgb.end(), 0);
+        std::fill(block.begin(), block.end(), nullptr);
+        std::fill(expanded.begin(), expanded.end(), 0);
+        resolved = false;
+    }
+
+    // Depth tests the samples of one pixel covered by a triangle
+    // Input Variables:
+    // - x, y: Pixel coordinates
+    // - mask: Samples covered by the triangle, bit s for sample s
+    // - z: Depth of the triangle at each sample
+    // Returns the samples that passed the depth test; the caller shades only when it is non-zero
+    unsigned int test(int x, int y, unsigned int mask, const float* z) const {
+        int i = y * width + x;
+        unsigned int pass = 0;
+        if (!block[i]) {
+            for (int s = 0; s < Samples; s++) {
+                if ((mask & (1u << s)) && depth[i] > z[s] && z[s] > 0.001f) pass |= 1u << s;
+            }
+        }
+        else {
+            const SampleBlock& b = *block[i];
+            for (int s = 0; s < Samples; s++) {
+                if ((mask & (1u << s)) && b.depth[s] > z[s] && z[s] > 0.001f) pass |= 1u << s;
+            }
+        }
+        return pass;
+    }
+
+    // Writes the samples returned by test()
+    // Input Variables:
+    // - x, y: Pixel coordinates
+    // - pass: Samples to write
+    // - z: Depth of the triangle at each sample
+    // - centreDepth: Depth stored when all four samples are written, so the pixel stays compressed
+    // - c: Colour to write, 3 bytes
+    void write(int x, int y, unsigned int pass, const float* z, float centreDepth, const unsigned char* c) {
+        int i = y * width + x;
+        if (pass == FullMask) {
+            // A single triangle owns the whole pixel: (re)compress it. A dropped block stays
+            // in the arena until the next frame.
+            block[i] = nullptr;
+            depth[i] = centreDepth;
+            rgb[i * 3] = c[0]; rgb[i * 3 + 1] = c[1]; rgb[i * 3 + 2] = c[2];
+            return;
+        }
+
+        if (!block[i]) {
+            SampleBlock* b = FrameArena::local().allocate<SampleBlock>();
+            for (int s = 0; s < Samples; s++) {
+                b->depth[s] = depth[i];
+                b->rgb[s][0] = rgb[i * 3]; b->rgb[s][1] = rgb[i * 3 + 1]; b->rgb[s][2] = rgb[i * 3 + 2];
+            }
+            block[i] = b;
+            expanded[y]++;
+        }
+
+        SampleBlock& b = *block[i];
+        for (int s = 0; s < Samples; s++) {
+            if (pass & (1u << s)) {
+                b.depth[s] = z[s];
+                b.rgb[s][0] = c[0]; b.rgb[s][1] = c[1]; b.rgb[s][2] = c[2];
+            }
+        }
+    }
+
+    // Number of pixels whose samples were expanded this frame (including ones later recompressed)
+    size_t expandedCount() const {
+        size_t n = 0;
+        for (int e : expanded) n += e;
+        return n;
+    }
+
+    // True when resolve() has covered every row since the last clear()
+    bool isResolved() const { return resolved; }
+
+    // Record that the caller resolved every row itself, e.g. split over several threads
+    void markResolved() { resolved = true; }
+
+    // Averages the samples of every pixel into the canvas
+    // Input Variables:
+    // - canvas: Window whose back buffer receives the resolved image
+    void resolve(GamesEngineeringBase::Window& canvas) {
+        resolve(canvas, 0, height);
+        resolved = true;
+    }
+
+    // Averages the samples of a range of rows into the canvas; ranges can be resolved in parallel
+    // Input Variables:
+    // - canvas: Window whose back buffer receives the resolved image
+    // - minY, maxY: First row and one past the last row to resolve
+    void resolve(GamesEngineeringBase::Window& canvas, unsigned int minY, unsigned int maxY) const {
+        for (unsigned int y = minY; y < maxY; y++) {
+            for (unsigned int x = 0; x < width; x++) {
+                int i = y * width + x;
+                if (!block[i]) {
+                    canvas.draw(x, y, rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+                    continue;
+                }
+                const SampleBlock& b = *block[i];
+                unsigned int r = 0, g = 0, bl = 0;
+                for (int s = 0; s < Samples; s++) {
+                    r += b.rgb[s][0]; g += b.rgb[s][1]; bl += b.rgb[s][2];
+                }
+                canvas.draw(x, y, (unsigned char)((r + Samples / 2) / Samples), (unsigned char)((g + Samples / 2) / Samples), (unsigned char)((bl + Samples / 2) / Samples));
+            }
+        }
+    }
+};
@@ -0,0 +1,397 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "simd.h"
+#include "vec4.h"
+#include "matrix.h"
+#include "mesh.h"
+#include "arena.h"
+#include "msaa.h"
+
+// Small depth buffer of the largest meshes in view, for skipping meshes hidden behind them before
+// their vertices are transformed. A buffer pixel stands for a block of canvas pixels, and only
+// takes an occluder's depth once the occluder is known to cover the whole block (plus a margin of
+// one canvas pixel for the multisample offsets). It then takes the farthest depth the occluder has
+// anywhere over the block, so every canvas pixel under it ends up at least as near, and anything
+// whose nearest depth lies behind that everywhere under its screen rectangle cannot pass the
+// depth test.
+//
+// Coverage is found for a whole mesh rather than per triangle, so a finely tessellated occluder
+// fills its silhouette: a block is covered when the mesh's front faces cover its centre and no
+// outline edge of those faces passes through it. An outline edge is one no other front face runs
+// back along, matched by position so split vertices still join. Triangles the renderer skips,
+// i.e. back faces, those under a pixel of area and those crossing the near plane, take no part.
+// Edges shared by two front faces need care too: the renderer steps its edge functions across
+// each triangle, so a pixel or sample lying right on the shared edge can be missed by both and
+// show what is behind. The blocks of such pixels are left uncovered.
+class OcclusionBuffer {
+public:
+    // Room for the rounding of the depth the renderer steps across a triangle
+    static constexpr float DepthSlack = 1e-4f;
+
+private:
+    // Flags of a buffer pixel while a mesh is drawn
+    static const int32_t CentreCovered = 1;     // A front face covers the centre
+    static const int32_t OnOutline = 2;         // An outline edge passes through, or a pixel may fall in a crack
+
+    // Directed edge between two screen positions, compared by bits
+    struct EdgeKey {
+        uint32_t bits[4];   // Start x, y and end x, y
+
+        bool operator == (const EdgeKey& other) const { return std::memcmp(bits, other.bits, sizeof(bits)) == 0; }
+        bool empty() const { return bits[0] == 0xffffffffu && bits[1] == 0xffffffffu; }
+        size_t hash() const {
+            uint64_t h = 14695981039346656037ull;
+            for (uint32_t b : bits) h = (h ^ b) * 1099511628211ull;
+            return static_cast<size_t>(h ^ (h >> 29));
+        }
+    };
+
+    int width = 0, height = 0;                  // Buffer size, width a multiple of 4
+    float scaleX = 1.f, scaleY = 1.f;           // Buffer pixels per canvas pixel
+    float canvasW = 0.f, canvasH = 0.f;
+    float marginX = 0.f, marginY = 0.f;         // One canvas pixel in buffer pixels
+    std::vector<float> depth;
+    std::vector<float> meshDepth;               // Farthest depth of the mesh being drawn over each pixel
+    std::vector<int32_t> meshFlags;             // CentreCovered and OnOutline of the mesh being drawn
+
+    static EdgeKey edgeKey(const vec4& a, const vec4& b) {
+        EdgeKey key;
+        float coords[4] = { a[0], a[1], b[0], b[1] };
+        std::memcpy(key.bits, coords, sizeof(coords));
+        return key;
+    }
+
+    // Inserts a key into an open-addressed table, or finds it
+    // Returns true when the key was already there
+    static bool insertEdge(EdgeKey* table, size_t mask, const EdgeKey& key) {
+        for (size_t slot = key.hash() & mask;; slot = (slot + 1) & mask) {
+            if (table[slot].empty()) {
+                table[slot] = key;
+                return false;
+            }
+            if (table[slot] == key) return true;
+        }
+    }
+
+    static bool findEdge(const EdgeKey* table, size_t mask, const EdgeKey& key) {
+        for (size_t slot = key.hash() & mask;; slot = (slot + 1) & mask) {
+            if (table[slot].empty()) return false;
+            if (table[slot] == key) return true;
+        }
+    }
+
+    // Buffer pixels whose grown square [i - mx, i + 1 + mx] may overlap [lo, hi] on one axis
+    static void pixelRange(float lo, float hi, float margin, int size, int& first, int& last) {
+        first = std::max(static_cast<int>(std::floor(lo - 1.f - margin)), 0);
+        last = std::min(static_cast<int>(std::floor(hi + margin)), size - 1);
+    }
+
+    // Adds a front face of the mesh being drawn: marks the pixels whose centres it covers and
+    // raises the mesh's depth over every pixel it may reach
+    // Input Variables:
+    // - p0, p1, p2: Canvas-space positions, wound as front faces are
+    void rasterizeTriangle(const vec4& p0, const vec4& p1, const vec4& p2) {
+        float x[3] = { p0[0] * scaleX, p1[0] * scaleX, p2[0] * scaleX };
+        float y[3] = { p0[1] * scaleY, p1[1] * scaleY, p2[1] * scaleY };
+        float z[3] = { p0[2], p1[2], p2[2] };
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+        if (area <= 0.f) return;
+
+        // Edge k runs from vertex k to vertex k + 1 and is A*x + B*y + C, taken at pixel centres
+        float A[3], B[3], C[3];
+        for (int k = 0; k < 3; k++) {
+            int n = (k + 1) % 3;
+            float ex = x[n] - x[k], ey = y[n] - y[k];
+            A[k] = -ey;
+            B[k] = ex;
+            C[k] = ey * x[k] - ex * y[k] + 0.5f * (A[k] + B[k]);
+        }
+
+        // Depth is affine in screen space; the edge opposite each vertex weighs it. The farthest
+        // depth over a grown pixel square is taken, but never beyond the farthest vertex.
+        float invArea = 1.f / area;
+        float dzdx = (A[1] * z[0] + A[2] * z[1] + A[0] * z[2]) * invArea;
+        float dzdy = (B[1] * z[0] + B[2] * z[1] + B[0] * z[2]) * invArea;
+        float z0 = z[0] - dzdx * x[0] - dzdy * y[0];
+        z0 += dzdx > 0.f ? dzdx * (1.f + marginX) : -dzdx * marginX;
+        z0 += dzdy > 0.f ? dzdy * (1.f + marginY) : -dzdy * marginY;
+        float zMax = std::max({ z[0], z[1], z[2] });
+
+        int startX, endX, startY, endY;
+        pixelRange(std::min({ x[0], x[1], x[2] }), std::max({ x[0], x[1], x[2] }), marginX, width, startX, endX);
+        pixelRange(std::min({ y[0], y[1], y[2] }), std::max({ y[0], y[1], y[2] }), marginY, height, startY, endY);
+        startX &= ~3;
+
+        for (int j = startY; j <= endY; j++) {
+            float* rowDepth = &meshDepth[static_cast<size_t>(j) * width];
+            int32_t* rowFlags = &meshFlags[static_cast<size_t>(j) * width];
+            float fy = static_cast<float>(j);
+#if RASTER_SIMD
+            // Four pixels at a time, edges and depth stepped across the lanes
+            const __m128 lanes = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+            __m128 e0 = _mm_add_ps(_mm_set1_ps(A[0] * startX + B[0] * fy + C[0]), _mm_mul_ps(_mm_set1_ps(A[0]), lanes));
+            __m128 e1 = _mm_add_ps(_mm_set1_ps(A[1] * startX + B[1] * fy + C[1]), _mm_mul_ps(_mm_set1_ps(A[1]), lanes));
+            __m128 e2 = _mm_add_ps(_mm_set1_ps(A[2] * startX + B[2] * fy + C[2]), _mm_mul_ps(_mm_set1_ps(A[2]), lanes));
+            __m128 zf = _mm_add_ps(_mm_set1_ps(dzdx * startX + dzdy * fy + z0), _mm_mul_ps(_mm_set1_ps(dzdx), lanes));
+            __m128 s0 = _mm_set1_ps(4.f * A[0]), s1 = _mm_set1_ps(4.f * A[1]), s2 = _mm_set1_ps(4.f * A[2]), sz = _mm_set1_ps(4.f * dzdx);
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 far = _mm_set1_ps(zMax);
+            const __m128i covered = _mm_set1_epi32(CentreCovered);
+            for (int i = startX; i <= endX; i += 4) {
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+                _mm_storeu_ps(rowDepth + i, _mm_max_ps(_mm_loadu_ps(rowDepth + i), _mm_min_ps(zf, far)));
+                __m128i flags = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rowFlags + i));
+                flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(inside), covered));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(rowFlags + i), flags);
+                e0 = _mm_add_ps(e0, s0);
+                e1 = _mm_add_ps(e1, s1);
+                e2 = _mm_add_ps(e2, s2);
+                zf = _mm_add_ps(zf, sz);
+            }
+#else
+            for (int i = startX; i <= endX; i++) {
+                float fx = static_cast<float>(i);
+                rowDepth[i] = std::max(rowDepth[i], std::min(dzdx * fx + dzdy * fy + z0, zMax));
+                if (A[0] * fx + B[0] * fy + C[0] >= 0.f && A[1] * fx + B[1] * fy + C[1] >= 0.f && A[2] * fx + B[2] * fy + C[2] >= 0.f) {
+                    rowFlags[i] |= CentreCovered;
+                }
+            }
+#endif
+        }
+    }
+
+    // Marks the pixels whose grown squares an outline edge touches
+    // Input Variables:
+    // - a, b: Canvas-space end points
+    void markOutline(const vec4& a, const vec4& b) {
+        float ax = a[0] * scaleX, ay = a[1] * scaleY, bx = b[0] * scaleX, by = b[1] * scaleY;
+        float A = ay - by, B = bx - ax, C = ax * by - bx * ay;
+        // Least and greatest of the line's function over a grown square, relative to its corner (i, j)
+        float lowX = A < 0.f ? A * (1.f + marginX) : -A * marginX, highX = A < 0.f ? -A * marginX : A * (1.f + marginX);
+        float lowY = B < 0.f ? B * (1.f + marginY) : -B * marginY, highY = B < 0.f ? -B * marginY : B * (1.f + marginY);
+        int startX, endX, startY, endY;
+        pixelRange(std::min(ax, bx), std::max(ax, bx), marginX, width, startX, endX);
+        pixelRange(std::min(ay, by), std::max(ay, by), marginY, height, startY, endY);
+        for (int j = startY; j <= endY; j++) {
+            int32_t* rowFlags = &meshFlags[static_cast<size_t>(j) * width];
+            for (int i = startX; i <= endX; i++) {
+                float e = A * i + B * j + C;
+                if (e + lowX + lowY <= 0.f && e + highX + highY >= 0.f) rowFlags[i] |= OnOutline;
+            }
+        }
+    }
+
+    // Marks the pixels with a sample close enough to an edge between two front faces that the
+    // renderer's stepped edge functions may leave it out of both
+    // Input Variables:
+    // - a, b: Canvas-space end points
+    // - tolerance: Distance from the edge, in canvas pixels, within which a sample may be missed
+    // - multisample: Whether the renderer takes the multisample offsets rather than pixel positions
+    void markSeam(const vec4& a, const vec4& b, float tolerance, bool multisample) {
+        float dx = b[0] - a[0], dy = b[1] - a[1];
+        float length = std::sqrt(dx * dx + dy * dy);
+        if (length <= 0.f) return;
+        bool alongX = std::fabs(dx) >= std::fabs(dy);
+        // Step along the longer axis, in the grid of pixel positions or of each multisample offset
+        float u0 = alongX ? a[0] : a[1], v0 = alongX ? a[1] : a[0];
+        float du = alongX ? dx : dy, dv = alongX ? dy : dx;
+        float slope = dv / du, reach = tolerance * length / std::fabs(du);
+        int sizeU = alongX ? static_cast<int>(canvasW) : static_cast<int>(canvasH);
+        int sizeV = alongX ? static_cast<int>(canvasH) : static_cast<int>(canvasW);
+        for (int s = multisample ? 0 : -1; s < (multisample ? MsaaBuffer::Samples : 0); s++) {
+            float ou = s < 0 ? 0.f : MsaaBuffer::offsets[s][alongX ? 0 : 1];
+            float ov = s < 0 ? 0.f : MsaaBuffer::offsets[s][alongX ? 1 : 0];
+            int first = std::max(static_cast<int>(std::ceil(std::min(u0, u0 + du) - ou - tolerance)), 0);
+            int last = std::min(static_cast<int>(std::floor(std::max(u0, u0 + du) - ou + tolerance)), sizeU - 1);
+            for (int u = first; u <= last; u++) {
+                float v = v0 + (u + ou - u0) * slope - ov;
+                int lo = std::max(static_cast<int>(std::ceil(v - reach)), 0);
+                int hi = std::min(static_cast<int>(std::floor(v + reach)), sizeV - 1);
+                for (int w = lo; w <= hi; w++) {
+                    int px = alongX ? u : w, py = alongX ? w : u;
+                    int i = std::min(static_cast<int>(px * scaleX), width - 1);
+                    int j = std::min(static_cast<int>(py * scaleY), height - 1);
+                    meshFlags[static_cast<size_t>(j) * width + i] |= OnOutline;
+                }
+            }
+        }
+    }
+
+public:
+    // Sizes the buffer. Allocates, so call when the size changes only.
+    // Input Variables:
+    // - w, h: Size of the buffer, w rounded up to a multiple of 4
+    // - canvasWidth, canvasHeight: Size of the canvas it stands for
+    void create(int w, int h, int canvasWidth, int canvasHeight) {
+        width = (w + 3) & ~3;
+        height = h;
+        canvasW = static_cast<float>(canvasWidth);
+        canvasH = static_cast<float>(canvasHeight);
+        scaleX = width / canvasW;
+        scaleY = height / canvasH;
+        marginX = scaleX;
+        marginY = scaleY;
+        depth.assign(static_cast<size_t>(width) * height, 1.f);
+        meshDepth.assign(depth.size(), 0.f);
+        meshFlags.assign(depth.size(), 0);
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    bool matches(int w, int h, int canvasWidth, int canvasHeight) const {
+        return width == ((w + 3) & ~3) && height == h && canvasW == canvasWidth && canvasH == canvasHeight;
+    }
+
+    // Sets every pixel to the far plane, occluding nothing
+    void clear() {
+        std::fill(depth.begin(), depth.end(), 1.f);
+    }
+
+    // Rasterizes the front faces of a mesh
+    // Input Variables:
+    // - mesh: Occluder
+    // - mvp: Projection * camera * world matrix of the draw
+    // - scratch: Arena for the transformed vertices, rewound before returning
+    // - multisample: Whether the renderer draws with 4x multisampling, see Renderer::msaa
+    void drawMesh(const Mesh& mesh, const matrix& mvp, FrameArena& scratch, bool multisample) {
+        size_t mark = scratch.mark();
+        const Vertex* vertices = mesh.vertexData();
+        size_t vCount = mesh.vertexCount();
+        vec4* screen = scratch.allocate<vec4>(vCount);
+        matrixColumns mvpC(mvp);
+        for (size_t i = 0; i < vCount; i++) {
+            vec4 p = mvpC * vertices[i].p;
+            // Outside the near plane, or too near to be drawn: marked for the triangles to skip
+            if (p[3] <= 0.f || p[2] <= 0.001f * p[3]) {
+                screen[i] = vec4(0.f, 0.f, -1.f, 0.f);
+                continue;
+            }
+            // Same arithmetic as the draw, so positions shared by triangles match bit for bit
+            p.W();
+            p[0] = (p[0] + 1.f) * 0.5f * canvasW;
+            p[1] = (1.f - (p[1] + 1.f) * 0.5f) * canvasH;
+            screen[i] = p;
+        }
+
+        // Front faces the renderer draws, and the pixels they can reach
+        const triIndices* triangles = mesh.triangleData();
+        size_t tCount = mesh.triangleCount();
+        const triIndices** front = scratch.allocate<const triIndices*>(tCount);
+        size_t frontCount = 0;
+        float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+        for (size_t t = 0; t < tCount; t++) {
+            const vec4& a = screen[triangles[t].v[0]];
+            const vec4& b = screen[triangles[t].v[1]];
+            const vec4& c = screen[triangles[t].v[2]];
+            if (a[2] < 0.f || b[2] < 0.f || c[2] < 0.f) continue;
+            // Twice the area, as triangle::draw() measures it; a little over its threshold of one
+            // pixel, so rounding cannot let in a triangle the draw skips
+            float cross = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+            if (cross < 1.001f) continue;
+            front[frontCount++] = &triangles[t];
+            minX = std::min({ minX, a[0], b[0], c[0] });
+            maxX = std::max({ maxX, a[0], b[0], c[0] });
+            minY = std::min({ minY, a[1], b[1], c[1] });
+            maxY = std::max({ maxY, a[1], b[1], c[1] });
+        }
+        if (frontCount == 0) {
+            scratch.rewind(mark);
+            return;
+        }
+
+        int startX, endX, startY, endY;
+        pixelRange(minX * scaleX, maxX * scaleX, marginX, width, startX, endX);
+        pixelRange(minY * scaleY, maxY * scaleY, marginY, height, startY, endY);
+        if (startX > endX || startY > endY) {
+            scratch.rewind(mark);
+            return;
+        }
+        startX &= ~3;
+        endX = std::min(endX | 3, width - 1);
+        for (int j = startY; j <= endY; j++) {
+            size_t row = static_cast<size_t>(j) * width;
+            std::fill(meshDepth.begin() + row + startX, meshDepth.begin() + row + endX + 1, 0.f);
+            std::fill(meshFlags.begin() + row + startX, meshFlags.begin() + row + endX + 1, 0);
+        }
+
+        for (size_t t = 0; t < frontCount; t++) {
+            rasterizeTriangle(screen[front[t]->v[0]], screen[front[t]->v[1]], screen[front[t]->v[2]]);
+        }
+
+        // Outline edges, which no front face runs back along, and seams between front faces.
+        // The renderer's rounding starts at that of canvas coordinates and grows with the number
+        // of pixels it steps across a triangle.
+        size_t capacity = 16;
+        while (capacity < 6 * frontCount) capacity *= 2;
+        EdgeKey* table = scratch.allocate<EdgeKey>(capacity);
+        std::memset(table, 0xff, capacity * sizeof(EdgeKey));
+        for (size_t t = 0; t < frontCount; t++) {
+            for (int k = 0; k < 3; k++) {
+                insertEdge(table, capacity - 1, edgeKey(screen[front[t]->v[k]], screen[front[t]->v[(k + 1) % 3]]));
+            }
+        }
+        for (size_t t = 0; t < frontCount; t++) {
+            const vec4* p[3] = { &screen[front[t]->v[0]], &screen[front[t]->v[1]], &screen[front[t]->v[2]] };
+            float extent = std::max(std::max({ (*p[0])[0], (*p[1])[0], (*p[2])[0] }) - std::min({ (*p[0])[0], (*p[1])[0], (*p[2])[0] }),
+                std::max({ (*p[0])[1], (*p[1])[1], (*p[2])[1] }) - std::min({ (*p[0])[1], (*p[1])[1], (*p[2])[1] }));
+            float tolerance = 2.5e-4f + 1.2e-7f * extent * extent;
+            for (int k = 0; k < 3; k++) {
+                const vec4& a = *p[k];
+                const vec4& b = *p[(k + 1) % 3];
+                if (findEdge(table, capacity - 1, edgeKey(b, a))) markSeam(a, b, tolerance, multisample);
+                else markOutline(a, b);
+            }
+        }
+
+        for (int j = startY; j <= endY; j++) {
+            size_t row = static_cast<size_t>(j) * width;
+            for (int i = startX; i <= endX; i++) {
+                if (meshFlags[row + i] == CentreCovered) depth[row + i] = std::min(depth[row + i], meshDepth[row + i]);
+            }
+        }
+        scratch.rewind(mark);
+    }
+
+    // Tests whether a world-space box is hidden behind the occluders
+    // Input Variables:
+    // - lo, hi: Corners of the box
+    // - viewProjection: Projection * camera matrix
+    // Returns true only when every point of the box is behind an occluder; boxes reaching
+    // in front of the near plane never are
+    bool occluded(const float lo[3], const float hi[3], const matrix& viewProjection) const {
+        float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY, nearest = INFINITY;
+        for (int corner = 0; corner < 8; corner++) {
+            vec4 p(corner & 1 ? hi[0] : lo[0], corner & 2 ? hi[1] : lo[1], corner & 4 ? hi[2] : lo[2]);
+            p = viewProjection * p;
+            if (p[3] <= 0.f || p[2] <= 0.f) return false;
+            p.W();
+            float sx = (p[0] + 1.f) * 0.5f * canvasW, sy = (1.f - (p[1] + 1.f) * 0.5f) * canvasH;
+            minX = std::min(minX, sx);
+            maxX = std::max(maxX, sx);
+            minY = std::min(minY, sy);
+            maxY = std::max(maxY, sy);
+            nearest = std::min(nearest, p[2]);
+        }
+
+        // Buffer pixels under the rectangle, grown by a canvas pixel for the multisample offsets
+        int x0 = std::max(static_cast<int>(std::floor(minX * scaleX - marginX)), 0);
+        int x1 = std::min(static_cast<int>(std::floor(maxX * scaleX + marginX)), width - 1);
+        int y0 = std::max(static_cast<int>(std::floor(minY * scaleY - marginY)), 0);
+        int y1 = std::min(static_cast<int>(std::floor(maxY * scaleY + marginY)), height - 1);
+        if (x0 > x1 || y0 > y1) return false;
+
+        float limit = nearest - DepthSlack;
+        for (int j = y0; j <= y1; j++) {
+            const float* row = &depth[static_cast<size_t>(j) * width];
+            for (int i = x0; i <= x1; i++) {
+                if (!(row[i] < limit)) return false;
+            }
+        }
+        return true;
+    }
+};
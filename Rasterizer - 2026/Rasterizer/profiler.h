@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <fstream>
+#include <ostream>
+#include <cstring>
+#include <algorithm>
+
+// Frame profiler: named spans (a stage, a strip, a pass) recorded per thread.
+// Every thread that attaches owns a ring of the most recent spans and is its only writer, so
+// recording a span is two clock reads and a store, with no lock and no shared cache line.
+// Between frames the main thread reads the rings for a rolling percentile summary per stage,
+// and writeChromeTrace() saves them for chrome://tracing or Perfetto.
+// Build with RASTER_PROFILE=0 to compile every span out.
+#if !defined(RASTER_PROFILE)
+#define RASTER_PROFILE 1
+#endif
+
+class Profiler {
+public:
+    static const int MaxThreads = 64;
+    static const unsigned int RingSize = 1 << 14;   // Spans kept per thread, a power of two
+
+    struct Span {
+        const char* name;           // String literal naming the stage
+        long long start;            // Nanoseconds on the steady clock
+        unsigned int duration;      // Nanoseconds
+        unsigned int frame;         // Frame the span was recorded in
+    };
+
+private:
+    struct Ring {
+        Span spans[RingSize];
+        std::atomic<unsigned int> written{ 0 };     // Spans ever written; the newest is at written - 1
+    };
+
+    inline static std::unique_ptr<Ring> rings[MaxThreads];
+    inline static std::atomic<int> threadCount{ 0 };        // One past the highest attached index
+    inline static std::atomic<unsigned int> frame{ 0 };
+    inline static unsigned int summaryFrame = 0;            // First frame not yet summarised
+
+    static Ring*& localRing() {
+        thread_local Ring* ring = nullptr;
+        return ring;
+    }
+
+public:
+    // Current time on the clock spans use
+    static long long now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Gives the calling thread a ring; threads that never attach record nothing
+    // Input Variables:
+    // - index: Thread index, e.g. JobSystem::currentThread(); a thread re-attaching with an index
+    //          keeps that index's earlier spans
+    static void attachThread(int index) {
+        if (index < 0 || index >= MaxThreads) return;
+        if (!rings[index]) rings[index] = std::make_unique<Ring>();
+        localRing() = rings[index].get();
+        int count = threadCount.load();
+        while (count < index + 1 && !threadCount.compare_exchange_weak(count, index + 1)) {}
+    }
+
+    // Starts a new frame; spans recorded from now on carry its number
+    static void beginFrame() { frame.fetch_add(1, std::memory_order_relaxed); }
+
+    // Records a finished span on the calling thread
+    // Input Variables:
+    // - name: String literal naming the stage
+    // - start, end: Times from now()
+    static void record(const char* name, long long start, long long end) {
+        Ring* ring = localRing();
+        if (!ring) return;
+        unsigned int n = ring->written.load(std::memory_order_relaxed);
+        ring->spans[n & (RingSize - 1)] = { name, start, static_cast<unsigned int>(end - start), frame.load(std::memory_order_relaxed) };
+        ring->written.store(n + 1, std::memory_order_release);
+    }
+
+    // Calls f(thread, span) for every span still held, oldest first per thread.
+    // Call between frames, while no thread is recording.
+    template<typename F>
+    static void forEachSpan(F&& f) {
+        int threads = threadCount.load(std::memory_order_acquire);
+        for (int t = 0; t < threads; t++) {
+            if (!rings[t]) continue;
+            const Ring& ring = *rings[t];
+            unsigned int written = ring.written.load(std::memory_order_acquire);
+            unsigned int first = written > RingSize ? written - RingSize : 0;
+            for (unsigned int i = first; i < written; i++) f(t, ring.spans[i & (RingSize - 1)]);
+        }
+    }
+
+    // Prints, for every stage seen since the last call, the median, 95th and 99th percentile and
+    // the longest span. Call between frames.
+    // Input Variables:
+    // - out: Stream to print to, one line per stage
+    static void printSummary(std::ostream& out) {
+        static const int MaxStages = 32;
+        static std::vector<unsigned int> durations[MaxStages];
+        const char* names[MaxStages];
+        int stages = 0;
+        unsigned int firstFrame = summaryFrame;
+        summaryFrame = frame.load(std::memory_order_relaxed) + 1;
+        for (std::vector<unsigned int>& d : durations) d.clear();
+
+        forEachSpan([&](int, const Span& span) {
+            if (span.frame < firstFrame) return;
+            int s = 0;
+            while (s < stages && names[s] != span.name && std::strcmp(names[s], span.name) != 0) s++;
+            if (s == stages) {
+                if (stages == MaxStages) return;
+                names[stages++] = span.name;
+            }
+            durations[s].push_back(span.duration);
+        });
+
+        for (int s = 0; s < stages; s++) {
+            std::vector<unsigned int>& d = durations[s];
+            std::sort(d.begin(), d.end());
+            auto ms = [&d](double q) { return 1e-6 * d[std::min(d.size() - 1, static_cast<size_t>(q * d.size()))]; };
+            out << "\n   " << names[s] << ": p50 " << ms(0.5) << " ms, p95 " << ms(0.95) << " ms, p99 " << ms(0.99)
+                << " ms, max " << 1e-6 * d.back() << " ms (" << d.size() << " spans)";
+        }
+    }
+
+    // Saves every span still held as Chrome trace event JSON, one track per thread
+    // Input Variables:
+    // - path: File to write
+    // Returns false when the file could not be written
+    static bool writeChromeTrace(const char* path) {
+        std::ofstream file(path);
+        if (!file) return false;
+
+        long long origin = -1;
+        forEachSpan([&origin](int, const Span& span) {
+            if (origin < 0 || span.start < origin) origin = span.start;
+        });
+
+        file << "{\"traceEvents\":[\n";
+        bool first = true;
+        int threads = threadCount.load(std::memory_order_acquire);
+        for (int t = 0; t < threads; t++) {
+            if (!rings[t]) continue;
+            file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t
+                << ",\"args\":{\"name\":\"" << (t == 0 ? "main" : "worker ") << (t == 0 ? "" : std::to_string(t)) << "\"}}";
+            first = false;
+        }
+        forEachSpan([&](int t, const Span& span) {
+            file << (first ? "" : ",\n") << "{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << t
+                << ",\"ts\":" << (span.start - origin) / 1000.0 << ",\"dur\":" << span.duration / 1000.0
+                << ",\"args\":{\"frame\":" << span.frame << "}}";
+            first = false;
+        });
+        file << "\n]}\n";
+        return static_cast<bool>(file);
+    }
+};
+
+// Records the enclosing scope as a span; use through PROFILE_SCOPE so it compiles out
+class ProfileScope {
+    const char* name;
+    long long start;
+
+public:
+    explicit ProfileScope(const char* _name) : name(_name), start(Profiler::now()) {}
+    ~ProfileScope() { Profiler::record(name, start, Profiler::now()); }
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#if RASTER_PROFILE
+// Times the rest of the enclosing scope under a string literal name
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name) ((void)0)
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cmath>
+#include "vec4.h"
+
+// Rotation quaternion (x, y, z: vector part, w: scalar part).
+// Rotations are composed like matrices: (a * b) rotates by b first, then by a.
+class quaternion {
+public:
+    float x, y, z, w;
+
+    // Constructor initializes the quaternion, the identity rotation by default
+    quaternion(float _x = 0.f, float _y = 0.f, float _z = 0.f, float _w = 1.f) : x(_x), y(_y), z(_z), w(_w) {}
+
+    // Create a rotation around an axis
+    // Input Variables:
+    // - axis: Axis of rotation, need not be normalised
+    // - aRad: Rotation angle in radians
+    static quaternion fromAxisAngle(const vec4& axis, float aRad) {
+        float len = std::sqrt(vec4::dot(axis, axis));
+        if (len == 0.f) return quaternion();
+        float s = std::sin(aRad * 0.5f) / len;
+        return quaternion(axis[0] * s, axis[1] * s, axis[2] * s, std::cos(aRad * 0.5f));
+    }
+
+    // Create the rotation of matrix::makeRotateXYZ(rx, ry, rz), i.e. Z first, then Y, then X
+    // Input Variables:
+    // - rx, ry, rz: Rotation angles in radians around each axis
+    static quaternion fromEuler(float rx, float ry, float rz) {
+        float sx = std::sin(rx * 0.5f), cx = std::cos(rx * 0.5f);
+        float sy = std::sin(ry * 0.5f), cy = std::cos(ry * 0.5f);
+        float sz = std::sin(rz * 0.5f), cz = std::cos(rz * 0.5f);
+        return quaternion(
+            sx * cy * cz + cx * sy * sz,
+            cx * sy * cz - sx * cy * sz,
+            cx * cy * sz + sx * sy * cz,
+            cx * cy * cz - sx * sy * sz);
+    }
+
+    // Compose two rotations
+    // Input Variables:
+    // - q: Rotation applied before this one
+    // Returns the combined rotation
+    quaternion operator * (const quaternion& q) const {
+        return quaternion(
+            w * q.x + x * q.w + y * q.z - z * q.y,
+            w * q.y - x * q.z + y * q.w + z * q.x,
+            w * q.z + x * q.y - y * q.x + z * q.w,
+            w * q.w - x * q.x - y * q.y - z * q.z);
+    }
+
+    // Squared length, 1 for a rotation
+    float lengthSquared() const { return x * x + y * y + z * z + w * w; }
+
+    // Rescale to unit length so the quaternion stays a pure rotation
+    void normalise() {
+        float inv = 1.0f / std::sqrt(lengthSquared());
+        x *= inv; y *= inv; z *= inv; w *= inv;
+    }
+};
@@ -15,11 +15,62 @@
 #include "RNG.h"
 #include "light.h"
 #include "triangle.h"
+#include "depthtriangle.h"
+#include "shadow.h"
+#include "lighttiles.h"
+#include "transform.h"
+#include "arena.h"
+#include "jobs.h"
+#include "strips.h"
+#include "framegraph.h"
+#include "commands.h"
+#include "profiler.h"
+#include "bvh.h"
+#include "occlusion.h"
+#include "golden.h"
+#include "snapshot.h"
+#include "streaming.h"
 #include <thread>
 #include <vector>
-#include <mutex>
-#include <condition_variable>
+#include <memory>
+#include <string>
+#include <functional>
 #include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+// Debug builds count every heap allocation so render() can assert that steady-state frames
+// make none. Define RASTER_TRACK_ALLOCATIONS=0 to turn it off, or =1 to use it in release builds.
+#if !defined(RASTER_TRACK_ALLOCATIONS)
+#if defined(_DEBUG)
+#define RASTER_TRACK_ALLOCATIONS 1
+#else
+#define RASTER_TRACK_ALLOCATIONS 0
+#endif
+#endif
+
+#if RASTER_TRACK_ALLOCATIONS
+void* operator new(size_t size) {
+    if (HeapStats::counted) HeapStats::allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+#endif
+
+// The renderer built again without SIMD by scalar.cpp, which regressionTests() checks this build
+// against. Programs that build raster.cpp into their own (RASTER_NO_MAIN) go without it.
+#if RASTER_SIMD && !defined(RASTER_NO_MAIN)
+#define RASTER_SCALAR_TWIN 1
+namespace scalar {
+    bool renderTestScene(const std::string& name, int frames, const std::function<void(int, int, int, const unsigned char*)>& rendered);
+}
+#else
+#define RASTER_SCALAR_TWIN 0
+#endif
+
 // Main rendering function that processes a mesh, transforms its vertices, applies lighting, and draws triangles on the canvas.
 // Input Variables:
 // - renderer: The Renderer object used for drawing.
@@ -30,19 +81,67 @@
 struct SceneTriangle {
     Vertex t[3];
     float ka, kd;
+    ShadingRate rate;
+    vec4 w[3];        // World position / clip w with 1/w in the last component, only filled when shadows or local lights need it
+};
+
+// Range of strips a triangle overlaps, empty (last < first) for culled triangles
+struct BinRange {
+    int first, last;
+};
+
+// Per-strip lists of triangle indices
+struct Bins {
+    unsigned int* index[StripLayout::MaxStrips];
+    unsigned int count[StripLayout::MaxStrips];
+};
+
+// Everything a frame carries from its set-up passes to its drawing passes (see addSetupPasses).
+// There are two so that with Renderer::pipelineFrames one frame is set up while the other is drawn.
+struct FrameData {
+    FrameArena arena{ 16 << 20 };       // Triangles, bins and transients, released when the slot is reused
+    FrameArena lightArena{ 64 << 10 };  // Tile lists of lightGrid, filled by a pass of its own
+    LightGrid lightGrid;                // Point and spot lights culled into screen tiles
+    StripLayout strips;                 // Strips the triangles were binned into, timed by the shading pass
+    Light light;                        // Directional light as it was when the frame was set up
+    unsigned int triCount = 0;
+    unsigned int* firstTri = nullptr;   // First triangle of each mesh in tris
+    SceneTriangle* tris = nullptr;
+    Bins bins;
+    const LightGrid* grid = nullptr;    // &lightGrid when any local light reaches the screen
+    bool needWorld = false;             // Triangles carry world positions for shadows or local lights
+    const Renderer* target = nullptr;   // Renderer a pipelined frame is still to be drawn into
 };
 
-static std::vector<std::thread> pool;
-static bool initialized = false;
-static std::mutex mtx;
-static std::condition_variable cv_start, cv_done;
-static bool ready = false;
-static int finished_count = 0;
-static std::vector<std::vector<SceneTriangle>> Buckets;
-static std::vector<SceneTriangle>* pTriList = nullptr;
-static Renderer* pRenderer = nullptr;
-static Light* pLight = nullptr;
+static const int StripsPerThread = 4;             // Strips per job system thread, so idle threads have strips left to steal
+static StripLayout canvasStrips;                  // Strips of the canvas, rebalanced from the time each took last frame
+static StripLayout depthStrips;                   // Uniform strips of shadow map passes
+static int threadSetting = 0;                     // Threads requested with setThreadCount(), 0 for automatic
+static bool pinSetting = false;                   // Pin job system threads to cores
+static FrameData frames[2];                       // Frame slots, alternating when frames are pipelined
+static int currentFrame = 0;                      // Slot of the frame being set up
+static std::vector<std::unique_ptr<FrameArena>> workerArenas;  // Scratch of each job system thread including the main one, see FrameArena::local()
+static std::unique_ptr<JobSystem> jobSystem;      // Runs every parallel stage, started by the first frame
+static const int WarmupFrames = 3;                // Frames that may still allocate while buffers find their size
+static int renderedFrames = 0;
+static bool pipelinedLastFrame = false;           // Renderer::pipelineFrames of the last frame
+static size_t mostDraws = 0;                      // Most draws in the main view of any frame so far
+static size_t heapAllocationCount = 0;            // Heap allocations inside render() since the last FPS report
 static GamesEngineeringBase::Timer fpsTimer;
+static float shadowPassTime = 0.0f;               // Seconds spent rendering shadow maps since the last FPS report
+static float mainPassTime = 0.0f;                 // Seconds spent in every other pass since the last FPS report
+static float tileLightSum = 0.0f;                 // Average lights per tile, summed since the last FPS report
+static int tileLightMax = 0;                      // Most lights in any tile since the last FPS report
+static double syncStartTime = 0.0;                // Seconds until workers picked up queued work, since the last FPS report
+static double syncEndTime = 0.0;                  // Seconds spent waiting at joins, since the last FPS report
+static ObjectBVH drawHierarchy;                   // Bounds of the main view's draws, see cullDraws()
+static std::vector<const Mesh*> hierarchyMeshes;  // Mesh of each draw drawHierarchy was built over
+static std::vector<vec4> localBounds;             // Object-space bounding sphere of each of those draws, radius in w
+static std::vector<vec4> drawBounds;              // World-space bounding sphere of each of those draws, radius in w
+static OcclusionBuffer occlusionBuffer;           // Depth of the occluders picked by cullDraws()
+#if RASTER_STATS
+static FrameStats lastFrameStats;                 // Counters of the last rendered frame, see Renderer::stats
+#endif
 
 void FPS() {
     static float Time = 0.0f;
@@ -53,129 +152,817 @@ void FPS() {
 
     if (Time >= 1.0f) {
         float fps = static_cast<float>(Frame) / Time;
-        std::cout << "\n Current FPS: " << fps << std::flush;
+        std::cout << "\n Current FPS: " << fps;
+        if (shadowPassTime > 0.0f) {
+            std::cout << " | shadow pass: " << 1000.0f * shadowPassTime / Frame << " ms"
+                << " | main pass: " << 1000.0f * mainPassTime / Frame << " ms";
+        }
+        if (tileLightMax > 0) {
+            std::cout << " | lights per tile: avg " << tileLightSum / Frame << ", max " << tileLightMax;
+        }
+        if (syncStartTime + syncEndTime > 0.0) {
+            std::cout << " | sync: start " << 1e6 * syncStartTime / Frame << " us, end " << 1e6 * syncEndTime / Frame << " us";
+        }
+#if RASTER_TRACK_ALLOCATIONS
+        std::cout << " | heap allocations: " << heapAllocationCount;
+#endif
+#if RASTER_STATS
+        const FrameStats& s = lastFrameStats;
+        std::cout << " | draws: " << s.draws << " (" << s.frustumCulled << " outside the view, " << s.occlusionCulled << " occluded)"
+            << " | triangles: " << s.triangles << " (" << s.backFacing << " back-facing, " << s.tiny << " tiny)"
+            << " | strips per triangle: " << s.binsPerTriangle()
+            << " | fragments: " << s.fragments << " (" << s.depthRejects << " depth rejects), overdraw " << s.overdraw();
+#endif
+#if RASTER_PROFILE
+        Profiler::printSummary(std::cout);
+#endif
+        std::cout << std::flush;
 
         Time = 0.0f;
         Frame = 0;
+        shadowPassTime = 0.0f;
+        mainPassTime = 0.0f;
+        tileLightSum = 0.0f;
+        tileLightMax = 0;
+        heapAllocationCount = 0;
+        syncStartTime = 0.0;
+        syncEndTime = 0.0;
     }
 }
-void threadWork(int i, int Threads) {
-    while (true) {
-        int minY, maxY;
-        {
-            std::unique_lock<std::mutex> lock(mtx);
-            while (!ready) {
-                cv_start.wait(lock);
-            }
 
-            int h = pRenderer->canvas.getHeight();
-            minY = i * (h / Threads);
-            if (i == Threads - 1) maxY = h;
-            else maxY = (i + 1) * (h / Threads);
-        }
-        const std::vector<SceneTriangle>& myBucket = Buckets[i];
-        for (const SceneTriangle& triData : myBucket) {
-            triangle tri(triData.t[0], triData.t[1], triData.t[2]);
-            tri.draw(*pRenderer, *pLight, triData.ka, triData.kd, minY, maxY);
+// The job system, started on first use with the settings of setThreadCount().
+// Every thread, the main one (thread 0) included, gets a scratch arena and a profiler ring of its own.
+JobSystem& jobs() {
+    if (!jobSystem) {
+        int threads = threadSetting > 0 ? threadSetting : JobSystem::defaultThreadCount();
+        workerArenas.resize(threads);
+        for (int i = 0; i < threads; i++) workerArenas[i] = std::make_unique<FrameArena>(1 << 20);
+        Profiler::attachThread(0);
+        jobSystem = std::make_unique<JobSystem>(threads, [](int i) {
+            FrameArena::setLocal(workerArenas[i].get());
+            HeapStats::counted = true;
+            Profiler::attachThread(i);
+        }, pinSetting);
+    }
+    return *jobSystem;
+}
+
+// Chooses the number of rendering threads. Takes effect from the next frame; call between frames.
+// Input Variables:
+// - threads: Total threads including the main one, 0 for one per hardware thread
+// - pin: Pin each thread to its own logical core
+void setThreadCount(int threads, bool pin = false) {
+    threadSetting = std::max(threads, 0);
+    pinSetting = pin;
+    jobSystem.reset();
+    workerArenas.clear();
+    renderedFrames = 0; // New threads and arenas warm up again
+}
+
+// Runs a job for every strip of a target on the job system and waits for all of them
+// Input Variables:
+// - name: Label of each strip in the profiler, a string literal
+// - strips: Split of the target into strips
+// - work: Function called once per strip with (strip index, first row, one past last row)
+template<typename F>
+void dispatch(const char* name, const StripLayout& strips, F&& work) {
+    jobs().parallelFor(strips.getCount(), 1, [name, &work, &strips](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            PROFILE_SCOPE(name);
+            work(i, strips.first(i), strips.end(i));
         }
+    });
+}
 
-        {
-            std::lock_guard<std::mutex> lock(mtx);
-            finished_count++;
-            if (finished_count == Threads) {
-                cv_done.notify_one();
+// Keeps a layout at the target's height and the strip count for the current thread count,
+// resetting it to equal strips when either changed
+// Input Variables:
+// - strips: Layout to check
+// - height: Height of the target in rows
+void fitStrips(StripLayout& strips, int height) {
+    int count = jobs().getThreadCount() * StripsPerThread;
+    if (!strips.fits(height, count)) strips.uniform(height, count);
+}
+
+// Strips a triangle's vertical extent overlaps
+// Input Variables:
+// - triMinY, triMaxY: Vertical extent of the triangle in rows
+// - strips: Split of the target
+BinRange binRange(float triMinY, float triMaxY, const StripLayout& strips) {
+    return { strips.stripOf(triMinY), strips.stripOf(triMaxY) };
+}
+
+// Sorts triangles into the strips they overlap, in parallel over chunks of triangles.
+// Every chunk counts its triangles per strip, a prefix sum turns the counts into write
+// positions, and every chunk then fills its own slice of each list. The lists are allocated
+// from the arena at their exact size and keep the submission order.
+// Input Variables:
+// - arena: Arena holding the lists
+// - ranges: Strips overlapped by each triangle, from binRange()
+// - n: Number of triangles
+// - strips: Number of strips
+// Output Variables:
+// - bins: Triangle indices of every strip, in submission order
+void buildBins(FrameArena& arena, const BinRange* ranges, unsigned int n, int strips, Bins& bins) {
+    const int Grain = 4096;
+    int chunks = static_cast<int>((n + Grain - 1) / Grain);
+    unsigned int* offsets = arena.allocate<unsigned int>(chunks * strips);   // [chunk][strip]
+
+    jobs().parallelFor(chunks, 1, [ranges, n, offsets, strips](int begin, int end) {
+        for (int c = begin; c < end; c++) {
+            unsigned int* count = offsets + c * strips;
+            std::fill(count, count + strips, 0u);
+            unsigned int last = std::min(n, (unsigned int)(c + 1) * Grain);
+            for (unsigned int i = c * Grain; i < last; i++) {
+                for (int t = ranges[i].first; t <= ranges[i].last; ++t) count[t]++;
             }
         }
-        {
-            std::unique_lock<std::mutex> lock(mtx);
-            while (ready) {
-                cv_start.wait(lock);
+    });
+
+    for (int t = 0; t < strips; t++) {
+        unsigned int total = 0;
+        for (int c = 0; c < chunks; c++) {
+            unsigned int count = offsets[c * strips + t];
+            offsets[c * strips + t] = total;
+            total += count;
+        }
+        bins.index[t] = arena.allocate<unsigned int>(total);
+        bins.count[t] = total;
+    }
+
+    jobs().parallelFor(chunks, 1, [ranges, n, offsets, strips, &bins](int begin, int end) {
+        for (int c = begin; c < end; c++) {
+            unsigned int* position = offsets + c * strips;
+            unsigned int last = std::min(n, (unsigned int)(c + 1) * Grain);
+            for (unsigned int i = c * Grain; i < last; i++) {
+                for (int t = ranges[i].first; t <= ranges[i].last; ++t) bins.index[t][position[t]++] = i;
             }
         }
+    });
+}
+
+// Index of each draw's first triangle when the triangles of all draws are stored back to back
+// Input Variables:
+// - arena: Arena holding the result
+// - draws: Draws in submission order
+// Output Variables:
+// - total: Number of triangles in the scene
+unsigned int* triangleOffsets(FrameArena& arena, const DrawList& draws, unsigned int& total) {
+    unsigned int* first = arena.allocate<unsigned int>(draws.size());
+    total = 0;
+    for (size_t m = 0; m < draws.size(); m++) {
+        first[m] = total;
+        total += static_cast<unsigned int>(draws[m].mesh->triangleCount());
+    }
+    return first;
+}
+
+// Picks the shading rate for a draw this frame
+// Draws with a fixed rate keep it; ShadingRate::Auto draws drop to 2x2 when they are far
+// from the camera or their origin moved quickly across the screen since the last frame.
+// Input Variables:
+// - renderer: Renderer holding the canvas size and auto shading thresholds
+// - draw: Draw being set up, its last screen position is updated when it has one
+// - viewWorld: Camera * world matrix for the draw
+// - mvp: Projection * camera * world matrix for the draw
+ShadingRate selectShadingRate(Renderer& renderer, const DrawCommand& draw, const matrix& viewWorld, const matrix& mvp) {
+    if (draw.rate != ShadingRate::Auto) return draw.rate;
+
+    vec4 origin(0.f, 0.f, 0.f, 1.f);
+    float distance = -(viewWorld * origin)[2];
+
+    vec4 screen = mvp * origin;
+    screen.W();
+    screen[0] = (screen[0] + 1.f) * 0.5f * (float)renderer.canvas.getWidth();
+    screen[1] = (1.f - (screen[1] + 1.f) * 0.5f) * (float)renderer.canvas.getHeight();
+
+    float motion = 0.f;
+    if (draw.motion) {
+        vec4& last = *draw.motion;
+        if (last[3] != 0.f) {
+            float dx = screen[0] - last[0];
+            float dy = screen[1] - last[1];
+            motion = std::sqrt(dx * dx + dy * dy);
+        }
+        last = vec4(screen[0], screen[1], 0.f, 1.f);
     }
+
+    if (distance > renderer.shadingRates.coarseDistance || motion > renderer.shadingRates.motionThreshold)
+        return ShadingRate::Rate2x2;
+    return ShadingRate::Rate1x1;
 }
 
+// Depth-only render of a scene into any depth buffer, the building block for shadow maps and
+// Z pre-passes. Only positions are transformed; colours and normals are never touched.
+// Uses the same strip binning and job system as render(). The caller clears the target.
+// Input Variables:
+// - target: Depth buffer to render into, its size defines the viewport
+// - draws: Draws to render
+// - view: World to view space transform
+// - projection: Projection matrix (perspective or orthographic)
+// - constantBias: Offset added to every depth written
+// - slopeBias: Offset scaled by each triangle's depth gradient
+void renderDepth(Zbuffer<float>& target, const DrawList& draws, const matrix& view, const matrix& projection, float constantBias = 0.f, float slopeBias = 0.f) {
+    int targetW = target.getWidth();
+    int targetH = target.getHeight();
+    fitStrips(depthStrips, targetH);
+
+    // Everything below lives in the calling thread's arena and is released when the pass is done
+    FrameArena& arena = FrameArena::local();
+    size_t arenaMark = arena.mark();
+    unsigned int triCount;
+    unsigned int* firstTri = triangleOffsets(arena, draws, triCount);
+    depthTriangle* tris = arena.allocate<depthTriangle>(triCount);
+    BinRange* ranges = arena.allocate<BinRange>(triCount);
+
+    // Transform each draw on whichever thread picks it up; its triangles go to its own slice
+    jobs().parallelFor(static_cast<int>(draws.size()), 1, [&](int begin, int end) {
+        PROFILE_SCOPE("depth transform");
+        FrameArena& scratch = FrameArena::local();
+        for (int m = begin; m < end; m++) {
+            const Mesh* mesh = draws[m].mesh;
+            matrixColumns mvp(projection * (view * *draws[m].world));
+
+            const Vertex* vertices = mesh->vertexData();
+            size_t vCount = mesh->vertexCount();
+            size_t meshMark = scratch.mark();
+            vec4* tp = scratch.allocate<vec4>(vCount);
+            for (size_t i = 0; i < vCount; ++i) {
+                tp[i] = mvp * vertices[i].p;
+                tp[i].W();
+                tp[i][0] = (tp[i][0] + 1.f) * 0.5f * (float)targetW;
+                tp[i][1] = (1.f - (tp[i][1] + 1.f) * 0.5f) * (float)targetH;
+            }
 
+            // Back faces are rejected by the triangle's signed area, which works for any projection
+            unsigned int k = firstTri[m];
+            const triIndices* indices = mesh->triangleData();
+            size_t tCount = mesh->triangleCount();
+            for (size_t t = 0; t < tCount; t++) {
+                const triIndices& ind = indices[t];
+                depthTriangle* tri = new (&tris[k]) depthTriangle(tp[ind.v[0]], tp[ind.v[1]], tp[ind.v[2]]);
+                ranges[k++] = binRange(tri->minY(), tri->maxY(), depthStrips);
+            }
+            scratch.rewind(meshMark);
+        }
+    });
 
-void render(Renderer& renderer, std::vector<Mesh*>& scene, matrix& camera, Light& L) {
-    const int Threads =16;                                                      // Threads
-    int canvasH = renderer.canvas.getHeight();
-    int Rows = canvasH / Threads;
+    Bins bins;
+    buildBins(arena, ranges, triCount, depthStrips.getCount(), bins);
 
-    if (Buckets.size() != (size_t)Threads) {
-        Buckets.resize(Threads);
-    }
+    dispatch("depth strip", depthStrips, [&target, &bins, tris, constantBias, slopeBias](int i, int minY, int maxY) {
+        for (unsigned int k = 0; k < bins.count[i]; k++) {
+            tris[bins.index[i][k]].draw(target, constantBias, slopeBias, minY, maxY);
+        }
+    });
+    arena.rewind(arenaMark);
+}
 
-    for (std::vector<SceneTriangle>& bucket : Buckets) {
-        bucket.clear();
-        bucket.reserve(5000);
+// Renders every cascade of a directional light's shadow map, each spread over the job system
+// Input Variables:
+// - shadows: Shadow map to fit and fill
+// - casters: Draws that cast shadows
+// - L: Light casting the shadows
+// - camera: World to view matrix of the main camera
+// - projection: Projection matrix of the main camera
+void renderShadowMap(ShadowMap& shadows, const DrawList& casters, Light& L, matrix& camera, matrix& projection) {
+    shadows.fit(L.omega_i, casters, camera, projection);
+    for (int c = 0; c < shadows.cascades; c++) {
+        shadows.depth[c].clear();
+        renderDepth(shadows.depth[c], casters, shadows.view[c], shadows.projection[c], shadows.constantBias, shadows.slopeBias);
     }
+}
 
-    for (Mesh* mesh : scene) {
-        matrix viewWorld = camera * mesh->world;
-        matrix projection = renderer.perspective;
-        matrix mvp = projection * viewWorld;
+// Graph resources of one frame slot
+struct FrameResources {
+    FrameGraph::Resource lights;        // frame.lightGrid
+    FrameGraph::Resource triangles;     // frame.tris
+    FrameGraph::Resource bins;          // frame.bins
+};
 
-        size_t vCount = mesh->vertices.size();
-        std::vector<Vertex> tv(vCount);
-        std::vector<vec4> vPos(vCount);
+// Graph resources of the render targets
+struct TargetResources {
+    FrameGraph::Resource depth;         // renderer.zbuffer
+    FrameGraph::Resource canvas;        // renderer.canvas
+    FrameGraph::Resource samples;       // renderer.samples, None without MSAA
+    FrameGraph::Resource shadowMap;     // L.shadowMap, None without one
+};
 
-        for (size_t i = 0; i < vCount; ++i) {
-            vPos[i] = viewWorld * mesh->vertices[i].p;
-            tv[i].p = mvp * mesh->vertices[i].p;
-            tv[i].p.W();
-            tv[i].p[0] = (tv[i].p[0] + 1.f) * 0.5f * (float)renderer.canvas.getWidth();
-            tv[i].p[1] = (1.f - (tv[i].p[1] + 1.f) * 0.5f) * (float)renderer.canvas.getHeight();
-            tv[i].normal = mesh->world * mesh->vertices[i].normal;
-            tv[i].normal.normalise();
-            tv[i].rgb = mesh->vertices[i].rgb;
-        }
+// Declares the set-up passes of a frame: light culling, and geometry (vertex transform, culling
+// and triangle setup) followed by binning into the canvas strips. None of them touches the
+// canvas or the depth buffer, so they can run while the previous frame is drawn.
+// Input Variables:
+// - graph: Graph of this frame
+// - frame: Slot to fill, its arenas must have been reset
+// - renderer: Renderer holding the canvas size and projection
+// - draws: Draws of the main view, sorted; the array must live until the frame is drawn
+// - camera: World to view matrix
+// - L: Directional light, copied into the frame
+// - lights: Point and spot lights
+// Returns the resources the passes write
+FrameResources addSetupPasses(FrameGraph& graph, FrameData& frame, Renderer& renderer, DrawList draws, matrix& camera, Light& L, std::vector<LocalLight>& lights) {
+    FrameResources out{ FrameGraph::None, graph.importResource("triangles"), graph.importResource("bins") };
+    frame.light = L;
+    frame.grid = nullptr;
+    // World positions are needed whenever there are local lights, even before the light pass
+    // has found out whether any of them reaches the screen
+    frame.needWorld = L.shadowMap != nullptr || !lights.empty();
+
+    fitStrips(canvasStrips, renderer.canvas.getHeight());
+    frame.strips = canvasStrips;
+    frame.firstTri = triangleOffsets(frame.arena, draws, frame.triCount);
+    frame.tris = frame.arena.allocate<SceneTriangle>(frame.triCount);
+    FrameGraph::Resource ranges = graph.createTransient("bin ranges", frame.triCount * sizeof(BinRange));
+
+    if (!lights.empty()) {
+        out.lights = graph.importResource("light grid");
+        graph.addPass("light culling", {}, { out.lights }, [&frame, &renderer, &camera, &lights] {
+            frame.lightGrid.build(frame.lightArena, lights, camera, renderer.perspective, renderer.canvas.getWidth(), renderer.canvas.getHeight());
+            tileLightSum += frame.lightGrid.averageCount();
+            tileLightMax = std::max(tileLightMax, frame.lightGrid.maxCount());
+            if (!frame.lightGrid.empty()) frame.grid = &frame.lightGrid;
+        });
+    }
 
-        for (triIndices& ind : mesh->triangles) {
-            vec4 e1 = vPos[ind.v[1]] - vPos[ind.v[0]];
-            vec4 e2 = vPos[ind.v[2]] - vPos[ind.v[0]];
-            vec4 faceNormal = vec4::cross(e1, e2);
-            if (vec4::dot(faceNormal, vec4(-vPos[ind.v[0]][0], -vPos[ind.v[0]][1], -vPos[ind.v[0]][2], 0.f)) >= 0.0f) continue;
+    graph.addPass("geometry", {}, { out.triangles, ranges }, [&graph, &frame, &renderer, &camera, draws, ranges] {
+        const StripLayout& strips = frame.strips;
+        SceneTriangle* tris = frame.tris;
+        BinRange* binRanges = graph.get<BinRange>(ranges);
+        bool needWorld = frame.needWorld;
+
+        // One draw per job. Each draw fills its own slice of tris, so the result does not
+        // depend on which thread ran it.
+        jobs().parallelFor(static_cast<int>(draws.size()), 1, [&](int begin, int end) {
+            PROFILE_SCOPE("transform");
+            FrameArena& scratch = FrameArena::local();
+            for (int m = begin; m < end; m++) {
+                const DrawCommand& draw = draws[m];
+                const Mesh* mesh = draw.mesh;
+                const affine& world = *draw.world;
+                matrix viewWorld = camera * world;
+                matrix projection = renderer.perspective;
+                matrix mvp = projection * viewWorld;
+                ShadingRate rate = selectShadingRate(renderer, draw, viewWorld, mvp);
+                matrixColumns viewWorldC(viewWorld), mvpC(mvp);
+
+                // Per-mesh vertex data, released once the mesh's triangles are set up
+                const Vertex* vertices = mesh->vertexData();
+                size_t vCount = mesh->vertexCount();
+                size_t meshMark = scratch.mark();
+                Vertex* tv = scratch.allocate<Vertex>(vCount);
+                vec4* vPos = scratch.allocate<vec4>(vCount);
+                vec4* wPos = needWorld ? scratch.allocate<vec4>(vCount) : nullptr;
+
+                for (size_t i = 0; i < vCount; ++i) {
+                    vPos[i] = viewWorldC * vertices[i].p;
+                    tv[i].p = mvpC * vertices[i].p;
+                    if (needWorld) {
+                        float invW = 1.f / tv[i].p[3];
+                        vec4 position = world * vertices[i].p;
+                        wPos[i] = vec4(position[0] * invW, position[1] * invW, position[2] * invW, invW);
+                    }
+                    tv[i].p.W();
+                    tv[i].p[0] = (tv[i].p[0] + 1.f) * 0.5f * (float)renderer.canvas.getWidth();
+                    tv[i].p[1] = (1.f - (tv[i].p[1] + 1.f) * 0.5f) * (float)renderer.canvas.getHeight();
+                    tv[i].normal = world * vertices[i].normal;
+                    tv[i].normal.normalise();
+                    tv[i].rgb = vertices[i].rgb;
+                }
+
+                unsigned int k = frame.firstTri[m];
+                RASTER_STAT(FrameStats counts);
+                const triIndices* indices = mesh->triangleData();
+                size_t tCount = mesh->triangleCount();
+                RASTER_STAT(counts.triangles = tCount);
+                for (size_t t = 0; t < tCount; t++) {
+                    const triIndices& ind = indices[t];
+                    BinRange& range = binRanges[k];
+                    SceneTriangle* slot = &tris[k++];
+
+                    vec4 e1 = vPos[ind.v[1]] - vPos[ind.v[0]];
+                    vec4 e2 = vPos[ind.v[2]] - vPos[ind.v[0]];
+                    vec4 faceNormal = vec4::cross(e1, e2);
+                    if (vec4::dot(faceNormal, vec4(-vPos[ind.v[0]][0], -vPos[ind.v[0]][1], -vPos[ind.v[0]][2], 0.f)) >= 0.0f) {
+                        range = { 1, 0 };
+                        RASTER_STAT(counts.backFacing++);
+                        continue;
+                    }
+
+                    SceneTriangle& tri = *new (slot) SceneTriangle{ {tv[ind.v[0]], tv[ind.v[1]], tv[ind.v[2]]}, draw.ka, draw.kd, rate, {} };
+                    if (needWorld) {
+                        tri.w[0] = wPos[ind.v[0]];
+                        tri.w[1] = wPos[ind.v[1]];
+                        tri.w[2] = wPos[ind.v[2]];
+                    }
+                    float triMinY = std::min({ tri.t[0].p[1], tri.t[1].p[1], tri.t[2].p[1] });
+                    float triMaxY = std::max({ tri.t[0].p[1], tri.t[1].p[1], tri.t[2].p[1] });
+                    // Multisampled triangles cover one more row for the samples below the last centre
+                    if (renderer.msaa) triMaxY += 1.f;
+
+                    range = binRange(triMinY, triMaxY, strips);
+#if RASTER_STATS
+                    // Same area test as triangle::draw(), which skips these in every strip
+                    float ex1 = tri.t[1].p[0] - tri.t[0].p[0], ey1 = tri.t[1].p[1] - tri.t[0].p[1];
+                    float ex2 = tri.t[2].p[0] - tri.t[0].p[0], ey2 = tri.t[2].p[1] - tri.t[0].p[1];
+                    if (std::fabs(ex1 * ey2 - ey1 * ex2) < 1.f) counts.tiny++;
+                    counts.binEntries += range.last - range.first + 1;
+                    if (range.last > range.first) counts.multiStrip++;
+#endif
+                }
+                RASTER_STAT(renderer.stats.addTriangles(counts));
+                scratch.rewind(meshMark);
+            }
+        });
+    });
 
+    graph.addPass("binning", { ranges }, { out.bins }, [&graph, &frame, ranges] {
+        buildBins(frame.arena, graph.get<BinRange>(ranges), frame.triCount, frame.strips.getCount(), frame.bins);
+    });
+    return out;
+}
 
-            SceneTriangle tri = { {tv[ind.v[0]], tv[ind.v[1]], tv[ind.v[2]]}, mesh->ka, mesh->kd };
-            float triMinY = std::min({ tri.t[0].p[1], tri.t[1].p[1], tri.t[2].p[1] });
-            float triMaxY = std::max({ tri.t[0].p[1], tri.t[1].p[1], tri.t[2].p[1] });
+// Declares the drawing passes of a frame set up by addSetupPasses(): Z pre-pass, shading and
+// multisample resolve. Shading times every strip in frame.strips for rebalancing.
+// Input Variables:
+// - graph: Graph of this frame
+// - frame: Frame to draw
+// - in: Resources written by the frame's set-up passes
+// - renderer: Renderer whose targets receive the frame, cleared by the caller
+// - targets: Resources of the render targets
+void addDrawPasses(FrameGraph& graph, FrameData& frame, const FrameResources& in, Renderer& renderer, const TargetResources& targets) {
+    // Z pre-pass over the same bins: every visible depth is known before any pixel is shaded.
+    // The multisample target keeps its own per-sample depth, so MSAA renders without one.
+    if (renderer.zPrepass && !renderer.msaa) {
+        graph.addPass("z prepass", { in.triangles, in.bins }, { targets.depth }, [&frame, &renderer] {
+            const Bins& bins = frame.bins;
+            const SceneTriangle* tris = frame.tris;
+            dispatch("z prepass strip", frame.strips, [&renderer, &bins, tris](int i, int minY, int maxY) {
+                for (unsigned int k = 0; k < bins.count[i]; k++) {
+                    const SceneTriangle& triData = tris[bins.index[i][k]];
+                    depthTriangle tri(triData.t[0].p, triData.t[1].p, triData.t[2].p);
+                    tri.draw(renderer.zbuffer, 0.f, 0.f, minY, maxY);
+                }
+            });
+        });
+    }
 
-            int firstThread = std::clamp(static_cast<int>(triMinY / Rows), 0, Threads - 1);
-            int lastThread = std::clamp(static_cast<int>(triMaxY / Rows), 0, Threads - 1);
+    // Shading, timed per strip so the next frame's strips can be rebalanced
+    FrameGraph::Resource colour = renderer.msaa ? targets.samples : targets.canvas;
+    FrameGraph::Resource depth = renderer.msaa ? FrameGraph::None : targets.depth;
+    graph.addPass("shading", { in.triangles, in.bins, in.lights, targets.shadowMap }, { colour, depth }, [&frame, &renderer] {
+        const Bins& bins = frame.bins;
+        const SceneTriangle* tris = frame.tris;
+        StripLayout& strips = frame.strips;
+        Light& L = frame.light;
+        dispatch("shading strip", strips, [&renderer, &L, &bins, &strips, tris, grid = frame.grid, needWorld = frame.needWorld](int i, int minY, int maxY) {
+            auto stripStart = std::chrono::steady_clock::now();
+            for (unsigned int k = 0; k < bins.count[i]; k++) {
+                const SceneTriangle& triData = tris[bins.index[i][k]];
+                triangle tri(triData.t[0], triData.t[1], triData.t[2]);
+                if (needWorld) tri.setWorldLighting(L.shadowMap, grid, triData.w[0], triData.w[1], triData.w[2]);
+                tri.draw(renderer, L, triData.ka, triData.kd, minY, maxY, triData.rate);
+            }
+            strips.record(i, std::chrono::duration<float>(std::chrono::steady_clock::now() - stripStart).count());
+        });
+    });
+
+    // Post-processing: resolve the multisample target into the canvas, one strip per job
+    if (renderer.msaa) {
+        graph.addPass("msaa resolve", { targets.samples }, { targets.canvas }, [&frame, &renderer] {
+            dispatch("resolve strip", frame.strips, [&renderer](int, int minY, int maxY) {
+                renderer.samples.resolve(renderer.canvas, minY, maxY);
+            });
+            renderer.samples.markResolved();
+        });
+    }
+}
+
+// Merges the command buffers into one array sorted by key (ties keep buffer and recording order)
+// and splits it by pass
+// Input Variables:
+// - arena: Arena holding the lists
+// - queue: Recorded draws
+// Output Variables:
+// - mainDraws: Draws with PassMain
+// - shadowDraws: Draws with PassShadow
+void sortDraws(FrameArena& arena, const CommandQueue& queue, DrawList& mainDraws, DrawList& shadowDraws) {
+    size_t total = queue.size();
+    // Key in the high half, position in the merged array in the low half
+    unsigned long long* order = arena.allocate<unsigned long long>(total);
+    const DrawCommand** source = arena.allocate<const DrawCommand*>(total);
+    size_t n = 0;
+    for (int b = 0; b < queue.getBufferCount(); b++) {
+        const CommandBuffer& buffer = queue.buffer(b);
+        for (size_t i = 0; i < buffer.size(); i++, n++) {
+            source[n] = buffer.data() + i;
+            order[n] = (static_cast<unsigned long long>(source[n]->key) << 32) | n;
+        }
+    }
+    std::sort(order, order + total);
+
+    DrawCommand* main = arena.allocate<DrawCommand>(total);
+    DrawCommand* shadow = arena.allocate<DrawCommand>(total);
+    mainDraws = { main, 0 };
+    shadowDraws = { shadow, 0 };
+    for (size_t i = 0; i < total; i++) {
+        const DrawCommand& draw = *source[order[i] & 0xffffffffu];
+        if (draw.passes & PassMain) main[mainDraws.count++] = draw;
+        if (draw.passes & PassShadow) shadow[shadowDraws.count++] = draw;
+    }
+}
 
-            for (int t = firstThread; t <= lastThread; ++t) {
-                Buckets[t].push_back(tri);
+// Drops the draws whose bounds lie outside the view. The draws are kept in a bounding volume
+// hierarchy that is refit every frame and rebuilt only when the meshes drawn change, so after
+// the refit the cost follows the parts of the scene at the edges of the view rather than its size.
+// A mesh's object-space bounds are taken when the hierarchy is built; meshes whose vertices are
+// edited in place must be drawn through a new list, e.g. with an extra draw, to be re-measured.
+// With renderer.occlusion enabled, the draws in view that cover the most of the screen are then
+// rasterized into the occlusion buffer, and the hierarchy is walked again testing every box
+// against it as well.
+// Input Variables:
+// - arena: Arena holding the returned list
+// - draws: Draws of the main view, sorted
+// - camera: World to view matrix
+// - renderer: Renderer holding the projection and occlusion settings
+// Output Variables:
+// - occluded: Number of draws in view that were culled as hidden behind the occluders
+// Returns the draws not culled, in their order in draws
+DrawList cullDraws(FrameArena& arena, const DrawList& draws, const matrix& camera, Renderer& renderer, size_t& occluded) {
+    PROFILE_SCOPE("cull draws");
+    int count = static_cast<int>(draws.size());
+    bool sameMeshes = hierarchyMeshes.size() == draws.size();
+    for (int i = 0; sameMeshes && i < count; i++) sameMeshes = hierarchyMeshes[i] == draws[i].mesh;
+    if (!sameMeshes) {
+        hierarchyMeshes.resize(count);
+        localBounds.resize(count);
+        drawBounds.resize(count);
+        for (int i = 0; i < count; i++) {
+            const Mesh* mesh = draws[i].mesh;
+            hierarchyMeshes[i] = mesh;
+            if (i > 0 && mesh == draws[i - 1].mesh) {
+                localBounds[i] = localBounds[i - 1];    // Instances of one mesh are usually recorded together
+                continue;
             }
+            vec4 centre;
+            float radius;
+            mesh->getWorldBounds(affine(), centre, radius);
+            localBounds[i] = vec4(centre[0], centre[1], centre[2], radius);
         }
     }
 
-    if (!initialized) {
-        for (int i = 0; i < Threads; i++) {
-            pool.emplace_back(threadWork, i, Threads);
+    jobs().parallelFor(count, 1024, [&draws](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            const affine& world = *draws[i].world;
+            const vec4& local = localBounds[i];
+            float scale = 0.f;
+            for (unsigned int c = 0; c < 3; c++) {
+                scale = std::max(scale, world(0, c) * world(0, c) + world(1, c) * world(1, c) + world(2, c) * world(2, c));
+            }
+            vec4 centre = world * vec4(local[0], local[1], local[2]);
+            drawBounds[i] = vec4(centre[0], centre[1], centre[2], local[3] * std::sqrt(scale));
+        }
+    });
+    if (sameMeshes) drawHierarchy.refit(drawBounds.data());
+    else drawHierarchy.build(drawBounds.data(), count);
+
+    matrix viewProjection = renderer.perspective * camera;
+    Frustum frustum = Frustum::fromMatrix(viewProjection);
+    unsigned int* visible = arena.allocate<unsigned int>(draws.size());
+    size_t kept = 0;
+    drawHierarchy.cull(frustum, [visible, &kept](int i) { visible[kept++] = static_cast<unsigned int>(i); });
+    occluded = 0;
+
+    const OcclusionSettings& settings = renderer.occlusion;
+    if (settings.enabled && kept > 1) {
+        PROFILE_SCOPE("occlusion");
+        int width = renderer.canvas.getWidth(), height = renderer.canvas.getHeight();
+        if (!occlusionBuffer.matches(settings.width, settings.height, width, height)) {
+            occlusionBuffer.create(settings.width, settings.height, width, height);
+        }
+        occlusionBuffer.clear();
+
+        // Rank the draws in view by the height of their bounding sphere on screen
+        size_t mark = arena.mark();
+        std::pair<float, unsigned int>* candidates = arena.allocate<std::pair<float, unsigned int>>(kept);
+        size_t candidateCount = 0;
+        float focal = 0.5f * renderer.perspective(1, 1);
+        for (size_t i = 0; i < kept; i++) {
+            const vec4& s = drawBounds[visible[i]];
+            vec4 centre = camera * vec4(s[0], s[1], s[2]);
+            float size = s[3] * focal / std::max(-centre[2], 1e-3f);
+            if (size >= settings.minOccluderSize) candidates[candidateCount++] = { size, visible[i] };
+        }
+        size_t occluderCount = std::min(candidateCount, static_cast<size_t>(std::max(settings.maxOccluders, 0)));
+        std::partial_sort(candidates, candidates + occluderCount, candidates + candidateCount,
+            [](const std::pair<float, unsigned int>& a, const std::pair<float, unsigned int>& b) { return a.first > b.first; });
+
+        size_t triangles = 0;
+        int drawn = 0;
+        for (size_t i = 0; i < occluderCount; i++) {
+            const DrawCommand& draw = draws[candidates[i].second];
+            size_t count = draw.mesh->triangleCount();
+            if (triangles + count > settings.maxOccluderTriangles) continue;
+            triangles += count;
+            drawn++;
+            matrix viewWorld = camera * *draw.world;
+            occlusionBuffer.drawMesh(*draw.mesh, renderer.perspective * viewWorld, arena, renderer.msaa);
         }
-        initialized = true;
+        arena.rewind(mark);
+
+        if (drawn > 0) {
+            size_t inView = kept;
+            kept = 0;
+            drawHierarchy.cull(frustum,
+                [&viewProjection](const float lo[3], const float hi[3]) { return occlusionBuffer.occluded(lo, hi, viewProjection); },
+                [visible, &kept](int i) { visible[kept++] = static_cast<unsigned int>(i); });
+            occluded = inView - kept;
+        }
+    }
+    std::sort(visible, visible + kept);
+
+    DrawCommand* culled = arena.allocate<DrawCommand>(kept);
+    for (size_t i = 0; i < kept; i++) culled[i] = draws[visible[i]];
+    return { culled, kept };
+}
+
+// Renders recorded draws lit by one directional light and any number of point and spot lights.
+// The passes of the frame are declared in a frame graph, which runs independent ones at the
+// same time, e.g. the shadow map next to the geometry of the main view.
+// With renderer.pipelineFrames set, the draws are only set up here and drawn by the next call,
+// next to the set-up of that call's draws; present() then shows the previous frame, and finish()
+// draws the last one.
+// Either way every command has been consumed when render() returns, so the queue can be reset.
+// Input Variables:
+// - renderer: Renderer holding the canvas and depth buffer
+// - queue: Draws recorded since queue.begin(), by any number of threads
+// - camera: World to view matrix
+// - L: Directional light, optionally with a shadow map
+// - lights: Point and spot lights, culled into screen tiles so each pixel only evaluates nearby ones
+void render(Renderer& renderer, const CommandQueue& queue, matrix& camera, Light& L, std::vector<LocalLight>& lights) {
+#if RASTER_TRACK_ALLOCATIONS
+    HeapStats::counted = true;
+    size_t allocationsAtStart = HeapStats::allocations.load(std::memory_order_relaxed);
+#endif
+    // Pipelining brings the second frame slot into use, which warms up again
+    if (renderer.pipelineFrames != pipelinedLastFrame) renderedFrames = 0;
+    pipelinedLastFrame = renderer.pipelineFrames;
+    JobSystem& jobSystem = jobs();
+    Profiler::beginFrame();
+    PROFILE_SCOPE("frame");
+
+    // The slot being set up was last drawn before this call, so its memory can be reused.
+    // An arena only reallocates its block when the previous frame overflowed it; such a frame
+    // does not count as steady state.
+    FrameData& frame = frames[currentFrame];
+    FrameData& previous = frames[currentFrame ^ 1];
+    FrameArena::setLocal(workerArenas[0].get());
+    bool arenaGrew = frame.arena.reset();
+    arenaGrew |= frame.lightArena.reset();
+    for (std::unique_ptr<FrameArena>& arena : workerArenas) {
+        arenaGrew |= arena->reset();
     }
 
-    {
-        std::lock_guard<std::mutex> lock(mtx);
-        pRenderer = &renderer;
-        pLight = &L;
-        finished_count = 0;
-        ready = true;
+    // Sample blocks of the multisample target live in the scratch arenas of the threads that
+    // shade. Passes that rewind a scratch arena, like the shadow map, never overlap shading,
+    // because shading reads the shadow map.
+    DrawList mainDraws, shadowDraws;
+    sortDraws(frame.arena, queue, mainDraws, shadowDraws);
+    // The culling hierarchy and the other buffers sized by the draw count only grow in a frame with
+    // more draws than any before, e.g. while a streamed world fills in
+    bool moreDraws = mainDraws.size() > mostDraws;
+    mostDraws = std::max(mostDraws, mainDraws.size());
+    RASTER_STAT(size_t recordedDraws = mainDraws.size());
+    size_t occludedDraws = 0;
+    if (renderer.cullObjects) mainDraws = cullDraws(frame.arena, mainDraws, camera, renderer, occludedDraws);
+    RASTER_STAT(renderer.stats.addDraws(recordedDraws, recordedDraws - mainDraws.size() - occludedDraws, occludedDraws));
+
+    FrameGraph graph;
+    bool shadowed = L.shadowMap != nullptr;
+    TargetResources targets{
+        graph.importResource("depth buffer"),
+        graph.importResource("canvas"),
+        renderer.msaa ? graph.importResource("samples") : FrameGraph::None,
+        shadowed ? graph.importResource("shadow map") : FrameGraph::None
+    };
+
+    bool drawPrevious = renderer.pipelineFrames && previous.target == &renderer;
+    previous.target = nullptr; // A frame still in flight when pipelining was turned off is dropped
+    if (drawPrevious) {
+        FrameResources drawn{ graph.importResource("previous light grid"), graph.importResource("previous triangles"), graph.importResource("previous bins") };
+        addDrawPasses(graph, previous, drawn, renderer, targets);
+    }
+    // Declared after the previous frame's shading, which still reads last frame's shadow map
+    FrameGraph::PassId shadowPass = -1;
+    if (shadowed) {
+        shadowPass = graph.addPass("shadow map", {}, { targets.shadowMap }, [&L, &camera, &renderer, shadowDraws] {
+            renderShadowMap(*L.shadowMap, shadowDraws, L, camera, renderer.perspective);
+        });
     }
-    cv_start.notify_all();
+    FrameResources current = addSetupPasses(graph, frame, renderer, mainDraws, camera, L, lights);
+    if (!renderer.pipelineFrames) addDrawPasses(graph, frame, current, renderer, targets);
 
-    {
-        std::unique_lock<std::mutex> lock(mtx);
-        while (finished_count != Threads) {
-            cv_done.wait(lock);
-        }
-        ready = false;
+    graph.execute(jobSystem, frame.arena);
+
+    for (FrameGraph::PassId p = 0; p < graph.getPassCount(); p++) {
+        if (p == shadowPass) shadowPassTime += graph.passSeconds(p);
+        else mainPassTime += graph.passSeconds(p);
     }
-    cv_start.notify_all();
+    if (drawPrevious) canvasStrips.rebalance(previous.strips);
+    if (!renderer.pipelineFrames) canvasStrips.rebalance(frame.strips);
+    else {
+        frame.target = &renderer;
+        currentFrame ^= 1;
+    }
+
+#if RASTER_STATS
+    renderer.stats.endFrame();
+    lastFrameStats = renderer.stats.frameStats();
+#endif
+
+    JobSystem::SyncStats sync = jobSystem.takeSyncStats();
+    syncStartTime += sync.start;
+    syncEndTime += sync.end;
+
+#if RASTER_TRACK_ALLOCATIONS
+    size_t allocations = HeapStats::allocations.load(std::memory_order_relaxed) - allocationsAtStart;
+    heapAllocationCount += allocations;
+    for (const std::unique_ptr<FrameArena>& arena : workerArenas) {
+        arenaGrew |= arena->overflowed();
+    }
+    bool steadyState = renderedFrames >= WarmupFrames && !arenaGrew && !moreDraws && !frame.arena.overflowed() && !frame.lightArena.overflowed();
+    assert((allocations == 0 || !steadyState) && "steady-state frame allocated on the heap");
+#endif
+    (void)arenaGrew;
+    (void)moreDraws;
+    renderedFrames++;
 }
+
+// Draws the frame left in flight by the last render() with renderer.pipelineFrames set. That frame
+// still reads the shadow map of the light it was set up with, so call this before destroying or
+// refilling it elsewhere, then present() as after a serial frame. Nothing is drawn without one.
+// Input Variables:
+// - renderer: Renderer the frame was set up for, cleared by the caller
+void finish(Renderer& renderer) {
+    FrameData& previous = frames[currentFrame ^ 1];
+    if (previous.target != &renderer) return;
+    previous.target = nullptr;
+    PROFILE_SCOPE("finish");
+
+    // Its triangles live in the slot's own arena; the samples of the multisample target, which
+    // the caller's clear() dropped, are taken from the scratch arenas again
+    FrameArena::setLocal(workerArenas[0].get());
+    for (std::unique_ptr<FrameArena>& arena : workerArenas) arena->reset();
+
+    FrameGraph graph;
+    TargetResources targets{
+        graph.importResource("depth buffer"),
+        graph.importResource("canvas"),
+        renderer.msaa ? graph.importResource("samples") : FrameGraph::None,
+        previous.light.shadowMap ? graph.importResource("shadow map") : FrameGraph::None
+    };
+    FrameResources drawn{ graph.importResource("previous light grid"), graph.importResource("previous triangles"), graph.importResource("previous bins") };
+    addDrawPasses(graph, previous, drawn, renderer, targets);
+    graph.execute(jobs(), previous.arena);
+
+    for (FrameGraph::PassId p = 0; p < graph.getPassCount(); p++) mainPassTime += graph.passSeconds(p);
+    canvasStrips.rebalance(previous.strips);
+}
+
+// Renders meshes lit by one directional light and any number of point and spot lights.
+// Every mesh is one draw with its own transform and material, in the order given.
+// Input Variables:
+// - renderer: Renderer holding the canvas and depth buffer
+// - scene: Meshes to draw
+// - camera: World to view matrix
+// - L: Directional light, optionally with a shadow map
+// - lights: Point and spot lights
+// - motion: Screen position of each draw last frame for ShadingRate::Auto, owned by the caller and
+//   updated here; entry i belongs to scene[i], so clear it whenever the list changes. Without it
+//   Auto draws are judged by distance only.
+void render(Renderer& renderer, std::vector<Mesh*>& scene, matrix& camera, Light& L, std::vector<LocalLight>& lights, std::vector<vec4>* motion = nullptr) {
+    static CommandQueue meshDraws;
+    if (motion) motion->resize(scene.size(), vec4(0.f, 0.f, 0.f, 0.f)); // w = 0 marks that no previous frame has been seen
+    meshDraws.begin(1);
+    CommandBuffer& buffer = meshDraws.local();
+    for (size_t m = 0; m < scene.size(); m++) {
+        Mesh* mesh = scene[m];
+        buffer.draw(*mesh, &mesh->world, Material::of(*mesh), static_cast<unsigned int>(m), PassAll, motion ? &(*motion)[m] : nullptr);
+    }
+    render(renderer, meshDraws, camera, L, lights);
+}
+
+// Renders a scene lit by a single directional light
+void render(Renderer& renderer, std::vector<Mesh*>& scene, matrix& camera, Light& L) {
+    static std::vector<LocalLight> noLights;
+    render(renderer, scene, camera, L, noLights);
+}
+
+// Renders recorded draws lit by a single directional light
+void render(Renderer& renderer, const CommandQueue& queue, matrix& camera, Light& L) {
+    static std::vector<LocalLight> noLights;
+    render(renderer, queue, camera, L, noLights);
+}
+
 // Test scene function to demonstrate rendering with user-controlled transformations
 // No input variables
 void sceneTest() {
@@ -193,7 +980,7 @@ void sceneTest() {
         renderer.canvas.checkInput();
         renderer.clear();
 
-        mesh.world = matrix::makeTranslation(x, y, z);
+        mesh.world = affine::makeTranslation(x, y, z);
 
         if (renderer.canvas.keyPressed(VK_ESCAPE)) break;
         if (renderer.canvas.keyPressed('A')) x -= 0.1f;
@@ -211,15 +998,15 @@ void sceneTest() {
 
 // Utility function to generate a random rotation matrix
 // No input variables
-matrix makeRandomRotation() {
+affine makeRandomRotation() {
     RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
     unsigned int r = rng.getRandomInt(0, 3);
 
     switch (r) {
-    case 0: return matrix::makeRotateX(rng.getRandomFloat(0.f, 2.0f * M_PI));
-    case 1: return matrix::makeRotateY(rng.getRandomFloat(0.f, 2.0f * M_PI));
-    case 2: return matrix::makeRotateZ(rng.getRandomFloat(0.f, 2.0f * M_PI));
-    default: return matrix::makeIdentity();
+    case 0: return affine::makeRotateX(rng.getRandomFloat(0.f, 2.0f * M_PI));
+    case 1: return affine::makeRotateY(rng.getRandomFloat(0.f, 2.0f * M_PI));
+    case 2: return affine::makeRotateZ(rng.getRandomFloat(0.f, 2.0f * M_PI));
+    default: return affine();
     }
 }
 
@@ -227,16 +1014,17 @@ matrix makeRandomRotation() {
 // No input variables
 void scene1() {
     Renderer renderer;
+    renderer.setMsaa(true); // cube edges alias badly without it
     matrix camera;
     Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
 
     std::vector<Mesh*> scene;
     for (unsigned int i = 0; i < 20; i++) {
         Mesh* m1 = new Mesh(); *m1 = Mesh::makeCube(1.f);
-        m1->world = matrix::makeTranslation(-2.0f, 0.0f, (-3 * static_cast<float>(i))) * makeRandomRotation();
+        m1->world = affine::makeTranslation(-2.0f, 0.0f, (-3 * static_cast<float>(i))) * makeRandomRotation();
         scene.push_back(m1);
         Mesh* m2 = new Mesh(); *m2 = Mesh::makeCube(1.f);
-        m2->world = matrix::makeTranslation(2.0f, 0.0f, (-3 * static_cast<float>(i))) * makeRandomRotation();
+        m2->world = affine::makeTranslation(2.0f, 0.0f, (-3 * static_cast<float>(i))) * makeRandomRotation();
         scene.push_back(m2);
     }
 
@@ -247,8 +1035,8 @@ void scene1() {
         renderer.clear();
         camera = matrix::makeTranslation(0, 0, -zoffset);
 
-        scene[0]->world = scene[0]->world * matrix::makeRotateXYZ(0.1f, 0.1f, 0.0f);
-        scene[1]->world = scene[1]->world * matrix::makeRotateXYZ(0.0f, 0.1f, 0.2f);
+        scene[0]->world = scene[0]->world * affine::makeRotateXYZ(0.1f, 0.1f, 0.0f);
+        scene[1]->world = scene[1]->world * affine::makeRotateXYZ(0.0f, 0.1f, 0.2f);
 
         if (renderer.canvas.keyPressed(VK_ESCAPE)) break;
         zoffset -= 0.1f;
@@ -266,11 +1054,12 @@ void scene2() {
     Renderer renderer;
     matrix camera = matrix::makeIdentity();
     Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+    ShadowMap shadows(1024);
+    L.shadowMap = &shadows;
 
     std::vector<Mesh*> scene;
 
-    struct rRot { float x; float y; float z; }; // Structure to store random rotation parameters
-    std::vector<rRot> rotations;
+    TransformBatch cubes; // Cube placements, each spinning by a random rotation per frame
 
     RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
 
@@ -280,9 +1069,10 @@ void scene2() {
             Mesh* m = new Mesh();
             *m = Mesh::makeCube(1.f);
             scene.push_back(m);
-            m->world = matrix::makeTranslation(-7.0f + (static_cast<float>(x) * 2.f), 5.0f - (static_cast<float>(y) * 2.f), -8.f);
-            rRot r{ rng.getRandomFloat(-.1f, .1f), rng.getRandomFloat(-.1f, .1f), rng.getRandomFloat(-.1f, .1f) };
-            rotations.push_back(r);
+            Transform t;
+            t.position = vec4(-7.0f + (static_cast<float>(x) * 2.f), 5.0f - (static_cast<float>(y) * 2.f), -8.f);
+            float rx = rng.getRandomFloat(-.1f, .1f), ry = rng.getRandomFloat(-.1f, .1f), rz = rng.getRandomFloat(-.1f, .1f);
+            cubes.add(t, quaternion::fromEuler(rx, ry, rz));
         }
     }
 
@@ -292,7 +1082,7 @@ void scene2() {
     scene.push_back(sphere);
     float sphereOffset = -6.f;
     float sphereStep = 0.1f;
-    sphere->world = matrix::makeTranslation(sphereOffset, 0.f, -6.f);
+    sphere->world = affine::makeTranslation(sphereOffset, 0.f, -6.f);
 
     auto start = std::chrono::high_resolution_clock::now();
     std::chrono::time_point<std::chrono::high_resolution_clock> end;
@@ -305,18 +1095,19 @@ void scene2() {
         renderer.clear();
 
         // Rotate each cube in the grid
-        for (unsigned int i = 0; i < rotations.size(); i++)
-            scene[i]->world = scene[i]->world * matrix::makeRotateXYZ(rotations[i].x, rotations[i].y, rotations[i].z);
+        cubes.update();
+        cubes.write([&scene](size_t i, const affine& world) { scene[i]->world = world; });
 
         // Move the sphere back and forth
         sphereOffset += sphereStep;
-        sphere->world = matrix::makeTranslation(sphereOffset, 0.f, -6.f);
+        sphere->world = affine::makeTranslation(sphereOffset, 0.f, -6.f);
         if (sphereOffset > 6.0f || sphereOffset < -6.0f) {
             sphereStep *= -1.f;
 
         }
 
         if (renderer.canvas.keyPressed(VK_ESCAPE)) break;
+        if (renderer.canvas.keyPressed('P')) saveSnapshot("scene2.rscn", scene, camera, L, {}); // Capture for sceneSnapshot()
 
         render(renderer, scene, camera, L);
         renderer.present();
@@ -330,46 +1121,124 @@ void scene3() {
     matrix camera = matrix::makeIdentity();
     Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
 
-    std::vector<Mesh*> scene;
-    struct rRot { float x, y, z; };
-    std::vector<rRot> cubeRotations;
+    // The small spheres are instances of one mesh, each drawn with its own transform
+    Mesh ball = Mesh::makeSphere(0.4f, 10, 20);
+    TransformBatch spheres; // Small sphere placements, each spinning by a random rotation per frame
     RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
 
     for (unsigned int y = 0; y < 10; y++) {
         for (unsigned int x = 0; x < 5; x++) {
-            Mesh* m = new Mesh();
-            *m = Mesh::makeSphere(0.4f, 10, 20);
-            m->world = matrix::makeTranslation(2.0f + (x * 1.0f), 4.5f - (y * 1.0f), -10.f);
-            scene.push_back(m);
-            cubeRotations.push_back({ rng.getRandomFloat(-.02f, .02f), rng.getRandomFloat(-.02f, .02f), rng.getRandomFloat(-.02f, .02f) });
+            Transform t;
+            t.position = vec4(2.0f + (x * 1.0f), 4.5f - (y * 1.0f), -10.f);
+            float rx = rng.getRandomFloat(-.02f, .02f), ry = rng.getRandomFloat(-.02f, .02f), rz = rng.getRandomFloat(-.02f, .02f);
+            spheres.add(t, quaternion::fromEuler(rx, ry, rz));
         }
     }
 
-    Mesh* aSphere = new Mesh();
-    *aSphere = Mesh::makeSphere(1.5f, 40, 80);
+    std::vector<affine> ballWorlds(spheres.size());
 
-    scene.push_back(aSphere);
+    Mesh aSphere = Mesh::makeSphere(1.5f, 40, 80);
+    aSphere.shadingRate = ShadingRate::Rate2x2; // low-frequency surface, shade once per 2x2 block
 
     float sphereY = 0.0f;
     float sphereStep = 0.06f;
 
+    CommandQueue queue;
     bool running = true;
     while (running) {
         FPS();
         renderer.canvas.checkInput();
         renderer.clear();
 
-        for (size_t i = 0; i < cubeRotations.size(); i++) {
-            scene[i]->world = scene[i]->world * matrix::makeRotateXYZ(cubeRotations[i].x, cubeRotations[i].y, cubeRotations[i].z);
-        }
+        spheres.update();
+        spheres.write([&ballWorlds](size_t i, const affine& world) { ballWorlds[i] = world; });
 
         sphereY += sphereStep;
-        aSphere->world = matrix::makeTranslation(-4.0f, sphereY, -8.f);
+        aSphere.world = affine::makeTranslation(-4.0f, sphereY, -8.f);
         if (sphereY > 4.5f || sphereY < -4.5f) sphereStep *= -1.f;
 
         if (renderer.canvas.keyPressed(VK_ESCAPE)) break;
 
-        render(renderer, scene, camera, L);
+        // Record the draws on every thread; the keys keep the order of a serial traversal
+        queue.begin(jobs().getThreadCount());
+        jobs().parallelFor(static_cast<int>(ballWorlds.size()), 8, [&queue, &ball, &ballWorlds](int begin, int end) {
+            CommandBuffer& buffer = queue.local();
+            for (int i = begin; i < end; i++) buffer.draw(ball, &ballWorlds[i], Material::of(ball), i);
+        });
+        queue.local().draw(aSphere, &aSphere.world, Material::of(aSphere), static_cast<unsigned int>(ballWorlds.size()));
+
+        render(renderer, queue, camera, L);
+
+        renderer.present();
+    }
+}
+
+// Scene lit mostly by hundreds of small moving point lights plus a few spot lights
+// No input variables
+void sceneLights() {
+    Renderer renderer;
+    matrix camera = matrix::makeIdentity();
+    Light L{ vec4(0.f, 1.f, -1.f, 0.f), colour(0.1f, 0.1f, 0.1f), colour(0.05f, 0.05f, 0.05f) }; // faces away from the camera, so the local lights dominate
+
+    std::vector<Mesh*> scene;
+    for (unsigned int y = 0; y < 8; y++) {
+        for (unsigned int x = 0; x < 12; x++) {
+            Mesh* m = new Mesh();
+            *m = Mesh::makeSphere(0.45f, 10, 20);
+            m->world = affine::makeTranslation(-5.5f + x * 1.0f, 3.5f - y * 1.0f, -10.f);
+            m->kd = 0.9f;
+            scene.push_back(m);
+        }
+    }
+
+    struct Orbit { float cx, cy, radius, phase, speed; };
+    std::vector<Orbit> orbits;
+    std::vector<LocalLight> lights;
+    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+
+    for (unsigned int i = 0; i < 256; i++) {
+        orbits.push_back({ rng.getRandomFloat(-6.f, 6.f), rng.getRandomFloat(-4.f, 4.f), rng.getRandomFloat(0.2f, 1.5f),
+            rng.getRandomFloat(0.f, 2.0f * M_PI), rng.getRandomFloat(-0.05f, 0.05f) });
+        LocalLight light;
+        light.L = colour(rng.getRandomFloat(0.f, 0.8f), rng.getRandomFloat(0.f, 0.8f), rng.getRandomFloat(0.f, 0.8f));
+        light.range = rng.getRandomFloat(0.6f, 1.2f);
+        lights.push_back(light);
+    }
+
+    // Spot lights sweeping across the grid from in front of it
+    const unsigned int spots = 4;
+    for (unsigned int i = 0; i < spots; i++) {
+        LocalLight light;
+        light.position = vec4(-4.5f + i * 3.0f, 0.f, -6.f, 1.f);
+        light.L = colour(0.5f, 0.45f, 0.3f);
+        light.range = 8.f;
+        light.cosOuter = std::cos(0.2f);
+        light.cosInner = std::cos(0.12f);
+        lights.push_back(light);
+    }
+
+    float t = 0.f;
+    bool running = true;
+    while (running) {
+        FPS();
+        renderer.canvas.checkInput();
+        renderer.clear();
+
+        t += 1.f;
+        for (size_t i = 0; i < orbits.size(); i++) {
+            const Orbit& o = orbits[i];
+            float a = o.phase + o.speed * t;
+            lights[i].position = vec4(o.cx + o.radius * std::cos(a), o.cy + o.radius * std::sin(a), -9.2f, 1.f);
+        }
+        for (unsigned int i = 0; i < spots; i++) {
+            LocalLight& spot = lights[orbits.size() + i];
+            spot.direction = vec4(std::sin(0.02f * t + i), 0.4f * std::cos(0.013f * t + i), -1.f, 0.f);
+        }
+
+        if (renderer.canvas.keyPressed(VK_ESCAPE)) break;
+        if (renderer.canvas.keyPressed('P')) saveSnapshot("lights.rscn", scene, camera, L, lights); // Capture for sceneSnapshot()
+
+        render(renderer, scene, camera, L, lights);
 
         renderer.present();
     }
@@ -377,15 +1246,507 @@ void scene3() {
     for (auto& m : scene) delete m;
 }
 
-// Entry point of the application
+// Scene saved with saveSnapshot(), e.g. by pressing P in scene2 or sceneLights, drawn as captured
+// Input Variables:
+// - path: Snapshot to load
+void sceneSnapshot(const std::string& path) {
+    SceneSnapshot snapshot;
+    if (!loadSnapshot(path, snapshot)) {
+        std::cout << "Cannot load snapshot " << path << std::endl;
+        return;
+    }
+
+    Renderer renderer;
+    while (true) {
+        FPS();
+        renderer.canvas.checkInput();
+        renderer.clear();
+
+        if (renderer.canvas.keyPressed(VK_ESCAPE)) break;
+
+        render(renderer, snapshot.scene, snapshot.camera, snapshot.light, snapshot.lights);
+
+        renderer.present();
+    }
+}
+
+// City of boxes streamed from disk in chunks while the camera flies over it. The first run writes
+// the chunks to ./city; later runs only read the index and load chunks as the camera nears them.
 // No input variables
-int main() {
+void sceneCity() {
+    StreamingOptions options;
+    options.memoryBudget = size_t(64) << 20;
+    StreamingWorld world;
+    if (!world.open("city", options)) {
+        RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+        Mesh cube = Mesh::makeCube(1.f);
+        std::vector<Mesh*> city;
+        for (int z = 0; z < 400; z++) {
+            for (int x = -20; x < 20; x++) {
+                Mesh* m = new Mesh(cube);
+                float height = rng.getRandomFloat(1.f, 12.f);
+                m->world = affine::makeTRS(vec4(x * 4.f, height * 0.5f, -z * 4.f), quaternion(), vec4(3.f, height, 3.f));
+                m->setColour(colour(rng.getRandomFloat(0.4f, 1.f), rng.getRandomFloat(0.4f, 1.f), rng.getRandomFloat(0.4f, 1.f)), 0.3f, 0.7f);
+                city.push_back(m);
+            }
+        }
+        bool written = buildStreamingWorld(city, 32.f, "city");
+        for (auto& m : city) delete m;
+        if (!written || !world.open("city", options)) {
+            std::cout << "Cannot write the city" << std::endl;
+            return;
+        }
+    }
+
+    Renderer renderer;
+    Light L{ vec4(0.3f, 1.f, 0.5f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+    GamesEngineeringBase::Timer timer;
+    std::vector<Mesh*> scene;
+    float z = 10.f;
+    while (true) {
+        FPS();
+        renderer.canvas.checkInput();
+        renderer.clear();
+
+        if (renderer.canvas.keyPressed(VK_ESCAPE)) break;
+        z -= 0.5f;
+        if (z < -1600.f) z = 10.f;
+
+        vec4 eye(0.f, 20.f, z);
+        matrix camera = matrix::makeLookAt(eye, vec4(0.f, 10.f, z - 30.f), vec4(0.f, 1.f, 0.f, 0.f));
+        world.update(eye, timer.dt());
+        scene.clear();
+        world.gather(scene);
+
+        render(renderer, scene, camera, L);
+
+        renderer.present();
+    }
+}
+
+// Regression tests. Each test scene draws a fixed animation from a fixed seed, so every build and
+// every way of running the renderer must produce the same frames.
+
+// Callback of a test scene, called after the i-th call of render() with i
+using FrameCallback = std::function<void(int)>;
+
+// Test scene: two rows of cubes at random angles, multisampled, with the camera flying in (see scene1)
+// Input Variables:
+// - renderer: Renderer to draw with
+// - frames: Number of frames to render
+// - rendered: Called after every frame
+void testCubes(Renderer& renderer, int frames, const FrameCallback& rendered) {
+    RandomNumberGenerator::getInstance().seed(1);
+    renderer.setMsaa(true);
+    Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+
+    std::vector<Mesh> meshes(40, Mesh::makeCube(1.f));
+    std::vector<Mesh*> scene;
+    for (unsigned int i = 0; i < meshes.size(); i++) {
+        meshes[i].world = affine::makeTranslation(i % 2 ? 2.0f : -2.0f, 0.0f, -3.f * (i / 2)) * makeRandomRotation();
+        scene.push_back(&meshes[i]);
+    }
+
+    for (int f = 0; f < frames; f++) {
+        renderer.clear();
+        matrix camera = matrix::makeTranslation(0, 0, -8.f + 0.3f * f);
+        meshes[0].world = meshes[0].world * affine::makeRotateXYZ(0.1f, 0.1f, 0.0f);
+        meshes[1].world = meshes[1].world * affine::makeRotateXYZ(0.0f, 0.1f, 0.2f);
+        render(renderer, scene, camera, L);
+        rendered(f);
+    }
+    renderer.setMsaa(false);
+}
+
+// Test scene: grid of spinning cubes and a sliding sphere, shadowed (see scene2)
+// Input Variables:
+// - renderer, frames, rendered: As testCubes()
+void testGrid(Renderer& renderer, int frames, const FrameCallback& rendered) {
+    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+    rng.seed(2);
+    matrix camera = matrix::makeIdentity();
+    Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+    ShadowMap shadows(1024);
+    L.shadowMap = &shadows;
+
+    std::vector<Mesh> meshes(49, Mesh::makeCube(1.f));
+    meshes[48] = Mesh::makeSphere(1.0f, 10, 20);
+    std::vector<Mesh*> scene;
+    for (Mesh& mesh : meshes) scene.push_back(&mesh);
+    TransformBatch cubes;
+    for (unsigned int i = 0; i < 48; i++) {
+        Transform t;
+        t.position = vec4(-7.0f + (i % 8) * 2.f, 5.0f - (i / 8) * 2.f, -8.f);
+        float rx = rng.getRandomFloat(-.1f, .1f), ry = rng.getRandomFloat(-.1f, .1f), rz = rng.getRandomFloat(-.1f, .1f);
+        cubes.add(t, quaternion::fromEuler(rx, ry, rz));
+    }
+
+    for (int f = 0; f < frames; f++) {
+        renderer.clear();
+        cubes.update();
+        cubes.write([&meshes](size_t i, const affine& world) { meshes[i].world = world; });
+        meshes[48].world = affine::makeTranslation(-6.f + 0.5f * f, 0.f, -6.f);
+        render(renderer, scene, camera, L);
+        rendered(f);
+    }
+}
+
+// Test scene: instanced spheres recorded from every thread, and a large sphere shaded per 2x2 block
+// (see scene3)
+// Input Variables:
+// - renderer, frames, rendered: As testCubes()
+void testInstances(Renderer& renderer, int frames, const FrameCallback& rendered) {
+    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+    rng.seed(3);
+    matrix camera = matrix::makeIdentity();
+    Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+
+    Mesh ball = Mesh::makeSphere(0.4f, 10, 20);
+    Mesh aSphere = Mesh::makeSphere(1.5f, 40, 80);
+    aSphere.shadingRate = ShadingRate::Rate2x2;
+    std::vector<affine> ballWorlds;
+    for (unsigned int i = 0; i < 50; i++) {
+        ballWorlds.push_back(affine::makeTranslation(2.0f + (i % 5), 4.5f - (i / 5), -10.f) * makeRandomRotation());
+    }
+
+    CommandQueue queue;
+    for (int f = 0; f < frames; f++) {
+        renderer.clear();
+        aSphere.world = affine::makeTranslation(-4.0f, -3.f + 0.6f * f, -8.f);
+        queue.begin(jobs().getThreadCount());
+        jobs().parallelFor(static_cast<int>(ballWorlds.size()), 8, [&queue, &ball, &ballWorlds](int begin, int end) {
+            CommandBuffer& buffer = queue.local();
+            for (int i = begin; i < end; i++) buffer.draw(ball, &ballWorlds[i], Material::of(ball), i);
+        });
+        queue.local().draw(aSphere, &aSphere.world, Material::of(aSphere), static_cast<unsigned int>(ballWorlds.size()));
+        render(renderer, queue, camera, L);
+        rendered(f);
+    }
+}
+
+// Test scene: grid of spheres lit by orbiting point lights and sweeping spot lights (see sceneLights)
+// Input Variables:
+// - renderer, frames, rendered: As testCubes()
+void testLights(Renderer& renderer, int frames, const FrameCallback& rendered) {
+    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+    rng.seed(4);
+    matrix camera = matrix::makeIdentity();
+    Light L{ vec4(0.f, 1.f, -1.f, 0.f), colour(0.1f, 0.1f, 0.1f), colour(0.05f, 0.05f, 0.05f) };
+
+    std::vector<Mesh> meshes(96, Mesh::makeSphere(0.45f, 10, 20));
+    std::vector<Mesh*> scene;
+    for (unsigned int i = 0; i < meshes.size(); i++) {
+        meshes[i].world = affine::makeTranslation(-5.5f + (i % 12), 3.5f - (i / 12), -10.f);
+        meshes[i].kd = 0.9f;
+        scene.push_back(&meshes[i]);
+    }
+
+    std::vector<LocalLight> lights(132);
+    std::vector<float> cx(128), cy(128), phase(128);
+    for (unsigned int i = 0; i < 128; i++) {
+        cx[i] = rng.getRandomFloat(-6.f, 6.f);
+        cy[i] = rng.getRandomFloat(-4.f, 4.f);
+        lights[i].L = colour(rng.getRandomFloat(0.f, 0.8f), rng.getRandomFloat(0.f, 0.8f), rng.getRandomFloat(0.f, 0.8f));
+        lights[i].range = rng.getRandomFloat(0.6f, 1.2f);
+        phase[i] = rng.getRandomFloat(0.f, 2.0f * M_PI);
+    }
+    for (unsigned int i = 128; i < lights.size(); i++) {
+        lights[i].position = vec4(-4.5f + (i - 128) * 3.0f, 0.f, -6.f, 1.f);
+        lights[i].L = colour(0.5f, 0.45f, 0.3f);
+        lights[i].range = 8.f;
+        lights[i].cosOuter = std::cos(0.2f);
+        lights[i].cosInner = std::cos(0.12f);
+    }
+
+    for (int f = 0; f < frames; f++) {
+        renderer.clear();
+        for (unsigned int i = 0; i < 128; i++) {
+            float a = phase[i] + 0.3f * f;
+            lights[i].position = vec4(cx[i] + 0.5f * std::cos(a), cy[i] + 0.5f * std::sin(a), -9.2f, 1.f);
+        }
+        for (unsigned int i = 128; i < lights.size(); i++) {
+            lights[i].direction = vec4(std::sin(0.2f * f + i), 0.4f * std::cos(0.13f * f + i), -1.f, 0.f);
+        }
+        render(renderer, scene, camera, L, lights);
+        rendered(f);
+    }
+}
+
+// Test scene: soup of random triangles of every size and orientation, overlapping, partly off
+// screen and some under a pixel in area, to reach the edge cases the built-in scenes do not
+// Input Variables:
+// - renderer, frames, rendered: As testCubes()
+// - seed: Seed of the soup
+void testSoup(Renderer& renderer, int frames, const FrameCallback& rendered, unsigned int seed) {
+    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+    rng.seed(seed);
+    matrix camera = matrix::makeIdentity();
+    Light L{ vec4(0.3f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+
+    Mesh soup;
+    for (int t = 0; t < 2000; t++) {
+        // Sizes spread over three orders of magnitude, centres beyond the edges of the view
+        float size = std::pow(10.f, rng.getRandomFloat(-2.5f, 0.5f));
+        float cx = rng.getRandomFloat(-9.f, 9.f), cy = rng.getRandomFloat(-7.f, 7.f), cz = rng.getRandomFloat(-14.f, -4.f);
+        soup.col.set(rng.getRandomFloat(0.f, 1.f), rng.getRandomFloat(0.f, 1.f), rng.getRandomFloat(0.f, 1.f));
+        for (int v = 0; v < 3; v++) {
+            vec4 position(cx + rng.getRandomFloat(-size, size), cy + rng.getRandomFloat(-size, size), cz + rng.getRandomFloat(-size, size) * 0.5f);
+            vec4 normal(rng.getRandomFloat(-1.f, 1.f), rng.getRandomFloat(-1.f, 1.f), 1.f, 0.f);
+            normal.normalise();
+            soup.addVertex(position, normal);
+        }
+        soup.addTriangle(3 * t, 3 * t + 1, 3 * t + 2);
+        soup.addTriangle(3 * t, 3 * t + 2, 3 * t + 1); // Both windings, so half survive the back-face test
+    }
+    std::vector<Mesh*> scene{ &soup };
+
+    for (int f = 0; f < frames; f++) {
+        renderer.clear();
+        soup.world = affine::makeRotateZ(0.05f * f);
+        render(renderer, scene, camera, L);
+        rendered(f);
+    }
+}
+
+// Test scene: a finely tessellated sphere and a wall in front of a field of small meshes, many of
+// them hidden behind the two and many outside the view, for frustum and occlusion culling. Nothing
+// reaches behind the camera, so the frames are the same with culling off.
+// Input Variables:
+// - renderer, frames, rendered: As testCubes()
+void testOccluders(Renderer& renderer, int frames, const FrameCallback& rendered) {
+    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+    rng.seed(5);
+    Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+
+    Mesh sphere = Mesh::makeSphere(3.f, 40, 80);
+    Mesh wall = Mesh::makeCube(6.f);
+    std::vector<Mesh> meshes;
+    for (unsigned int i = 0; i < 300; i++) {
+        meshes.push_back(i % 2 ? Mesh::makeSphere(0.3f, 10, 20) : Mesh::makeCube(0.5f));
+        meshes.back().world = affine::makeTranslation(rng.getRandomFloat(-24.f, 24.f), rng.getRandomFloat(-10.f, 10.f), rng.getRandomFloat(-40.f, -14.f))
+            * makeRandomRotation();
+    }
+    std::vector<Mesh*> scene{ &sphere, &wall };
+    for (Mesh& mesh : meshes) scene.push_back(&mesh);
+
+    for (int f = 0; f < frames; f++) {
+        renderer.clear();
+        matrix camera = matrix::makeRotateY(0.03f * f);
+        sphere.world = affine::makeTranslation(-3.f + 0.5f * f, 0.5f, -8.f);
+        wall.world = affine::makeTranslation(5.f, -1.f, -11.f) * affine::makeRotateXYZ(0.f, 0.05f * f, 0.f);
+        render(renderer, scene, camera, L);
+        rendered(f);
+    }
+}
+
+// A scene regressionTests() renders, and what it is checked for
+struct TestScene {
+    const char* name;
+    std::function<void(Renderer&, int, const FrameCallback&)> run;
+    bool culls = false;     // Checked against culling off, and for culling anything
+};
+
+// Canvas size of the test scenes, a quarter of the windowed scenes' to keep the references small
+static const unsigned int TestWidth = 512, TestHeight = 384;
+
+static const TestScene testScenes[] = {
+    { "cubes", testCubes },
+    { "grid", testGrid },
+    { "instances", testInstances },
+    { "lights", testLights },
+    { "soup1", [](Renderer& r, int n, const FrameCallback& cb) { testSoup(r, n, cb, 101); } },
+    { "soup2", [](Renderer& r, int n, const FrameCallback& cb) { testSoup(r, n, cb, 102); } },
+    { "occluders", testOccluders, true },
+};
+
+// Renders a test scene on one thread with a renderer of its own, for comparing two builds of the
+// renderer in one process (see scalar.cpp)
+// Input Variables:
+// - name: Name of the scene in testScenes
+// - frames: Number of frames to render
+// - rendered: Called after every frame with its index, the canvas size and its pixels, 3 bytes each
+// Returns false when there is no scene of that name
+bool renderTestScene(const std::string& name, int frames, const std::function<void(int, int, int, const unsigned char*)>& rendered) {
+    static Renderer renderer(TestWidth, TestHeight);
+    for (const TestScene& scene : testScenes) {
+        if (name != scene.name) continue;
+        setThreadCount(1);
+        scene.run(renderer, frames, [&rendered](int f) {
+            Image image = Image::capture(renderer.canvas);
+            rendered(f, image.width, image.height, image.rgb.data());
+        });
+        return true;
+    }
+    return false;
+}
+
+// Renders every test scene and compares the frames with reference images and across ways of running
+// the renderer. Each scene runs on one thread first; those frames are compared with the references
+// in the directory, a missing one failing, or written there when updating. The scene then runs with a Z
+// pre-pass, with the scalar build of scalar.cpp when this one uses SIMD, on several threads, which
+// splits the targets into different strips, and with pipelined frames; all must match the
+// single-threaded frames. Scenes that keep everything in front of the camera also run with culling
+// off, which must not change a pixel; with RASTER_STATS they must cull some draws both outside the
+// view and behind occluders in every checked frame. To cross-check another build option, make the
+// references with one build and test the other against them. Frames are never presented.
+// Input Variables:
+// - directory: Directory of the reference images, created when updating
+// - update: Write the references from this build's frames instead of comparing
+// - tolerance: Largest channel difference still counted as equal
+// Returns the number of frames that failed; a diff image is written next to the reference of each
+int regressionTests(const std::string& directory, bool update = false, int tolerance = 0) {
+    if (update) {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+    }
+    const int Frames = 9;
+    const int Checked[] = { 0, 4, 8 };
+    auto isChecked = [&Checked](int f) { return std::find(std::begin(Checked), std::end(Checked), f) != std::end(Checked); };
+    int manyThreads = std::max(JobSystem::defaultThreadCount(), 4);
+
+    Renderer renderer(TestWidth, TestHeight);
+    int failures = 0;
+    auto check = [&](const Image& expected, const Image& actual, const std::string& label, const std::string& diffPath) {
+        Image diff;
+        ImageComparison result = compareImages(expected, actual, tolerance, &diff);
+        std::cout << "\n " << label << ": ";
+        if (result.matches()) {
+            std::cout << "ok (max difference " << result.maxDifference << ")";
+            return;
+        }
+        failures++;
+        if (!result.sameSize) std::cout << "FAILED, size differs";
+        else {
+            std::cout << "FAILED, " << result.differing << " pixels differ, max difference " << result.maxDifference;
+            diff.save(diffPath);
+        }
+    };
+
+    for (const TestScene& scene : testScenes) {
+        std::string base = directory + "/" + scene.name + "_";
+        Image frames[Frames];
+
+        // Single-threaded and serial, against the references
+        setThreadCount(1);
+        scene.run(renderer, Frames, [&](int f) {
+            if (!isChecked(f)) return;
+            frames[f] = Image::capture(renderer.canvas);
+#if RASTER_STATS
+            const FrameStats& stats = renderer.stats.frameStats();
+            if (scene.culls && (stats.frustumCulled == 0 || stats.occlusionCulled == 0)) {
+                failures++;
+                std::cout << "\n " << scene.name << " frame " << f << ": FAILED, " << stats.frustumCulled << " draws outside the view and "
+                    << stats.occlusionCulled << " occluded, expected some of both";
+            }
+#endif
+            std::string path = base + std::to_string(f) + ".ppm";
+            Image reference;
+            if (update) {
+                frames[f].save(path);
+                std::cout << "\n " << scene.name << " frame " << f << ": reference written";
+            }
+            else if (!reference.load(path)) {
+                failures++;
+                std::cout << "\n " << scene.name << " frame " << f << ": FAILED, no reference " << path;
+            }
+            else check(reference, frames[f], std::string(scene.name) + " frame " + std::to_string(f), base + std::to_string(f) + "_diff.ppm");
+        });
+
+        // Z pre-pass, same frames; the multisample target has no pre-pass, so cubes runs as before
+        renderer.zPrepass = true;
+        scene.run(renderer, Frames, [&](int f) {
+            if (!isChecked(f)) return;
+            check(frames[f], Image::capture(renderer.canvas), std::string(scene.name) + " frame " + std::to_string(f) + ", Z pre-pass",
+                base + std::to_string(f) + "_prepass_diff.ppm");
+        });
+        renderer.zPrepass = false;
+
+#if RASTER_SCALAR_TWIN
+        // Scalar build of the renderer, same frames
+        scalar::renderTestScene(scene.name, Frames, [&](int f, int width, int height, const unsigned char* rgb) {
+            if (!isChecked(f)) return;
+            Image image;
+            image.width = width;
+            image.height = height;
+            image.rgb.assign(rgb, rgb + static_cast<size_t>(width) * height * 3);
+            check(frames[f], image, std::string(scene.name) + " frame " + std::to_string(f) + ", scalar", base + std::to_string(f) + "_scalar_diff.ppm");
+        });
+#endif
+
+        // Several threads, same frames
+        setThreadCount(manyThreads);
+        scene.run(renderer, Frames, [&](int f) {
+            if (!isChecked(f)) return;
+            check(frames[f], Image::capture(renderer.canvas), std::string(scene.name) + " frame " + std::to_string(f) + ", " + std::to_string(manyThreads) + " threads",
+                base + std::to_string(f) + "_threads_diff.ppm");
+        });
+
+        // Pipelined: each call draws the frame set up by the call before, and finish() the last
+        // one while the scene's shadow map still exists
+        renderer.pipelineFrames = true;
+        auto checkPipelined = [&](int f) {
+            if (!isChecked(f)) return;
+            check(frames[f], Image::capture(renderer.canvas), std::string(scene.name) + " frame " + std::to_string(f) + ", pipelined",
+                base + std::to_string(f) + "_pipelined_diff.ppm");
+        };
+        scene.run(renderer, Frames, [&](int f) {
+            if (f > 0) checkPipelined(f - 1);
+            if (f == Frames - 1) {
+                renderer.clear();
+                finish(renderer);
+                checkPipelined(f);
+            }
+        });
+        renderer.pipelineFrames = false;
+
+        // Culling off, same frames
+        if (scene.culls) {
+            renderer.cullObjects = false;
+            scene.run(renderer, Frames, [&](int f) {
+                if (!isChecked(f)) return;
+                check(frames[f], Image::capture(renderer.canvas), std::string(scene.name) + " frame " + std::to_string(f) + ", not culled",
+                    base + std::to_string(f) + "_unculled_diff.ppm");
+            });
+            renderer.cullObjects = true;
+        }
+    }
+
+    setThreadCount(0);
+    std::cout << "\n Regression tests: " << (failures ? std::to_string(failures) + " frames FAILED" : std::string("all passed")) << std::endl;
+    return failures;
+}
+
+#if !defined(RASTER_NO_MAIN) // Defined by programs that build raster.cpp into their own, like bench.cpp
+// Entry point of the application
+// Input Variables:
+// - argv: Empty to run the scene chosen below, or "--test [directory] [--update]" to run the
+//   regression tests against the references in directory (./references by default), or with
+//   --update to write them
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "--test") {
+        std::string directory = "references";
+        bool update = false;
+        for (int i = 2; i < argc; i++) {
+            if (std::string(argv[i]) == "--update") update = true;
+            else directory = argv[i];
+        }
+        return regressionTests(directory, update) == 0 ? 0 : 1;
+    }
+
     // Uncomment the desired scene function to run
     //scene1();
     scene2();
     //scene3();
+    //sceneLights();
+    //sceneSnapshot("scene2.rscn");
+    //sceneCity();
     //sceneTest(); 
 
+#if RASTER_PROFILE
+    // The last frames of every thread, for chrome://tracing or ui.perfetto.dev
+    Profiler::writeChromeTrace("frame_trace.json");
+#endif
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
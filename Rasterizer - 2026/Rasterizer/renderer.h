@@ -4,6 +4,29 @@
 #include "GamesEngineeringBase.h"
 #include "zbuffer.h"
 #include "matrix.h"
+#include "msaa.h"
+#include "profiler.h"
+#include "stats.h"
+
+// Thresholds used to pick a shading rate for meshes set to ShadingRate::Auto.
+// A mesh is shaded at 2x2 when it is further away than coarseDistance or its origin moved
+// more than motionThreshold pixels since the previous frame, otherwise at 1x1.
+struct ShadingRateSettings {
+    float coarseDistance = 12.0f;   // View-space distance beyond which coarse shading is used
+    float motionThreshold = 8.0f;   // Screen-space motion in pixels per frame beyond which coarse shading is used
+};
+
+// Software occlusion culling of the main view's draws. The draws in view that cover the most of
+// the screen are rasterized into a small depth buffer, and the others are tested against it before
+// their vertices are transformed.
+struct OcclusionSettings {
+    bool enabled = true;                   // Test draws against the occluders; needs Renderer::cullObjects
+    int width = 256;                       // Size of the occlusion depth buffer
+    int height = 128;
+    float minOccluderSize = 0.1f;          // Least radius of an occluder's bounding sphere, as a fraction of the screen height
+    int maxOccluders = 16;                 // Most draws rasterized as occluders per frame
+    size_t maxOccluderTriangles = 20000;   // Most occluder triangles per frame
+};
 
 // The `Renderer` class handles rendering operations, including managing the
 // Z-buffer, canvas, and perspective transformations for a 3D scene.
@@ -16,22 +39,56 @@ public:
     Zbuffer<float> zbuffer;                  // Z-buffer for depth management
     GamesEngineeringBase::Window canvas;     // Canvas for rendering the scene
     matrix perspective;                      // Perspective projection matrix
+    ShadingRateSettings shadingRates;        // Thresholds for automatic coarse shading
+    bool zPrepass = false;                   // Lay down depth for the whole frame before shading so each pixel is shaded once
+    bool msaa = false;                       // Rasterize into the 4x multisample target instead of canvas and zbuffer, see setMsaa()
+    MsaaBuffer samples;                      // Multisample colour and depth, resolved into the canvas by present()
+    bool fastNormalise = false;              // Normalise per-pixel normals with vec4::normaliseFast instead of sqrt and divides
+    // Set up each frame while the previous one is rasterized; present() then shows the previous frame.
+    // The frame in flight reads the shadow map it was set up with until the next render() or
+    // finish() returns, so call finish() before destroying it or turning this off.
+    bool pipelineFrames = false;
+    bool cullObjects = true;                 // Skip draws whose bounds lie outside the view, found through a hierarchy over the draws
+    OcclusionSettings occlusion;             // Skip draws hidden behind large ones, see OcclusionSettings
+#if RASTER_STATS
+    RasterStats stats;                       // Triangle and fragment counters, closed by render() every frame
+#endif
 
     // Constructor initializes the canvas, Z-buffer, and perspective projection matrix.
-    Renderer() {
-        canvas.create(1024, 768, "Raster");  // Create a canvas with specified dimensions and title
-        zbuffer.create(1024, 768);           // Initialize the Z-buffer with the same dimensions
+    // Input Variables:
+    // - width, height: Size of the canvas in pixels, 4:3 to match the projection
+    Renderer(unsigned int width = 1024, unsigned int height = 768) {
+        canvas.create(width, height, "Raster");  // Create a canvas with specified dimensions and title
+        zbuffer.create(width, height);           // Initialize the Z-buffer with the same dimensions
         perspective = matrix::makePerspective(fov, aspect, n, f); // Set up the perspective matrix
+        RASTER_STAT(stats.create(width, height));
+    }
+
+    // Turns 4x multisample anti-aliasing on or off. The sample buffer is allocated on first use.
+    // Input Variables:
+    // - enable: True to rasterize with 4 coverage samples per pixel
+    void setMsaa(bool enable) {
+        msaa = enable;
+        if (msaa && samples.getWidth() != canvas.getWidth()) {
+            samples.create(canvas.getWidth(), canvas.getHeight());
+        }
     }
 
     // Clears the canvas and resets the Z-buffer.
     void clear() {
+        RASTER_STAT(stats.clear());
+        if (msaa) {
+            samples.clear(); // The resolve overwrites every canvas pixel, so only the samples need clearing
+            return;
+        }
         canvas.clear();  // Clear the canvas (sets all pixels to the background color)
         zbuffer.clear(); // Reset the Z-buffer to the farthest depth
     }
 
     // Presents the current canvas frame to the display.
     void present() {
+        PROFILE_SCOPE("present");
+        if (msaa && !samples.isResolved()) samples.resolve(canvas); // Average the samples into the canvas, unless render() already did
         canvas.present(); // Display the rendered frame
     }
 };
@@ -0,0 +1,62 @@
+// The renderer built a second time, without SIMD, inside namespace scalar. regressionTests()
+// renders every test scene with both and compares the frames, so one run checks that the SIMD
+// and the scalar paths agree (see simd.h).
+// raster.cpp is included whole, so every header keeps a single copy of its code in the namespace.
+// System headers and GamesEngineeringBase are included first, outside it: their include guards
+// then keep them out of the namespace, and the scalar renderer shares their declarations.
+
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <type_traits>
+#include <concepts>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <filesystem>
+#include <new>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <math.h>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "GamesEngineeringBase.h"
+
+#if !defined(RASTER_NO_SIMD)
+#define RASTER_NO_SIMD
+#endif
+#define RASTER_NO_MAIN
+#undef RASTER_TRACK_ALLOCATIONS
+#define RASTER_TRACK_ALLOCATIONS 0  // operator new can only be replaced once, by raster.cpp
+
+namespace scalar {
+#include "raster.cpp"
+}
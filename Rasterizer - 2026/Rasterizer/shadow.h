@@ -0,0 +1,205 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "vec4.h"
+#include "matrix.h"
+#include "zbuffer.h"
+#include "mesh.h"
+#include "arena.h"
+#include "commands.h"
+
+// Shadow map for a directional light.
+// The scene is rendered depth-only from the light with an orthographic projection. With more than
+// one cascade the camera frustum is split along the view distance and each slice gets its own map,
+// so nearby shadows keep their resolution in large scenes. Memory and fill cost are bounded by
+// size * size * cascades regardless of scene size.
+class ShadowMap {
+public:
+    static constexpr int MaxCascades = 4;
+
+    int size;                 // Width and height of each cascade's depth map in texels
+    int cascades;             // Number of cascades in use, 1 to MaxCascades
+    float shadowDistance;     // View distance covered when cascades > 1, a single cascade covers the whole scene
+    float constantBias;       // Depth bias applied when rendering the maps
+    float slopeBias;          // Slope-scaled depth bias applied when rendering the maps, in texels of depth change
+    int pcfRadius;            // Percentage-closer filter radius in texels, 1 gives a 3x3 kernel
+
+    Zbuffer<float> depth[MaxCascades];      // Depth seen from the light, one map per cascade
+    matrix view[MaxCascades];               // World to light view space per cascade
+    matrix projection[MaxCascades];         // Orthographic projection per cascade
+    matrix toTexels[MaxCascades];           // World to shadow map space per cascade (x, y in texels, z depth)
+    matrixColumns toTexelsColumns[MaxCascades]; // toTexels prepared for the per-pixel lookups
+
+    // Constructor allocates the depth maps
+    // Input Variables:
+    // - _size: Width and height of each map in texels
+    // - _cascades: Number of cascades, clamped to 1..MaxCascades
+    ShadowMap(int _size = 1024, int _cascades = 1) : size(_size), shadowDistance(30.0f), constantBias(0.0005f), slopeBias(2.0f), pcfRadius(1) {
+        cascades = std::clamp(_cascades, 1, MaxCascades);
+        for (int c = 0; c < cascades; c++) {
+            depth[c].create(size, size);
+        }
+    }
+
+    // Fit every cascade's light-space box for this frame
+    // Input Variables:
+    // - lightDir: Direction towards the light (Light::omega_i), need not be normalised
+    // - casters: Draws that cast shadows
+    // - camera: World to view matrix of the main camera
+    // - cameraProjection: Perspective matrix of the main camera, used to size the cascade slices
+    void fit(const vec4& lightDir, const DrawList& casters, const matrix& camera, const matrix& cameraProjection) {
+        vec4 dir = lightDir;
+        dir[3] = 0.f;
+        dir.normalise();
+
+        // Bounding sphere of all casters, so every cascade can place its near plane behind them
+        vec4 sceneCentre(0.f, 0.f, 0.f, 1.f);
+        float sceneRadius = 0.f;
+        getSceneBounds(casters, sceneCentre, sceneRadius);
+
+        if (cascades == 1) {
+            fitCascade(0, dir, sceneCentre, sceneRadius, sceneCentre, sceneRadius);
+            return;
+        }
+
+        // Practical split scheme: blend of logarithmic and uniform distances
+        const float nearDist = 0.1f;
+        const float lambda = 0.75f;
+        float splits[MaxCascades + 1];
+        for (int c = 0; c <= cascades; c++) {
+            float t = static_cast<float>(c) / cascades;
+            float logSplit = nearDist * std::pow(shadowDistance / nearDist, t);
+            float uniSplit = nearDist + (shadowDistance - nearDist) * t;
+            splits[c] = lambda * logSplit + (1.f - lambda) * uniSplit;
+        }
+
+        // Frustum slice corners in view space come from the projection's x and y scales
+        matrix invCamera = camera.invert();
+        float sx = 1.f / cameraProjection(0, 0);
+        float sy = 1.f / cameraProjection(1, 1);
+
+        for (int c = 0; c < cascades; c++) {
+            vec4 corners[8];
+            int k = 0;
+            for (float d : { splits[c], splits[c + 1] }) {
+                for (float x : { -1.f, 1.f }) {
+                    for (float y : { -1.f, 1.f }) {
+                        corners[k++] = vec4(x * d * sx, y * d * sy, -d, 1.f);
+                    }
+                }
+            }
+
+            vec4 centre(0.f, 0.f, 0.f, 1.f);
+            for (const vec4& p : corners) {
+                for (unsigned int i = 0; i < 3; i++) centre[i] += p[i] / 8.f;
+            }
+            float radius = 0.f;
+            for (const vec4& p : corners) {
+                vec4 d = p - centre;
+                radius = std::max(radius, std::sqrt(vec4::dot(d, d)));
+            }
+
+            fitCascade(c, dir, invCamera * centre, radius, sceneCentre, sceneRadius);
+        }
+    }
+
+    // Fraction of light reaching a point, filtered over the PCF kernel
+    // The first cascade whose map contains the point is used; points outside every map are lit.
+    // Input Variables:
+    // - worldPos: Position in world space (w = 1)
+    // Returns a value between 0 (fully shadowed) and 1 (fully lit)
+    float visibility(const vec4& worldPos) const {
+        for (int c = 0; c < cascades; c++) {
+            vec4 p = toTexelsColumns[c] * worldPos;
+            int cx = static_cast<int>(p[0]);
+            int cy = static_cast<int>(p[1]);
+            if (cx < pcfRadius || cy < pcfRadius || cx >= size - pcfRadius || cy >= size - pcfRadius) continue;
+            if (p[2] >= 1.f) return 1.f;
+
+            int lit = 0;
+            for (int y = cy - pcfRadius; y <= cy + pcfRadius; y++) {
+                for (int x = cx - pcfRadius; x <= cx + pcfRadius; x++) {
+                    if (p[2] <= depth[c](x, y)) lit++;
+                }
+            }
+            int taps = (2 * pcfRadius + 1) * (2 * pcfRadius + 1);
+            return static_cast<float>(lit) / taps;
+        }
+        return 1.f;
+    }
+
+private:
+    // Place an orthographic box around a sphere as seen from the light
+    // The box is extended towards the light so casters outside the sphere still land in the map,
+    // and its centre is snapped to whole texels so the shadows do not shimmer as the camera moves.
+    // Input Variables:
+    // - c: Cascade index
+    // - dir: Normalised direction towards the light
+    // - centre, radius: Sphere that must be covered by the map
+    // - sceneCentre, sceneRadius: Bounding sphere of all casters
+    void fitCascade(int c, const vec4& dir, vec4 centre, float radius, const vec4& sceneCentre, float sceneRadius) {
+        radius = std::max(radius, 0.01f);
+        vec4 up = std::fabs(dir[1]) > 0.99f ? vec4(1.f, 0.f, 0.f, 0.f) : vec4(0.f, 1.f, 0.f, 0.f);
+
+        // Snap the centre to the texel grid in the light's plane
+        vec4 right = vec4::cross(up, dir);
+        right.normalise();
+        vec4 lightUp = vec4::cross(dir, right);
+        float texel = 2.f * radius / size;
+        float u = vec4::dot(centre, right);
+        float v = vec4::dot(centre, lightUp);
+        float du = std::floor(u / texel) * texel - u;
+        float dv = std::floor(v / texel) * texel - v;
+        for (unsigned int i = 0; i < 3; i++) {
+            centre[i] += right[i] * du + lightUp[i] * dv;
+        }
+
+        vec4 toScene = sceneCentre - centre;
+        float back = std::max(radius, vec4::dot(toScene, dir) + sceneRadius);
+        vec4 eye(centre[0] + dir[0] * back, centre[1] + dir[1] * back, centre[2] + dir[2] * back, 1.f);
+
+        view[c] = matrix::makeLookAt(eye, centre, up);
+        projection[c] = matrix::makeOrthographic(-radius, radius, -radius, radius, 0.f, back + radius);
+
+        // Same mapping renderDepth applies after projection: NDC to texels with Y flipped
+        matrix viewport;
+        viewport(0, 0) = 0.5f * size; viewport(0, 3) = 0.5f * size;
+        viewport(1, 1) = -0.5f * size; viewport(1, 3) = 0.5f * size;
+        toTexels[c] = viewport * projection[c] * view[c];
+        toTexelsColumns[c] = matrixColumns(toTexels[c]);
+    }
+
+    // Bounding sphere of all draws, taken around the centre of their bounding box
+    // Output Variables:
+    // - centre, radius: Sphere enclosing every draw
+    static void getSceneBounds(const DrawList& scene, vec4& centre, float& radius) {
+        FrameArena& scratch = FrameArena::local();
+        size_t scratchMark = scratch.mark();
+        vec4* centres = scratch.allocate<vec4>(scene.size());
+        float* radii = scratch.allocate<float>(scene.size());
+        vec4 lo(1e30f, 1e30f, 1e30f, 1.f), hi(-1e30f, -1e30f, -1e30f, 1.f);
+        for (size_t m = 0; m < scene.size(); m++) {
+            scene[m].mesh->getWorldBounds(*scene[m].world, centres[m], radii[m]);
+            for (unsigned int i = 0; i < 3; i++) {
+                lo[i] = std::min(lo[i], centres[m][i] - radii[m]);
+                hi[i] = std::max(hi[i], centres[m][i] + radii[m]);
+            }
+        }
+        if (scene.empty()) {
+            centre = vec4(0.f, 0.f, 0.f, 1.f);
+            radius = 1.f;
+            scratch.rewind(scratchMark);
+            return;
+        }
+
+        centre = vec4((lo[0] + hi[0]) * 0.5f, (lo[1] + hi[1]) * 0.5f, (lo[2] + hi[2]) * 0.5f, 1.f);
+        radius = 0.f;
+        for (size_t m = 0; m < scene.size(); m++) {
+            vec4 d = centres[m] - centre;
+            radius = std::max(radius, std::sqrt(vec4::dot(d, d)) + radii[m]);
+        }
+        scratch.rewind(scratchMark);
+    }
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+// SIMD configuration shared by vec4, matrix and colour.
+// SSE2 is part of every x64 target, so the SIMD path is on by default there and needs no extra
+// compiler flags. Define RASTER_NO_SIMD before including any header (or on the command line)
+// to build the portable scalar code instead, e.g. to cross-check results.
+// The SIMD code performs the same operations in the same order as the scalar code, so both
+// produce identical results.
+#if !defined(RASTER_NO_SIMD) && (defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define RASTER_SIMD 1
+#include <immintrin.h>
+#else
+#define RASTER_SIMD 0
+#endif
+
+#if RASTER_SIMD
+// Broadcast one lane of a register to all four lanes
+#define RASTER_SPLAT(v, i) _mm_shuffle_ps((v), (v), _MM_SHUFFLE(i, i, i, i))
+#endif
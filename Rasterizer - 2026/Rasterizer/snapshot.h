@@ -0,0 +1,346 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include "matrix.h"
+#include "mesh.h"
+#include "light.h"
+#include "shadow.h"
+#include "meshfile.h"
+
+// Scene snapshots: a whole scene in one file, so benchmark scenes start instantly and the same
+// way every run. A snapshot holds the camera, the directional light with its shadow map settings,
+// the local lights, and every mesh as a geometry reference, a world transform and a material.
+// Meshes with the same vertices and triangles, such as copies of one cube or instances of one
+// sphere, share a single copy of the geometry. loadSnapshot() maps the file once and points every
+// mesh at its geometry in place: after the header checks, loading is building one Mesh per
+// object and turning file offsets into pointers, with the geometry paged in on first draw.
+//
+// Layout, in the byte order and Vertex layout of the machine that wrote it:
+//     SnapshotHeader
+//     SnapshotGeometry[geometryCount]     at geometryOffset
+//     SnapshotObject[objectCount]         at objectOffset
+//     SnapshotLight[lightCount]           at lightOffset
+//     Vertex and triIndices streams       each at a multiple of MeshFileAlignment
+// A file written by a build whose Vertex or triIndices differ in size is refused, not misread.
+
+static const uint32_t SnapshotVersion = 1;
+
+struct SnapshotHeader {
+    char magic[4];              // "RSCN"
+    uint32_t version;           // SnapshotVersion
+    uint32_t vertexSize;        // sizeof(Vertex) of the writer
+    uint32_t indexSize;         // sizeof(triIndices) of the writer
+    uint64_t geometryCount;
+    uint64_t objectCount;
+    uint64_t lightCount;
+    uint64_t geometryOffset;    // Byte offsets of the tables from the start of the file
+    uint64_t objectOffset;
+    uint64_t lightOffset;
+    uint64_t fileSize;          // Total size, so truncated files are caught before use
+    float camera[16];           // World to view matrix, row-major
+    float lightDirection[4];    // Light::omega_i
+    float lightColour[3];       // Light::L
+    float ambient[3];           // Light::ambient
+    int32_t shadowSize;         // ShadowMap settings of the light, shadowSize 0 when it has none
+    int32_t shadowCascades;
+    float shadowDistance;
+    float shadowConstantBias;
+    float shadowSlopeBias;
+    int32_t shadowPcfRadius;
+};
+
+// Vertices and triangles shared by one or more objects
+struct SnapshotGeometry {
+    uint64_t vertexOffset;      // Byte offset of the vertices, a multiple of MeshFileAlignment
+    uint64_t vertexCount;
+    uint64_t triangleOffset;    // Byte offset of the triangle indices, a multiple of MeshFileAlignment
+    uint64_t triangleCount;
+    float centre[3];            // Bounding sphere in object space
+    float radius;
+};
+
+// One mesh of the scene
+struct SnapshotObject {
+    uint32_t geometry;          // Index into the geometry table
+    uint32_t shadingRate;       // Mesh::shadingRate
+    float world[12];            // Rows 0-2 of the object to world transform
+    float colour[3];            // Mesh::col
+    float ka;
+    float kd;
+};
+
+// One LocalLight
+struct SnapshotLight {
+    float position[4];
+    float colour[3];
+    float range;
+    float direction[4];
+    float cosOuter;
+    float cosInner;
+};
+
+// Scene read back by loadSnapshot(): everything render() takes. The meshes draw their geometry
+// from the mapped file, which stays mapped while any of them is alive. Moving a snapshot keeps
+// the pointers in scene and light valid; copying it would not, so it cannot be copied.
+struct SceneSnapshot {
+    std::vector<Mesh> meshes;               // One mesh per saved object, in saved order
+    std::vector<Mesh*> scene;               // Pointers to meshes, as render() takes them
+    matrix camera;
+    Light light;                            // light.shadowMap points to shadowMap when one was saved
+    std::vector<LocalLight> lights;
+    std::unique_ptr<ShadowMap> shadowMap;
+    std::shared_ptr<MappedFile> file;       // Mapping the meshes draw from, set by loadSnapshot()
+
+    SceneSnapshot() = default;
+    SceneSnapshot(SceneSnapshot&&) = default;
+    SceneSnapshot& operator=(SceneSnapshot&&) = default;
+    SceneSnapshot(const SceneSnapshot&) = delete;
+    SceneSnapshot& operator=(const SceneSnapshot&) = delete;
+};
+
+// Hashes the geometry of a mesh, to find meshes that can share it in a snapshot
+// Input Variables:
+// - mesh: Mesh whose vertices and triangles to hash
+// Returns a 64-bit FNV-1a hash of the vertex and index bytes
+inline uint64_t hashSnapshotGeometry(const Mesh& mesh) {
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](const void* data, size_t bytes) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < bytes; i++) hash = (hash ^ p[i]) * 1099511628211ull;
+    };
+    add(mesh.vertexData(), mesh.vertexCount() * sizeof(Vertex));
+    add(mesh.triangleData(), mesh.triangleCount() * sizeof(triIndices));
+    return hash;
+}
+
+// Tests whether two meshes draw the same vertices and triangles
+inline bool sameSnapshotGeometry(const Mesh& a, const Mesh& b) {
+    if (a.vertexCount() != b.vertexCount() || a.triangleCount() != b.triangleCount()) return false;
+    if (a.vertexData() == b.vertexData() && a.triangleData() == b.triangleData()) return true;
+    return memcmp(a.vertexData(), b.vertexData(), a.vertexCount() * sizeof(Vertex)) == 0
+        && memcmp(a.triangleData(), b.triangleData(), a.triangleCount() * sizeof(triIndices)) == 0;
+}
+
+// Writes a scene as a snapshot
+// Input Variables:
+// - path: File to write
+// - scene: Meshes of the scene; their geometry, transforms and materials are saved
+// - camera: World to view matrix
+// - L: Directional light; of its shadow map only the settings are saved, not the depth
+// - lights: Local lights
+// Returns false when the file could not be written
+inline bool saveSnapshot(const std::string& path, const std::vector<Mesh*>& scene, const matrix& camera, const Light& L, const std::vector<LocalLight>& lights) {
+    // Give every distinct geometry one slot, in order of first use
+    std::vector<const Mesh*> geometrySource;                    // First mesh drawing each geometry
+    std::vector<uint32_t> geometryOf(scene.size());
+    std::unordered_map<uint64_t, std::vector<uint32_t>> byHash; // Geometry slots by hash
+    for (size_t i = 0; i < scene.size(); i++) {
+        const Mesh& mesh = *scene[i];
+        std::vector<uint32_t>& candidates = byHash[hashSnapshotGeometry(mesh)];
+        uint32_t slot = static_cast<uint32_t>(geometrySource.size());
+        for (uint32_t candidate : candidates) {
+            if (sameSnapshotGeometry(*geometrySource[candidate], mesh)) {
+                slot = candidate;
+                break;
+            }
+        }
+        if (slot == geometrySource.size()) {
+            geometrySource.push_back(&mesh);
+            candidates.push_back(slot);
+        }
+        geometryOf[i] = slot;
+    }
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, "RSCN", 4);
+    header.version = SnapshotVersion;
+    header.vertexSize = sizeof(Vertex);
+    header.indexSize = sizeof(triIndices);
+    header.geometryCount = geometrySource.size();
+    header.objectCount = scene.size();
+    header.lightCount = lights.size();
+    header.geometryOffset = alignMeshFileOffset(sizeof(SnapshotHeader));
+    header.objectOffset = alignMeshFileOffset(header.geometryOffset + header.geometryCount * sizeof(SnapshotGeometry));
+    header.lightOffset = alignMeshFileOffset(header.objectOffset + header.objectCount * sizeof(SnapshotObject));
+
+    for (unsigned int row = 0; row < 4; row++)
+        for (unsigned int col = 0; col < 4; col++)
+            header.camera[row * 4 + col] = camera(row, col);
+    colour lightColour = L.L, ambient = L.ambient;
+    for (int c = 0; c < 3; c++) {
+        header.lightColour[c] = lightColour[static_cast<colour::Colour>(c)];
+        header.ambient[c] = ambient[static_cast<colour::Colour>(c)];
+    }
+    for (int i = 0; i < 4; i++) header.lightDirection[i] = L.omega_i[i];
+    if (L.shadowMap) {
+        header.shadowSize = L.shadowMap->size;
+        header.shadowCascades = L.shadowMap->cascades;
+        header.shadowDistance = L.shadowMap->shadowDistance;
+        header.shadowConstantBias = L.shadowMap->constantBias;
+        header.shadowSlopeBias = L.shadowMap->slopeBias;
+        header.shadowPcfRadius = L.shadowMap->pcfRadius;
+    }
+
+    std::vector<SnapshotGeometry> geometry(geometrySource.size());
+    uint64_t offset = header.lightOffset + header.lightCount * sizeof(SnapshotLight);
+    for (size_t g = 0; g < geometry.size(); g++) {
+        const Mesh& mesh = *geometrySource[g];
+        SnapshotGeometry& record = geometry[g];
+        record.vertexCount = mesh.vertexCount();
+        record.triangleCount = mesh.triangleCount();
+        record.vertexOffset = alignMeshFileOffset(offset);
+        record.triangleOffset = alignMeshFileOffset(record.vertexOffset + record.vertexCount * sizeof(Vertex));
+        offset = record.triangleOffset + record.triangleCount * sizeof(triIndices);
+
+        vec4 lo, hi, centre;
+        mesh.getLocalBounds(lo, hi, centre, record.radius);
+        for (int i = 0; i < 3; i++) record.centre[i] = centre[i];
+    }
+    header.fileSize = offset;
+
+    std::vector<SnapshotObject> objects(scene.size());
+    for (size_t i = 0; i < scene.size(); i++) {
+        const Mesh& mesh = *scene[i];
+        SnapshotObject& record = objects[i];
+        record.geometry = geometryOf[i];
+        record.shadingRate = static_cast<uint32_t>(mesh.shadingRate);
+        for (unsigned int row = 0; row < 3; row++)
+            for (unsigned int col = 0; col < 4; col++)
+                record.world[row * 4 + col] = mesh.world(row, col);
+        colour col = mesh.col;
+        for (int c = 0; c < 3; c++) record.colour[c] = col[static_cast<colour::Colour>(c)];
+        record.ka = mesh.ka;
+        record.kd = mesh.kd;
+    }
+
+    std::vector<SnapshotLight> lightRecords(lights.size());
+    for (size_t i = 0; i < lights.size(); i++) {
+        const LocalLight& light = lights[i];
+        SnapshotLight& record = lightRecords[i];
+        colour c = light.L;
+        for (int k = 0; k < 4; k++) {
+            record.position[k] = light.position[k];
+            record.direction[k] = light.direction[k];
+        }
+        for (int k = 0; k < 3; k++) record.colour[k] = c[static_cast<colour::Colour>(k)];
+        record.range = light.range;
+        record.cosOuter = light.cosOuter;
+        record.cosInner = light.cosInner;
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) return false;
+    static const char padding[MeshFileAlignment] = {};
+    uint64_t written = 0;
+    auto write = [&file, &written](const void* data, uint64_t at, uint64_t bytes) {
+        file.write(padding, at - written);
+        file.write(static_cast<const char*>(data), bytes);
+        written = at + bytes;
+    };
+    write(&header, 0, sizeof(header));
+    write(geometry.data(), header.geometryOffset, geometry.size() * sizeof(SnapshotGeometry));
+    write(objects.data(), header.objectOffset, objects.size() * sizeof(SnapshotObject));
+    write(lightRecords.data(), header.lightOffset, lightRecords.size() * sizeof(SnapshotLight));
+    for (size_t g = 0; g < geometry.size(); g++) {
+        const Mesh& mesh = *geometrySource[g];
+        write(mesh.vertexData(), geometry[g].vertexOffset, geometry[g].vertexCount * sizeof(Vertex));
+        write(mesh.triangleData(), geometry[g].triangleOffset, geometry[g].triangleCount * sizeof(triIndices));
+    }
+    return static_cast<bool>(file);
+}
+
+// Maps a snapshot and rebuilds its scene, with every mesh drawing its geometry in place
+// Input Variables:
+// - path: Snapshot written by saveSnapshot()
+// Output Variables:
+// - snapshot: Scene of the file, replacing what it held
+// Returns false, leaving the snapshot unchanged, when the file is missing, truncated, not a
+// snapshot, from another version or written with another vertex layout. Indices are not checked:
+// the file is trusted as written by saveSnapshot().
+inline bool loadSnapshot(const std::string& path, SceneSnapshot& snapshot) {
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(path) || file->size() < sizeof(SnapshotHeader)) return false;
+
+    SnapshotHeader header;
+    memcpy(&header, file->data(), sizeof(header));
+    if (memcmp(header.magic, "RSCN", 4) != 0 || header.version != SnapshotVersion) return false;
+    if (header.vertexSize != sizeof(Vertex) || header.indexSize != sizeof(triIndices) || header.fileSize != file->size()) return false;
+    if (header.geometryOffset % MeshFileAlignment || header.objectOffset % MeshFileAlignment || header.lightOffset % MeshFileAlignment) return false;
+    if (header.geometryOffset + header.geometryCount * sizeof(SnapshotGeometry) > header.objectOffset
+        || header.objectOffset + header.objectCount * sizeof(SnapshotObject) > header.lightOffset
+        || header.lightOffset + header.lightCount * sizeof(SnapshotLight) > header.fileSize) return false;
+
+    // Offsets to pointers, once per geometry; every mesh drawing it copies the result
+    const SnapshotGeometry* geometry = reinterpret_cast<const SnapshotGeometry*>(file->data() + header.geometryOffset);
+    std::vector<MappedMeshData> mapped(static_cast<size_t>(header.geometryCount));
+    for (size_t g = 0; g < mapped.size(); g++) {
+        const SnapshotGeometry& record = geometry[g];
+        if (record.vertexOffset % MeshFileAlignment || record.triangleOffset % MeshFileAlignment
+            || record.vertexOffset + record.vertexCount * sizeof(Vertex) > header.fileSize
+            || record.triangleOffset + record.triangleCount * sizeof(triIndices) > header.fileSize) return false;
+        mapped[g].file = file;
+        mapped[g].vertices = reinterpret_cast<const Vertex*>(file->data() + record.vertexOffset);
+        mapped[g].vertexCount = static_cast<size_t>(record.vertexCount);
+        mapped[g].triangles = reinterpret_cast<const triIndices*>(file->data() + record.triangleOffset);
+        mapped[g].triangleCount = static_cast<size_t>(record.triangleCount);
+        mapped[g].centre = vec4(record.centre[0], record.centre[1], record.centre[2], 1.f);
+        mapped[g].radius = record.radius;
+    }
+
+    const SnapshotObject* objects = reinterpret_cast<const SnapshotObject*>(file->data() + header.objectOffset);
+    std::vector<Mesh> meshes(static_cast<size_t>(header.objectCount));
+    for (size_t i = 0; i < meshes.size(); i++) {
+        const SnapshotObject& record = objects[i];
+        if (record.geometry >= mapped.size() || record.shadingRate > static_cast<uint32_t>(ShadingRate::Auto)) return false;
+        Mesh& mesh = meshes[i];
+        mesh.mapped = mapped[record.geometry];
+        for (unsigned int row = 0; row < 3; row++)
+            for (unsigned int col = 0; col < 4; col++)
+                mesh.world(row, col) = record.world[row * 4 + col];
+        mesh.setColour(colour(record.colour[0], record.colour[1], record.colour[2]), record.ka, record.kd);
+        mesh.shadingRate = static_cast<ShadingRate>(record.shadingRate);
+    }
+
+    const SnapshotLight* lightRecords = reinterpret_cast<const SnapshotLight*>(file->data() + header.lightOffset);
+    std::vector<LocalLight> lights(static_cast<size_t>(header.lightCount));
+    for (size_t i = 0; i < lights.size(); i++) {
+        const SnapshotLight& record = lightRecords[i];
+        LocalLight& light = lights[i];
+        light.position = vec4(record.position[0], record.position[1], record.position[2], record.position[3]);
+        light.L = colour(record.colour[0], record.colour[1], record.colour[2]);
+        light.range = record.range;
+        light.direction = vec4(record.direction[0], record.direction[1], record.direction[2], record.direction[3]);
+        light.cosOuter = record.cosOuter;
+        light.cosInner = record.cosInner;
+    }
+
+    std::unique_ptr<ShadowMap> shadowMap;
+    if (header.shadowSize > 0) {
+        shadowMap = std::make_unique<ShadowMap>(header.shadowSize, header.shadowCascades);
+        shadowMap->shadowDistance = header.shadowDistance;
+        shadowMap->constantBias = header.shadowConstantBias;
+        shadowMap->slopeBias = header.shadowSlopeBias;
+        shadowMap->pcfRadius = header.shadowPcfRadius;
+    }
+
+    snapshot.meshes = std::move(meshes);
+    snapshot.scene.clear();
+    for (Mesh& mesh : snapshot.meshes) snapshot.scene.push_back(&mesh);
+    for (unsigned int row = 0; row < 4; row++)
+        for (unsigned int col = 0; col < 4; col++)
+            snapshot.camera(row, col) = header.camera[row * 4 + col];
+    snapshot.light.omega_i = vec4(header.lightDirection[0], header.lightDirection[1], header.lightDirection[2], header.lightDirection[3]);
+    snapshot.light.L = colour(header.lightColour[0], header.lightColour[1], header.lightColour[2]);
+    snapshot.light.ambient = colour(header.ambient[0], header.ambient[1], header.ambient[2]);
+    snapshot.shadowMap = std::move(shadowMap);
+    snapshot.light.shadowMap = snapshot.shadowMap.get();
+    snapshot.lights = std::move(lights);
+    snapshot.file = std::move(file);
+    return true;
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+
+// Counters of the work the rasterizer does: how many triangles each stage dropped, how many strips
+// the survivors were binned into and how many fragments passed or failed the depth test, per frame
+// and per screen tile. Debug builds collect them; define RASTER_STATS=0 to leave them out, or =1
+// to collect them in release builds. Renderer::stats holds them and render() closes every frame.
+#if !defined(RASTER_STATS)
+#if defined(_DEBUG)
+#define RASTER_STATS 1
+#else
+#define RASTER_STATS 0
+#endif
+#endif
+
+#if RASTER_STATS
+#define RASTER_STAT(statement) statement
+#else
+#define RASTER_STAT(statement) ((void)0)
+#endif
+
+// Totals of one frame
+struct FrameStats {
+    uint64_t draws = 0;             // Draws of the main pass
+    uint64_t frustumCulled = 0;     // Draws skipped before transform for lying outside the view
+    uint64_t occlusionCulled = 0;   // Draws skipped before transform for lying behind the occluders
+    uint64_t triangles = 0;         // Triangles of the draws of the main pass that were not culled
+    uint64_t backFacing = 0;        // Dropped by the back-face test
+    uint64_t tiny = 0;              // Binned but skipped by the rasterizer for covering under a pixel of area
+    uint64_t binEntries = 0;        // Bin entries of the triangles that were binned, one per strip overlapped
+    uint64_t multiStrip = 0;        // Triangles binned into more than one strip
+    uint64_t fragments = 0;         // Covered pixels that reached the depth test
+    uint64_t depthRejects = 0;      // Fragments that failed it
+    uint64_t pixels = 0;            // Pixels of the target
+
+    uint64_t binned() const { return triangles - backFacing; }
+    uint64_t written() const { return fragments - depthRejects; }
+    // Average strips each binned triangle lands in; growth means triangles got tall or strips short
+    float binsPerTriangle() const { return binned() ? static_cast<float>(binEntries) / binned() : 0.f; }
+    // Average writes per pixel
+    float overdraw() const { return pixels ? static_cast<float>(written()) / pixels : 0.f; }
+};
+
+// Fragment counts of one square of the target
+struct TileStats {
+    unsigned int fragments;
+    unsigned int depthRejects;
+};
+
+class RasterStats {
+public:
+    static const int TileSize = 16;     // Pixels per side of a tile
+
+    // What a heatmap shows per pixel
+    enum class Heatmap {
+        Overdraw,       // Fragments written
+        Fragments,      // Fragments depth tested, a measure of rasterization cost
+        DepthRejects    // Fragments that failed the depth test
+    };
+
+private:
+    int width = 0, height = 0;
+    int tilesX = 0, tilesY = 0;
+    // Per-pixel counts. Strips own whole rows, so every pixel has one writer and needs no atomics.
+    std::vector<uint16_t> tested;
+    std::vector<uint16_t> rejected;
+    std::vector<TileStats> tiles;
+    std::atomic<uint64_t> triangles{ 0 }, backFacing{ 0 }, tiny{ 0 }, binEntries{ 0 }, multiStrip{ 0 };
+    uint64_t draws = 0, frustumCulled = 0, occlusionCulled = 0;   // Written by the main thread only
+    FrameStats last;
+
+public:
+    // Sizes the counters to the target
+    // Input Variables:
+    // - w, h: Size of the target in pixels
+    void create(int w, int h) {
+        width = w;
+        height = h;
+        tilesX = (w + TileSize - 1) / TileSize;
+        tilesY = (h + TileSize - 1) / TileSize;
+        tested.assign(static_cast<size_t>(w) * h, 0);
+        rejected.assign(static_cast<size_t>(w) * h, 0);
+        tiles.assign(static_cast<size_t>(tilesX) * tilesY, { 0, 0 });
+    }
+
+    // Starts a frame; called by Renderer::clear()
+    void clear() {
+        std::fill(tested.begin(), tested.end(), uint16_t(0));
+        std::fill(rejected.begin(), rejected.end(), uint16_t(0));
+        triangles.store(0, std::memory_order_relaxed);
+        backFacing.store(0, std::memory_order_relaxed);
+        tiny.store(0, std::memory_order_relaxed);
+        binEntries.store(0, std::memory_order_relaxed);
+        multiStrip.store(0, std::memory_order_relaxed);
+        draws = frustumCulled = occlusionCulled = 0;
+    }
+
+    // Adds the draw counts of the main pass; called by render() on the main thread
+    // Input Variables:
+    // - total: Draws recorded
+    // - culled: Draws found outside the view
+    // - occluded: Draws found behind the occluders
+    void addDraws(uint64_t total, uint64_t culled, uint64_t occluded) {
+        draws += total;
+        frustumCulled += culled;
+        occlusionCulled += occluded;
+    }
+
+    // Adds the triangle counts of one draw; called once per draw by any thread
+    void addTriangles(const FrameStats& draw) {
+        triangles.fetch_add(draw.triangles, std::memory_order_relaxed);
+        backFacing.fetch_add(draw.backFacing, std::memory_order_relaxed);
+        tiny.fetch_add(draw.tiny, std::memory_order_relaxed);
+        binEntries.fetch_add(draw.binEntries, std::memory_order_relaxed);
+        multiStrip.fetch_add(draw.multiStrip, std::memory_order_relaxed);
+    }
+
+    // Counts a fragment at the depth test; called by the thread drawing the pixel's strip
+    // Input Variables:
+    // - x, y: Pixel
+    // - passed: Whether the depth test passed
+    void fragment(int x, int y, bool passed) {
+        size_t i = static_cast<size_t>(y) * width + x;
+        tested[i]++;
+        if (!passed) rejected[i]++;
+    }
+
+    // Sums the frame's counters into frameStats() and tile(); called by render() once every pass
+    // has finished. With Renderer::pipelineFrames the triangle counts are those of the frame just
+    // set up and the fragment counts those of the frame just drawn.
+    void endFrame() {
+        FrameStats frame;
+        frame.draws = draws;
+        frame.frustumCulled = frustumCulled;
+        frame.occlusionCulled = occlusionCulled;
+        frame.triangles = triangles.load(std::memory_order_relaxed);
+        frame.backFacing = backFacing.load(std::memory_order_relaxed);
+        frame.tiny = tiny.load(std::memory_order_relaxed);
+        frame.binEntries = binEntries.load(std::memory_order_relaxed);
+        frame.multiStrip = multiStrip.load(std::memory_order_relaxed);
+        frame.pixels = static_cast<uint64_t>(width) * height;
+
+        std::fill(tiles.begin(), tiles.end(), TileStats{ 0, 0 });
+        for (int y = 0; y < height; y++) {
+            TileStats* row = &tiles[static_cast<size_t>(y / TileSize) * tilesX];
+            for (int x = 0; x < width; x++) {
+                size_t i = static_cast<size_t>(y) * width + x;
+                row[x / TileSize].fragments += tested[i];
+                row[x / TileSize].depthRejects += rejected[i];
+                frame.fragments += tested[i];
+                frame.depthRejects += rejected[i];
+            }
+        }
+        last = frame;
+    }
+
+    // Totals of the last finished frame
+    const FrameStats& frameStats() const { return last; }
+
+    int getTilesX() const { return tilesX; }
+    int getTilesY() const { return tilesY; }
+    // Fragment counts of a tile in the last finished frame
+    const TileStats& tile(int tx, int ty) const { return tiles[static_cast<size_t>(ty) * tilesX + tx]; }
+
+    // Saves a per-pixel heatmap of the last frame as a binary PPM: black for none, then blue,
+    // green, yellow and red as the count rises, white at the top of the scale
+    // Input Variables:
+    // - path: File to write
+    // - kind: Count to show
+    // - scale: Count shown as white
+    // Returns false when the file could not be written
+    bool writeHeatmap(const char* path, Heatmap kind = Heatmap::Overdraw, int scale = 8) const {
+        std::ofstream file(path, std::ios::binary);
+        if (!file) return false;
+        file << "P6\n" << width << " " << height << "\n255\n";
+
+        // Colour ramp, stops at equal steps of the scale
+        static const unsigned char ramp[][3] = { {0, 0, 0}, {0, 0, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}, {255, 255, 255} };
+        const int stops = sizeof(ramp) / sizeof(ramp[0]) - 1;
+        std::vector<unsigned char> row(static_cast<size_t>(width) * 3);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t i = static_cast<size_t>(y) * width + x;
+                int count = kind == Heatmap::Overdraw ? tested[i] - rejected[i] : kind == Heatmap::Fragments ? tested[i] : rejected[i];
+                float t = std::min(static_cast<float>(count) / std::max(scale, 1), 1.f) * stops;
+                int s = std::min(static_cast<int>(t), stops - 1);
+                float f = t - s;
+                for (int c = 0; c < 3; c++) {
+                    row[x * 3 + c] = static_cast<unsigned char>(ramp[s][c] + (ramp[s + 1][c] - ramp[s][c]) * f);
+                }
+            }
+            file.write(reinterpret_cast<const char*>(row.data()), row.size());
+        }
+        return static_cast<bool>(file);
+    }
+};
@@ -0,0 +1,428 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+#include <filesystem>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include "mesh.h"
+#include "snapshot.h"
+
+// Out-of-core scenes. buildStreamingWorld() cuts a scene into square chunks on the ground (x, z)
+// plane and writes every chunk as a snapshot file, plus an index of the chunks' bounds, sizes and
+// average colours. StreamingWorld keeps only the index in memory. Each frame update() looks at
+// where the camera is and where it is heading, and hands the chunks in reach, nearest first, to a
+// background I/O thread, which maps them and touches every page so they are in memory before
+// they are drawn. gather() then lists the meshes of the resident chunks in view and a box in the
+// chunk's average colour for every chunk still on its way, so a frame never waits for the disk.
+// Loads are only queued while the resident chunks, plus those on their way, fit in the memory
+// budget; the least recently drawn chunks that no longer fit are dropped.
+
+static const uint32_t WorldIndexVersion = 1;
+
+struct WorldIndexHeader {
+    char magic[4];              // "RWLD"
+    uint32_t version;           // WorldIndexVersion
+    uint64_t chunkCount;
+    float chunkSize;            // Side of a chunk's cell on the x, z plane
+    float overhang;             // Largest distance any chunk's bounds reach beyond its cell
+};
+
+// One chunk in the index, followed in the file by the next
+struct WorldChunkRecord {
+    int32_t x, z;               // Cell of the chunk, covering [x, x + 1) * chunkSize and likewise for z
+    float boundsMin[3];         // World-space bounding box of the chunk's meshes
+    float boundsMax[3];
+    float colour[3];            // Average colour of the meshes, for the proxy box
+    uint32_t objectCount;
+    uint64_t fileSize;          // Bytes of the chunk's snapshot, counted against the memory budget
+};
+
+// Name of the snapshot of a chunk
+inline std::string worldChunkPath(const std::string& directory, int x, int z) {
+    return directory + "/chunk_" + std::to_string(x) + "_" + std::to_string(z) + ".rscn";
+}
+
+// Name of the index of a world
+inline std::string worldIndexPath(const std::string& directory) {
+    return directory + "/world.rwld";
+}
+
+// Writes a scene as a streaming world: one snapshot per chunk and an index
+// Input Variables:
+// - scene: Meshes of the scene; each goes to the chunk holding the centre of its bounds
+// - chunkSize: Side of a chunk on the x, z plane
+// - directory: Directory for the files, created if missing
+// Returns false when a file could not be written
+inline bool buildStreamingWorld(const std::vector<Mesh*>& scene, float chunkSize, const std::string& directory) {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    struct Cell {
+        int x, z;
+        std::vector<Mesh*> meshes;
+        vec4 lo, hi;
+        float colour[3] = {};
+    };
+    std::vector<Cell> cells;
+    std::unordered_map<int64_t, size_t> cellOf;     // Index into cells by packed cell coordinates
+
+    for (Mesh* mesh : scene) {
+        vec4 centre;
+        float radius;
+        mesh->getWorldBounds(centre, radius);
+        int x = static_cast<int>(std::floor(centre[0] / chunkSize));
+        int z = static_cast<int>(std::floor(centre[2] / chunkSize));
+        int64_t key = (static_cast<int64_t>(x) << 32) ^ static_cast<uint32_t>(z);
+        auto found = cellOf.find(key);
+        if (found == cellOf.end()) {
+            found = cellOf.emplace(key, cells.size()).first;
+            cells.push_back({ x, z, {}, vec4(centre[0] - radius, centre[1] - radius, centre[2] - radius), vec4(centre[0] + radius, centre[1] + radius, centre[2] + radius) });
+        }
+        Cell& cell = cells[found->second];
+        cell.meshes.push_back(mesh);
+        for (unsigned int i = 0; i < 3; i++) {
+            cell.lo[i] = std::min(cell.lo[i], centre[i] - radius);
+            cell.hi[i] = std::max(cell.hi[i], centre[i] + radius);
+        }
+        colour col = mesh->col;
+        for (int c = 0; c < 3; c++) cell.colour[c] += col[static_cast<colour::Colour>(c)];
+    }
+
+    WorldIndexHeader header = {};
+    memcpy(header.magic, "RWLD", 4);
+    header.version = WorldIndexVersion;
+    header.chunkCount = cells.size();
+    header.chunkSize = chunkSize;
+
+    std::vector<WorldChunkRecord> records(cells.size());
+    matrix camera;
+    Light light{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+    for (size_t i = 0; i < cells.size(); i++) {
+        const Cell& cell = cells[i];
+        WorldChunkRecord& record = records[i];
+        std::string path = worldChunkPath(directory, cell.x, cell.z);
+        if (!saveSnapshot(path, cell.meshes, camera, light, {})) return false;
+
+        record.x = cell.x;
+        record.z = cell.z;
+        for (int c = 0; c < 3; c++) {
+            record.boundsMin[c] = cell.lo[c];
+            record.boundsMax[c] = cell.hi[c];
+            record.colour[c] = cell.colour[c] / static_cast<float>(cell.meshes.size());
+        }
+        record.objectCount = static_cast<uint32_t>(cell.meshes.size());
+        record.fileSize = std::filesystem::file_size(path, error);
+
+        float x0 = cell.x * chunkSize, z0 = cell.z * chunkSize;
+        header.overhang = std::max({ header.overhang, x0 - cell.lo[0], cell.hi[0] - (x0 + chunkSize), z0 - cell.lo[2], cell.hi[2] - (z0 + chunkSize) });
+    }
+
+    std::ofstream file(worldIndexPath(directory), std::ios::binary);
+    if (!file) return false;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(WorldChunkRecord));
+    return static_cast<bool>(file);
+}
+
+struct StreamingOptions {
+    size_t memoryBudget = size_t(512) << 20;    // Bytes of chunk files kept resident
+    float drawDistance = 100.f;                 // Chunks closer than this to the camera are drawn
+    float prefetchDistance = 140.f;             // Chunks closer than this to the camera, now or soon, are loaded
+    float lookahead = 1.f;                      // Seconds of camera motion to prefetch ahead for
+    float teleportDistance = 50.f;              // Camera moves longer than this in one update are cuts, not predicted from
+};
+
+// World streamed from the files of buildStreamingWorld(). update() and gather() are called from
+// the main thread; loading runs on a thread of its own.
+class StreamingWorld {
+    enum class ChunkState { Absent, Queued, Resident, Failed };
+
+    struct Chunk {
+        WorldChunkRecord record;
+        ChunkState state = ChunkState::Absent;      // Queued includes the chunk being loaded
+        std::unique_ptr<SceneSnapshot> data;        // Meshes, while resident
+        std::unique_ptr<Mesh> proxy;                // Box drawn until the chunk is resident, made on first use
+        uint64_t lastUsed = 0;                      // Last frame the chunk was drawn or wanted within the budget
+        uint64_t lastWanted = 0;                    // Last frame the chunk was in reach
+    };
+
+    StreamingOptions options;
+    std::string directory;
+    float chunkSize = 1.f;
+    float overhang = 0.f;
+    std::vector<Chunk> chunks;
+    std::unordered_map<int64_t, int> chunkOf;       // Index into chunks by packed cell coordinates
+
+    // Main thread only
+    uint64_t frame = 0;
+    vec4 eye, predicted;                            // Camera position now and after options.lookahead seconds
+    bool hasEye = false;
+    size_t residentBytes = 0;
+    size_t queuedBytes = 0;                         // Bytes of the Queued chunks, loading or loaded but not taken in
+    std::vector<std::pair<float, int>> wanted;      // Chunks to have resident this frame by distance
+    std::vector<std::pair<uint64_t, std::unique_ptr<SceneSnapshot>>> retired;   // Evicted chunks and the frame they were evicted
+
+    // Shared with the I/O thread, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<int> requests;                      // Chunks to load, the nearest last
+    std::vector<std::pair<int, std::unique_ptr<SceneSnapshot>>> loaded;    // Finished loads, null when one failed
+    bool stopping = false;
+    std::thread io;
+
+    static int64_t cellKey(int x, int z) {
+        return (static_cast<int64_t>(x) << 32) ^ static_cast<uint32_t>(z);
+    }
+
+    // Distance from a point to the bounding box of a chunk, 0 inside it
+    static float distanceTo(const WorldChunkRecord& record, const vec4& p) {
+        float d2 = 0.f;
+        for (int i = 0; i < 3; i++) {
+            float d = std::max({ record.boundsMin[i] - p[i], 0.f, p[i] - record.boundsMax[i] });
+            d2 += d * d;
+        }
+        return std::sqrt(d2);
+    }
+
+    // Calls f(index) for every chunk whose cell lies within a distance of a point on the x, z plane
+    template <typename F>
+    void forChunksNear(const vec4& p, float distance, F&& f) const {
+        float reach = distance + overhang;
+        int x0 = static_cast<int>(std::floor((p[0] - reach) / chunkSize)), x1 = static_cast<int>(std::floor((p[0] + reach) / chunkSize));
+        int z0 = static_cast<int>(std::floor((p[2] - reach) / chunkSize)), z1 = static_cast<int>(std::floor((p[2] + reach) / chunkSize));
+        for (int z = z0; z <= z1; z++) {
+            for (int x = x0; x <= x1; x++) {
+                auto found = chunkOf.find(cellKey(x, z));
+                if (found != chunkOf.end()) f(found->second);
+            }
+        }
+    }
+
+    // Body of the I/O thread: loads requested chunks, nearest first, until stopped
+    void ioLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !requests.empty(); });
+            if (stopping) return;
+            int index = requests.back();
+            requests.pop_back();
+            lock.unlock();
+
+            const WorldChunkRecord& record = chunks[index].record;
+            std::unique_ptr<SceneSnapshot> data = std::make_unique<SceneSnapshot>();
+            if (loadSnapshot(worldChunkPath(directory, record.x, record.z), *data)) {
+                // Fault every page in now, so drawing the chunk never waits for the disk
+                const MappedFile& file = *data->file;
+                volatile unsigned char sink = 0;
+                for (size_t offset = 0; offset < file.size(); offset += 4096) sink = sink + file.data()[offset];
+            }
+            else {
+                data.reset();
+            }
+
+            lock.lock();
+            loaded.emplace_back(index, std::move(data));
+        }
+    }
+
+    // Drops a resident chunk; its meshes live on until frames that may still draw them are done
+    void evict(Chunk& chunk) {
+        retired.emplace_back(frame, std::move(chunk.data));
+        chunk.state = ChunkState::Absent;
+        residentBytes -= static_cast<size_t>(chunk.record.fileSize);
+    }
+
+public:
+    StreamingWorld() = default;
+    StreamingWorld(const StreamingWorld&) = delete;
+    StreamingWorld& operator=(const StreamingWorld&) = delete;
+
+    ~StreamingWorld() {
+        close();
+    }
+
+    // Reads the index of a world and starts the I/O thread; no chunk is loaded yet
+    // Input Variables:
+    // - _directory: Directory written by buildStreamingWorld()
+    // - _options: Budget and distances
+    // Returns false when the index is missing or not a world index
+    bool open(const std::string& _directory, const StreamingOptions& _options = StreamingOptions()) {
+        close();
+        std::ifstream file(worldIndexPath(_directory), std::ios::binary);
+        WorldIndexHeader header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+        if (memcmp(header.magic, "RWLD", 4) != 0 || header.version != WorldIndexVersion || header.chunkSize <= 0.f) return false;
+        std::vector<WorldChunkRecord> records(static_cast<size_t>(header.chunkCount));
+        if (!file.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(WorldChunkRecord))) return false;
+
+        directory = _directory;
+        options = _options;
+        chunkSize = header.chunkSize;
+        overhang = header.overhang;
+        chunks = std::vector<Chunk>(records.size());
+        for (size_t i = 0; i < records.size(); i++) {
+            chunks[i].record = records[i];
+            chunkOf[cellKey(records[i].x, records[i].z)] = static_cast<int>(i);
+        }
+
+        stopping = false;
+        io = std::thread([this] { ioLoop(); });
+        return true;
+    }
+
+    // Stops the I/O thread and drops every chunk. Call only once no frame draws the world any more.
+    void close() {
+        if (io.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            io.join();
+        }
+        requests.clear();
+        loaded.clear();
+        retired.clear();
+        chunks.clear();
+        chunkOf.clear();
+        residentBytes = 0;
+        queuedBytes = 0;
+        hasEye = false;
+    }
+
+    // Takes in finished loads, drops chunks over the budget and queues the loads the camera will
+    // need next. Never waits for the I/O thread beyond a short lock. A load counts against the
+    // budget from when it is queued, and a load already started cannot be called back.
+    // Input Variables:
+    // - position: Camera position in world space
+    // - dt: Seconds since the last update, to estimate the camera velocity
+    void update(const vec4& position, float dt) {
+        frame++;
+        predicted = position;
+        vec4 moved = position - eye;
+        bool cut = vec4::dot(moved, moved) > options.teleportDistance * options.teleportDistance;
+        if (hasEye && dt > 0.f && !cut) {
+            for (unsigned int i = 0; i < 3; i++) predicted[i] = position[i] + moved[i] / dt * options.lookahead;
+        }
+        eye = position;
+        hasEye = true;
+
+        // Meshes evicted two frames ago are no longer drawn, even by a pipelined frame
+        retired.erase(std::remove_if(retired.begin(), retired.end(), [this](const auto& r) { return r.first + 2 <= frame; }), retired.end());
+
+        // Chunks in reach now or at the predicted position, nearest first
+        wanted.clear();
+        auto want = [this](int index) {
+            Chunk& chunk = chunks[index];
+            float distance = std::min(distanceTo(chunk.record, eye), distanceTo(chunk.record, predicted));
+            if (distance >= options.prefetchDistance || chunk.lastWanted == frame) return;
+            chunk.lastWanted = frame;
+            wanted.emplace_back(distance, index);
+        };
+        forChunksNear(eye, options.prefetchDistance, want);
+        forChunksNear(predicted, options.prefetchDistance, want);
+        std::sort(wanted.begin(), wanted.end());
+
+        std::vector<std::pair<int, std::unique_ptr<SceneSnapshot>>> arrived;
+        bool queued;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            arrived.swap(loaded);
+
+            // Forget the loads not yet started; the one in progress stays Queued until it arrives
+            for (int index : requests) {
+                chunks[index].state = ChunkState::Absent;
+                queuedBytes -= static_cast<size_t>(chunks[index].record.fileSize);
+            }
+            requests.clear();
+
+            // Keep and queue what fits in the budget next to the loads still Queued, nearest first.
+            // Resident chunks left out are not marked used, so they are the ones evicted below
+            // when the loads arrive.
+            size_t bytes = queuedBytes;
+            for (const std::pair<float, int>& w : wanted) {
+                Chunk& chunk = chunks[w.second];
+                if (chunk.state != ChunkState::Queued) {
+                    size_t size = static_cast<size_t>(chunk.record.fileSize);
+                    if (bytes + size > options.memoryBudget) break;
+                    bytes += size;
+                }
+                chunk.lastUsed = frame;
+                if (chunk.state == ChunkState::Absent) {
+                    chunk.state = ChunkState::Queued;
+                    queuedBytes += static_cast<size_t>(chunk.record.fileSize);
+                    requests.push_back(w.second);
+                }
+            }
+            std::reverse(requests.begin(), requests.end());
+            queued = !requests.empty();
+        }
+        if (queued) wake.notify_one();
+
+        for (std::pair<int, std::unique_ptr<SceneSnapshot>>& a : arrived) {
+            Chunk& chunk = chunks[a.first];
+            queuedBytes -= static_cast<size_t>(chunk.record.fileSize);
+            if (!a.second) {
+                chunk.state = ChunkState::Failed;
+                continue;
+            }
+            chunk.data = std::move(a.second);
+            chunk.state = ChunkState::Resident;
+            chunk.lastUsed = std::max(chunk.lastUsed, frame - 1);
+            residentBytes += static_cast<size_t>(chunk.record.fileSize);
+        }
+
+        // Least recently used first, never a chunk wanted this frame
+        while (residentBytes > options.memoryBudget) {
+            Chunk* oldest = nullptr;
+            for (Chunk& chunk : chunks) {
+                if (chunk.state == ChunkState::Resident && chunk.lastUsed < frame && (!oldest || chunk.lastUsed < oldest->lastUsed)) oldest = &chunk;
+            }
+            if (!oldest) break;
+            evict(*oldest);
+        }
+    }
+
+    // Appends what to draw this frame: the meshes of resident chunks within the draw distance,
+    // and a proxy box for the chunks there that are not resident
+    // Output Variables:
+    // - scene: Meshes to draw, valid until the update() after next
+    void gather(std::vector<Mesh*>& scene) {
+        if (!hasEye) return;
+        forChunksNear(eye, options.drawDistance, [this, &scene](int index) {
+            Chunk& chunk = chunks[index];
+            if (distanceTo(chunk.record, eye) >= options.drawDistance) return;
+            chunk.lastUsed = frame;
+            if (chunk.state == ChunkState::Resident) {
+                for (Mesh* mesh : chunk.data->scene) scene.push_back(mesh);
+                return;
+            }
+            if (!chunk.proxy) {
+                const WorldChunkRecord& r = chunk.record;
+                chunk.proxy = std::make_unique<Mesh>(Mesh::makeCube(1.f));
+                vec4 centre((r.boundsMin[0] + r.boundsMax[0]) * 0.5f, (r.boundsMin[1] + r.boundsMax[1]) * 0.5f, (r.boundsMin[2] + r.boundsMax[2]) * 0.5f);
+                vec4 size(r.boundsMax[0] - r.boundsMin[0], r.boundsMax[1] - r.boundsMin[1], r.boundsMax[2] - r.boundsMin[2]);
+                chunk.proxy->world = affine::makeTRS(centre, quaternion(), size);
+                chunk.proxy->col = colour(r.colour[0], r.colour[1], r.colour[2]);
+            }
+            scene.push_back(chunk.proxy.get());
+        });
+    }
+
+    size_t getChunkCount() const { return chunks.size(); }
+    size_t getResidentBytes() const { return residentBytes; }
+
+    // Number of chunks resident in memory
+    size_t getResidentCount() const {
+        return std::count_if(chunks.begin(), chunks.end(), [](const Chunk& chunk) { return chunk.state == ChunkState::Resident; });
+    }
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+// Split of a render target into horizontal strips, the unit of work of the raster stages.
+// A uniform split leaves threads idle when the expensive pixels gather in a few strips, so
+// after each frame rebalance() moves the boundaries using the time every strip took: the
+// measured cost is spread evenly over the strip's rows, smoothed against earlier frames, and
+// the new boundaries give every strip about the same share of the total.
+class StripLayout {
+public:
+    static constexpr int MaxStrips = 256;
+
+private:
+    int height = 0;
+    int count = 0;
+    int start[MaxStrips + 1] = {};      // First row of each strip; start[count] == height
+    float cost[MaxStrips] = {};         // Seconds each strip took in the last measured pass
+    std::vector<int> rowStrip;          // Strip of every row
+    std::vector<float> rowCost;         // Smoothed cost of every row
+
+public:
+    // Resets to equal strips
+    // Input Variables:
+    // - h: Height of the target in rows
+    // - strips: Number of strips, clamped to [1, min(h, MaxStrips)]
+    void uniform(int h, int strips) {
+        height = std::max(h, 1);
+        count = std::clamp(strips, 1, std::min(height, MaxStrips));
+        int rows = height / count;
+        for (int s = 0; s < count; s++) start[s] = s * rows;
+        start[count] = height;
+        rowStrip.resize(height);
+        rowCost.assign(height, 0.f);
+        std::fill(cost, cost + MaxStrips, 0.f);
+        updateRows();
+    }
+
+    // True when the layout was made by uniform() with the same arguments, possibly rebalanced since
+    bool fits(int h, int strips) const {
+        int rows = std::max(h, 1);
+        return height == rows && count == std::clamp(strips, 1, std::min(rows, MaxStrips));
+    }
+
+    int getCount() const { return count; }
+    int getHeight() const { return height; }
+    int first(int s) const { return start[s]; }     // First row of strip s
+    int end(int s) const { return start[s + 1]; }   // One past the last row of strip s
+
+    // Strip containing a row; rows outside the target map to the first or last strip
+    // Input Variables:
+    // - y: Row, may be fractional
+    int stripOf(float y) const {
+        int row = std::clamp(static_cast<int>(y), 0, height - 1);
+        return rowStrip[row];
+    }
+
+    // Record the time one strip took this frame; strips may be timed from different threads
+    // Input Variables:
+    // - s: Strip index
+    // - seconds: Time spent on the strip
+    void record(int s, float seconds) { cost[s] = seconds; }
+
+    // Moves the boundaries so every strip gets an equal share of the recorded cost
+    void rebalance() { rebalance(*this); }
+
+    // Moves the boundaries using the cost recorded in another layout of the same target, e.g. a
+    // copy an earlier frame was binned with while this one has moved on
+    // Input Variables:
+    // - measured: Layout whose strips were timed with record()
+    void rebalance(const StripLayout& measured) {
+        if (measured.height != height) return;
+        float total = 0.f;
+        for (int s = 0; s < measured.count; s++) {
+            float perRow = measured.cost[s] / std::max(measured.end(s) - measured.first(s), 1);
+            for (int y = measured.first(s); y < measured.end(s); y++) {
+                // Half the weight on this frame keeps the split from oscillating
+                rowCost[y] = rowCost[y] > 0.f ? 0.5f * (rowCost[y] + perRow) : perRow;
+                total += rowCost[y];
+            }
+        }
+        if (total <= 0.f) return;
+
+        // Walk the rows and close a strip whenever its share is reached, keeping at least
+        // one row for each strip that is still to come
+        float share = total / count;
+        float sum = 0.f;
+        int s = 1;
+        for (int y = 0; y < height && s < count; y++) {
+            sum += rowCost[y];
+            int rowsLeft = height - (y + 1);
+            if ((sum >= share * s && y + 1 > start[s - 1]) || rowsLeft == count - s) {
+                start[s++] = y + 1;
+            }
+        }
+        start[count] = height;
+        updateRows();
+    }
+
+private:
+    void updateRows() {
+        for (int s = 0; s < count; s++) {
+            for (int y = start[s]; y < start[s + 1]; y++) rowStrip[y] = s;
+        }
+    }
+};
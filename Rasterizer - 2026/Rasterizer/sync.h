@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include "simd.h"
+
+// Lock-free waiting for the job system.
+// A waiter first spins on the atomic for a bounded number of iterations, which covers the
+// common case of work finishing or arriving within a few microseconds without any system call.
+// Only then does it park with std::atomic::wait (a futex on Linux, WaitOnAddress on Windows).
+
+// Hint to the CPU that the thread is spinning
+inline void spinPause() {
+#if RASTER_SIMD
+    _mm_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+// Monotonic counter that threads sleep on until it moves past the value they last saw.
+// advance() only makes a system call when someone might be parked.
+class Epoch {
+    std::atomic<unsigned int> value{ 0 };
+    std::atomic<int> parked{ 0 };       // Threads inside wait() past the spin phase
+
+public:
+    // Current value, to be read before checking the condition being waited for
+    unsigned int current() const { return value.load(std::memory_order_acquire); }
+
+    // Moves the epoch on and wakes every waiter
+    void advance() {
+        value.fetch_add(1, std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_seq_cst) > 0) value.notify_all();
+    }
+
+    // Blocks until the epoch differs from seen: spins, then parks
+    // Input Variables:
+    // - seen: Value returned by current() before the caller found nothing to do
+    // - spins: Iterations to spin before parking
+    void wait(unsigned int seen, int spins = 4096) {
+        for (int i = 0; i < spins; i++) {
+            if (value.load(std::memory_order_acquire) != seen) return;
+            spinPause();
+        }
+        parked.fetch_add(1, std::memory_order_seq_cst);
+        while (value.load(std::memory_order_seq_cst) == seen) {
+            value.wait(seen, std::memory_order_acquire);
+        }
+        parked.fetch_sub(1, std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <vector>
+#include "simd.h"
+#include "vec4.h"
+#include "quaternion.h"
+#include "affine.h"
+
+// Position, rotation and scale of one object.
+// Rotations are accumulated on a unit quaternion instead of multiplying the world matrix by a
+// rotation every frame, so the result never drifts away from a rigid transform.
+struct Transform {
+    vec4 position = vec4(0.f, 0.f, 0.f, 1.f);  // Translation
+    quaternion rotation;                        // Unit rotation quaternion
+    vec4 scale = vec4(1.f, 1.f, 1.f, 0.f);      // Scale along each local axis
+
+    // Apply a rotation in the object's local frame (like world * rotation) and renormalise
+    // Input Variables:
+    // - delta: Rotation to apply
+    void rotate(const quaternion& delta) {
+        rotation = rotation * delta;
+        rotation.normalise();
+    }
+
+    // Object to world transform
+    affine toAffine() const { return affine::makeTRS(position, rotation, scale); }
+};
+
+// Many transforms that each spin by a fixed rotation every frame, stored as structure of arrays
+// so update() and write() process four objects per SSE instruction. The scalar tail and the
+// RASTER_NO_SIMD build run the same operations in the same order and give identical results.
+class TransformBatch {
+    std::vector<float> px, py, pz;          // Positions
+    std::vector<float> qx, qy, qz, qw;      // Rotations
+    std::vector<float> dx, dy, dz, dw;      // Rotation applied per update
+    std::vector<float> sx, sy, sz;          // Scales
+
+public:
+    // Add an object
+    // Input Variables:
+    // - t: Initial transform
+    // - spin: Rotation applied in the object's local frame on every update()
+    // Returns the index of the object in the batch
+    size_t add(const Transform& t, const quaternion& spin = quaternion()) {
+        px.push_back(t.position[0]); py.push_back(t.position[1]); pz.push_back(t.position[2]);
+        qx.push_back(t.rotation.x); qy.push_back(t.rotation.y); qz.push_back(t.rotation.z); qw.push_back(t.rotation.w);
+        dx.push_back(spin.x); dy.push_back(spin.y); dz.push_back(spin.z); dw.push_back(spin.w);
+        sx.push_back(t.scale[0]); sy.push_back(t.scale[1]); sz.push_back(t.scale[2]);
+        return px.size() - 1;
+    }
+
+    // Number of objects in the batch
+    size_t size() const { return px.size(); }
+
+    // Current transform of an object
+    // Input Variables:
+    // - i: Index returned by add()
+    Transform get(size_t i) const {
+        Transform t;
+        t.position = vec4(px[i], py[i], pz[i], 1.f);
+        t.rotation = quaternion(qx[i], qy[i], qz[i], qw[i]);
+        t.scale = vec4(sx[i], sy[i], sz[i], 0.f);
+        return t;
+    }
+
+    // Move an object
+    // Input Variables:
+    // - i: Index returned by add()
+    // - p: New position
+    void setPosition(size_t i, const vec4& p) {
+        px[i] = p[0]; py[i] = p[1]; pz[i] = p[2];
+    }
+
+    // Apply every object's spin once and renormalise its rotation
+    void update() {
+        size_t n = size();
+        size_t i = 0;
+#if RASTER_SIMD
+        const __m128 one = _mm_set1_ps(1.0f);
+        for (; i + 4 <= n; i += 4) {
+            __m128 ax = _mm_loadu_ps(&qx[i]), ay = _mm_loadu_ps(&qy[i]), az = _mm_loadu_ps(&qz[i]), aw = _mm_loadu_ps(&qw[i]);
+            __m128 bx = _mm_loadu_ps(&dx[i]), by = _mm_loadu_ps(&dy[i]), bz = _mm_loadu_ps(&dz[i]), bw = _mm_loadu_ps(&dw[i]);
+
+            // Same terms and order as quaternion::operator*
+            __m128 rx = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(aw, bx), _mm_mul_ps(ax, bw)), _mm_mul_ps(ay, bz)), _mm_mul_ps(az, by));
+            __m128 ry = _mm_add_ps(_mm_add_ps(_mm_sub_ps(_mm_mul_ps(aw, by), _mm_mul_ps(ax, bz)), _mm_mul_ps(ay, bw)), _mm_mul_ps(az, bx));
+            __m128 rz = _mm_add_ps(_mm_sub_ps(_mm_add_ps(_mm_mul_ps(aw, bz), _mm_mul_ps(ax, by)), _mm_mul_ps(ay, bx)), _mm_mul_ps(az, bw));
+            __m128 rw = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(_mm_mul_ps(aw, bw), _mm_mul_ps(ax, bx)), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+
+            // Same as quaternion::normalise
+            __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(ry, ry)), _mm_mul_ps(rz, rz)), _mm_mul_ps(rw, rw));
+            __m128 inv = _mm_div_ps(one, _mm_sqrt_ps(len2));
+            _mm_storeu_ps(&qx[i], _mm_mul_ps(rx, inv));
+            _mm_storeu_ps(&qy[i], _mm_mul_ps(ry, inv));
+            _mm_storeu_ps(&qz[i], _mm_mul_ps(rz, inv));
+            _mm_storeu_ps(&qw[i], _mm_mul_ps(rw, inv));
+        }
+#endif
+        for (; i < n; i++) {
+            quaternion q = quaternion(qx[i], qy[i], qz[i], qw[i]) * quaternion(dx[i], dy[i], dz[i], dw[i]);
+            q.normalise();
+            qx[i] = q.x; qy[i] = q.y; qz[i] = q.z; qw[i] = q.w;
+        }
+    }
+
+    // Write every object's world transform
+    // Input Variables:
+    // - out: Receives one affine per object, e.g. a lambda storing into Mesh::world
+    template<typename F>
+    void write(F out) const {
+        size_t n = size();
+        size_t i = 0;
+#if RASTER_SIMD
+        const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f);
+        for (; i + 4 <= n; i += 4) {
+            __m128 x = _mm_loadu_ps(&qx[i]), y = _mm_loadu_ps(&qy[i]), z = _mm_loadu_ps(&qz[i]), w = _mm_loadu_ps(&qw[i]);
+            __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+            __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+            __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+            __m128 s0 = _mm_loadu_ps(&sx[i]), s1 = _mm_loadu_ps(&sy[i]), s2 = _mm_loadu_ps(&sz[i]);
+
+            // Same terms and order as affine::makeTRS, one register per matrix element
+            __m128 e[12];
+            e[0] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), s0);
+            e[1] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), s1);
+            e[2] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), s2);
+            e[3] = _mm_loadu_ps(&px[i]);
+            e[4] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), s0);
+            e[5] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), s1);
+            e[6] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), s2);
+            e[7] = _mm_loadu_ps(&py[i]);
+            e[8] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), s0);
+            e[9] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), s1);
+            e[10] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), s2);
+            e[11] = _mm_loadu_ps(&pz[i]);
+
+            // Transpose each group of four elements into one row per object
+            affine t[4];
+            for (unsigned int row = 0; row < 3; row++) {
+                __m128 r0 = e[row * 4], r1 = e[row * 4 + 1], r2 = e[row * 4 + 2], r3 = e[row * 4 + 3];
+                _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                t[0].setRow(row, vec4(r0)); t[1].setRow(row, vec4(r1));
+                t[2].setRow(row, vec4(r2)); t[3].setRow(row, vec4(r3));
+            }
+            for (unsigned int k = 0; k < 4; k++) out(i + k, t[k]);
+        }
+#endif
+        for (; i < n; i++) {
+            out(i, get(i).toAffine());
+        }
+    }
+};
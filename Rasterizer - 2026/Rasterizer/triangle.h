@@ -4,9 +4,12 @@
 #include "colour.h"
 #include "renderer.h"
 #include "light.h"
+#include "shadow.h"
+#include "lighttiles.h"
 #include <iostream>
 #include <algorithm>
 #include <cmath>
+#include <vector>
 
 // Simple support class for a 2D vector
 class vec2D {
@@ -42,6 +45,10 @@ class triangle {
     Vertex v[3];       // Vertices of the triangle
     float area;        // Area of the triangle
     colour col[3];     // Colors for each vertex of the triangle
+    const ShadowMap* shadow = nullptr; // Shadow map to look up, or nullptr when unshadowed
+    const LightGrid* lights = nullptr; // Tiled point and spot lights, or nullptr when there are none
+    vec4 wp[3];        // World positions divided by clip w, with 1/w in the last component
+    bool fastNormals = false; // Normalise interpolated normals with the approximate reciprocal square root
 
 public:
     // Constructor initializes the triangle with three vertices
@@ -58,6 +65,32 @@ public:
         area = std::fabs(e1.x * e2.y - e1.y * e2.x);
     }
 
+    // Enable lighting terms that need the world position of each pixel
+    // Input Variables:
+    // - map: Shadow map of the directional light, or nullptr
+    // - grid: Tiled local lights, or nullptr
+    // - w0, w1, w2: World position of each vertex divided by its clip w, with 1/w stored in w,
+    //   so it can be interpolated linearly in screen space and recovered perspective-correct
+    void setWorldLighting(const ShadowMap* map, const LightGrid* grid, const vec4& w0, const vec4& w1, const vec4& w2) {
+        shadow = map;
+        lights = grid;
+        wp[0] = w0;
+        wp[1] = w1;
+        wp[2] = w2;
+    }
+
+    // Perspective-correct world position of a point of the triangle
+    // Input Variables:
+    // - alpha, beta, gamma: Barycentric coordinates of the point
+    vec4 worldPosition(float alpha, float beta, float gamma) {
+        float invW = beta * wp[0][3] + gamma * wp[1][3] + alpha * wp[2][3];
+        return vec4(
+            (beta * wp[0][0] + gamma * wp[1][0] + alpha * wp[2][0]) / invW,
+            (beta * wp[0][1] + gamma * wp[1][1] + alpha * wp[2][1]) / invW,
+            (beta * wp[0][2] + gamma * wp[1][2] + alpha * wp[2][2]) / invW,
+            1.f);
+    }
+
     // Helper function to compute the cross product for barycentric coordinates
     // Input Variables:
     // - v1, v2: Edges defining the vector
@@ -98,8 +131,21 @@ public:
     // - renderer: Renderer object for drawing
     // - L: Light object for shading calculations
     // - ka, kd: Ambient and diffuse lighting coefficients
-    void draw(Renderer& renderer, Light& L, float ka, float kd, int minY, int maxY) {
+    // - minY, maxY: Rows of the canvas this call may write to
+    // - rate: Rate at which lighting is evaluated (depth and coverage stay per pixel), ignored with MSAA
+    void draw(Renderer& renderer, Light& L, float ka, float kd, int minY, int maxY, ShadingRate rate = ShadingRate::Rate1x1) {
         if (area < 1.f) return;
+        fastNormals = renderer.fastNormalise;
+        if (renderer.msaa) {
+            drawMsaa(renderer, L, ka, kd, minY, maxY);
+            return;
+        }
+        switch (rate) {
+        case ShadingRate::Rate2x1: drawCoarse(renderer, L, ka, kd, minY, maxY, 2, 1); return;
+        case ShadingRate::Rate1x2: drawCoarse(renderer, L, ka, kd, minY, maxY, 1, 2); return;
+        case ShadingRate::Rate2x2: drawCoarse(renderer, L, ka, kd, minY, maxY, 2, 2); return;
+        default: break;
+        }
         vec2D minV, maxV;
         getBoundsWindow(renderer.canvas, minV, maxV);
 
@@ -111,26 +157,25 @@ public:
         float invArea = 1.0f / area;
 
         float da_dx = (v[0].p[1] - v[1].p[1]) * invArea;
-        float da_dy = (v[1].p[0] - v[0].p[0]) * invArea;
-
         float db_dx = (v[1].p[1] - v[2].p[1]) * invArea;
-        float db_dy = (v[2].p[0] - v[1].p[0]) * invArea;
-
         float dg_dx = (v[2].p[1] - v[0].p[1]) * invArea;
-        float dg_dy = (v[0].p[0] - v[2].p[0]) * invArea;
 
         float dDepth_dx = db_dx * v[0].p[2] + dg_dx * v[1].p[2] + da_dx * v[2].p[2];
         float dR_dx = db_dx * v[0].rgb[colour::RED] + dg_dx * v[1].rgb[colour::RED] + da_dx * v[2].rgb[colour::RED];
         float dG_dx = db_dx * v[0].rgb[colour::GREEN] + dg_dx * v[1].rgb[colour::GREEN] + da_dx * v[2].rgb[colour::GREEN];
         float dB_dx = db_dx * v[0].rgb[colour::BLUE] + dg_dx * v[1].rgb[colour::BLUE] + da_dx * v[2].rgb[colour::BLUE];
 
-        float a_row, b_row, g_row;
-        getCoordinates(vec2D((float)startX, (float)startY), a_row, b_row, g_row);
+        // After a Z pre-pass the buffer holds the nearest depth of every pixel, stepped exactly as
+        // here (see depthTriangle), so only a triangle at that depth passes. The first to shade a
+        // pixel stores its depth one step nearer, so a later one at the very same depth is turned
+        // away as it would be without the pre-pass.
+        bool prepass = renderer.zPrepass;
 
         for (int y = startY; y < endY; y++) {
-            float alpha = a_row;
-            float beta = b_row;
-            float gamma = g_row;
+            // Every row starts from its own exact coordinates, so the pixels do not depend on
+            // which row the strip being drawn starts at
+            float alpha, beta, gamma;
+            getCoordinates(vec2D((float)startX, (float)y), alpha, beta, gamma);
 
             float depth = beta * v[0].p[2] + gamma * v[1].p[2] + alpha * v[2].p[2];
             float r = beta * v[0].rgb[colour::RED] + gamma * v[1].rgb[colour::RED] + alpha * v[2].rgb[colour::RED];
@@ -139,27 +184,255 @@ public:
 
             for (int x = startX; x < endX; x++) {
                 if (alpha >= 0.f && beta >= 0.f && gamma >= 0.f) {
-                    if (renderer.zbuffer(x, y) > depth && depth > 0.001f) {
+                    float nearest = renderer.zbuffer(x, y);
+                    bool visible = (prepass ? nearest >= depth : nearest > depth) && depth > 0.001f;
+                    RASTER_STAT(renderer.stats.fragment(x, y, visible));
+                    if (visible) {
                         vec4 normal = (v[0].normal * beta) + (v[1].normal * gamma) + (v[2].normal * alpha);
-                        normal.normalise();
+                        if (fastNormals) normal.normaliseFast();
+                        else normal.normalise();
 
                         float dot = std::max(vec4::dot(L.omega_i, normal), 0.0f);
+                        colour local;
+                        if ((shadow && dot > 0.f) || lights) {
+                            vec4 world = worldPosition(alpha, beta, gamma);
+                            if (shadow && dot > 0.f) dot *= shadow->visibility(world);
+                            if (lights) local = lights->shade(x, y, world, normal);
+                        }
 
-                        unsigned char cr = static_cast<unsigned char>(std::min((r * kd * dot + L.ambient[colour::RED] * ka), 1.0f) * 255);
-                        unsigned char cg = static_cast<unsigned char>(std::min((g * kd * dot + L.ambient[colour::GREEN] * ka), 1.0f) * 255);
-                        unsigned char cb = static_cast<unsigned char>(std::min((b * kd * dot + L.ambient[colour::BLUE] * ka), 1.0f) * 255);
+                        unsigned char cr = static_cast<unsigned char>(std::min((r * kd * (dot + local[colour::RED]) + L.ambient[colour::RED] * ka), 1.0f) * 255);
+                        unsigned char cg = static_cast<unsigned char>(std::min((g * kd * (dot + local[colour::GREEN]) + L.ambient[colour::GREEN] * ka), 1.0f) * 255);
+                        unsigned char cb = static_cast<unsigned char>(std::min((b * kd * (dot + local[colour::BLUE]) + L.ambient[colour::BLUE] * ka), 1.0f) * 255);
 
                         renderer.canvas.draw(x, y, cr, cg, cb);
-                        renderer.zbuffer(x, y) = depth;
+                        renderer.zbuffer(x, y) = prepass ? std::nextafter(depth, 0.f) : depth;
                     }
                 }
                 alpha += da_dx; beta += db_dx; gamma += dg_dx;
                 depth += dDepth_dx; r += dR_dx; g += dG_dx; b += dB_dx;
             }
-            a_row += da_dy; b_row += db_dy; g_row += dg_dy;
         }
     }
 
+    // Draw the triangle with lighting evaluated once per qw x qh block of pixels.
+    // Blocks are aligned to the screen grid so neighbouring triangles and strips agree on them.
+    // Coverage and depth are stepped per pixel exactly as in draw(); the first visible pixel of a
+    // block triggers one lighting evaluation at the block centre, which is cached and broadcast
+    // to the rest of the block.
+    // Input Variables:
+    // - renderer: Renderer object for drawing
+    // - L: Light object for shading calculations
+    // - ka, kd: Ambient and diffuse lighting coefficients
+    // - minY, maxY: Rows of the canvas this call may write to
+    // - qw, qh: Width and height of a shading block in pixels
+    void drawCoarse(Renderer& renderer, Light& L, float ka, float kd, int minY, int maxY, int qw, int qh) {
+        vec2D minV, maxV;
+        getBoundsWindow(renderer.canvas, minV, maxV);
+
+        int startY = std::max((int)std::floor(minV.y), minY);
+        int endY = std::min((int)std::ceil(maxV.y), maxY);
+        int startX = (int)std::floor(minV.x);
+        int endX = (int)std::ceil(maxV.x);
+        if (startY >= endY || startX >= endX) return;
+
+        float invArea = 1.0f / area;
+
+        float da_dx = (v[0].p[1] - v[1].p[1]) * invArea;
+        float db_dx = (v[1].p[1] - v[2].p[1]) * invArea;
+        float dg_dx = (v[2].p[1] - v[0].p[1]) * invArea;
+
+        float dDepth_dx = db_dx * v[0].p[2] + dg_dx * v[1].p[2] + da_dx * v[2].p[2];
+
+        bool prepass = renderer.zPrepass;  // See draw()
+
+        // One cached colour per block column, tagged with the block row it was shaded for.
+        // Taken from the thread's frame arena and handed back when the triangle is done.
+        int firstBlockX = startX - (startX % qw);
+        int blocks = (endX - firstBlockX + qw - 1) / qw;
+        FrameArena& scratch = FrameArena::local();
+        size_t scratchMark = scratch.mark();
+        int* shadedRow = scratch.allocate<int>(blocks);
+        unsigned char* shadedColour = scratch.allocate<unsigned char>(blocks * 3);
+        std::fill(shadedRow, shadedRow + blocks, -1);
+
+        for (int y = startY; y < endY; y++) {
+            int blockY = y - (y % qh);
+            // Every row starts from its own exact coordinates, so the pixels do not depend on
+            // which row the strip being drawn starts at
+            float alpha, beta, gamma;
+            getCoordinates(vec2D((float)startX, (float)y), alpha, beta, gamma);
+            float depth = beta * v[0].p[2] + gamma * v[1].p[2] + alpha * v[2].p[2];
+
+            for (int x = startX; x < endX; x++) {
+                if (alpha >= 0.f && beta >= 0.f && gamma >= 0.f) {
+                    float nearest = renderer.zbuffer(x, y);
+                    bool visible = (prepass ? nearest >= depth : nearest > depth) && depth > 0.001f;
+                    RASTER_STAT(renderer.stats.fragment(x, y, visible));
+                    if (visible) {
+                        int block = (x - firstBlockX) / qw;
+                        unsigned char* c = &shadedColour[block * 3];
+                        if (shadedRow[block] != blockY) {
+                            shadePoint(L, ka, kd, firstBlockX + block * qw + (qw - 1) * 0.5f, blockY + (qh - 1) * 0.5f, c);
+                            shadedRow[block] = blockY;
+                        }
+
+                        renderer.canvas.draw(x, y, c[0], c[1], c[2]);
+                        renderer.zbuffer(x, y) = prepass ? std::nextafter(depth, 0.f) : depth;
+                    }
+                }
+                alpha += da_dx; beta += db_dx; gamma += dg_dx;
+                depth += dDepth_dx;
+            }
+        }
+        scratch.rewind(scratchMark);
+    }
+
+    // Draw the triangle into the 4x multisample target.
+    // Coverage and depth are evaluated at every sample, but lighting runs once per pixel at the
+    // centroid of the covered samples, which always lies inside the triangle.
+    // Input Variables:
+    // - renderer: Renderer object holding the sample buffer
+    // - L: Light object for shading calculations
+    // - ka, kd: Ambient and diffuse lighting coefficients
+    // - minY, maxY: Rows of the canvas this call may write to
+    void drawMsaa(Renderer& renderer, Light& L, float ka, float kd, int minY, int maxY) {
+        MsaaBuffer& target = renderer.samples;
+        vec2D minV, maxV;
+        getBounds(minV, maxV);
+
+        // Samples sit up to half a pixel either side of the evaluated point, so widen the box by one
+        int startY = std::max((int)std::floor(minV.y), std::max(minY, 0));
+        int endY = std::min((int)std::ceil(maxV.y) + 1, std::min(maxY, (int)target.getHeight()));
+        int startX = std::max((int)std::floor(minV.x), 0);
+        int endX = std::min((int)std::ceil(maxV.x) + 1, (int)target.getWidth());
+        if (startY >= endY || startX >= endX) return;
+
+        float invArea = 1.0f / area;
+
+        float da_dx = (v[0].p[1] - v[1].p[1]) * invArea;
+        float da_dy = (v[1].p[0] - v[0].p[0]) * invArea;
+
+        float db_dx = (v[1].p[1] - v[2].p[1]) * invArea;
+        float db_dy = (v[2].p[0] - v[1].p[0]) * invArea;
+
+        float dg_dx = (v[2].p[1] - v[0].p[1]) * invArea;
+        float dg_dy = (v[0].p[0] - v[2].p[0]) * invArea;
+
+        float dDepth_dx = db_dx * v[0].p[2] + dg_dx * v[1].p[2] + da_dx * v[2].p[2];
+        float dDepth_dy = db_dy * v[0].p[2] + dg_dy * v[1].p[2] + da_dy * v[2].p[2];
+
+        // Per-sample offsets of the barycentrics and depth from the pixel's evaluation point
+        float sa[MsaaBuffer::Samples], sb[MsaaBuffer::Samples], sg[MsaaBuffer::Samples], sz[MsaaBuffer::Samples];
+        for (int s = 0; s < MsaaBuffer::Samples; s++) {
+            float ox = MsaaBuffer::offsets[s][0], oy = MsaaBuffer::offsets[s][1];
+            sa[s] = da_dx * ox + da_dy * oy;
+            sb[s] = db_dx * ox + db_dy * oy;
+            sg[s] = dg_dx * ox + dg_dy * oy;
+            sz[s] = dDepth_dx * ox + dDepth_dy * oy;
+        }
+        // Largest change of each barycentric between the evaluated point and any sample
+        float ma = 0.f, mb = 0.f, mg = 0.f;
+        for (int s = 0; s < MsaaBuffer::Samples; s++) {
+            ma = std::max(ma, std::fabs(sa[s]));
+            mb = std::max(mb, std::fabs(sb[s]));
+            mg = std::max(mg, std::fabs(sg[s]));
+        }
+
+        for (int y = startY; y < endY; y++) {
+            // Every row starts from its own exact coordinates, so the pixels do not depend on
+            // which row the strip being drawn starts at
+            float alpha, beta, gamma;
+            getCoordinates(vec2D((float)startX, (float)y), alpha, beta, gamma);
+            float depth = beta * v[0].p[2] + gamma * v[1].p[2] + alpha * v[2].p[2];
+
+            for (int x = startX; x < endX; x++) {
+                // Only pixels within reach of an edge need all four samples evaluated
+                unsigned int mask = 0;
+                if (alpha >= ma && beta >= mb && gamma >= mg) {
+                    mask = MsaaBuffer::FullMask;
+                }
+                else if (alpha >= -ma && beta >= -mb && gamma >= -mg) {
+                    for (int s = 0; s < MsaaBuffer::Samples; s++) {
+                        if (alpha + sa[s] >= 0.f && beta + sb[s] >= 0.f && gamma + sg[s] >= 0.f) mask |= 1u << s;
+                    }
+                }
+
+                if (mask) {
+                    float z[MsaaBuffer::Samples];
+                    for (int s = 0; s < MsaaBuffer::Samples; s++) z[s] = depth + sz[s];
+
+                    unsigned int pass = target.test(x, y, mask, z);
+                    RASTER_STAT(renderer.stats.fragment(x, y, pass != 0));
+                    if (pass) {
+                        // Shade at the centroid of the covered samples
+                        float ca = alpha, cb = beta, cg = gamma;
+                        if (mask != MsaaBuffer::FullMask) {
+                            float sumA = 0.f, sumB = 0.f, sumG = 0.f;
+                            int covered = 0;
+                            for (int s = 0; s < MsaaBuffer::Samples; s++) {
+                                if (mask & (1u << s)) {
+                                    sumA += sa[s]; sumB += sb[s]; sumG += sg[s];
+                                    covered++;
+                                }
+                            }
+                            ca += sumA / covered; cb += sumB / covered; cg += sumG / covered;
+                        }
+                        unsigned char c[3];
+                        shadeBarycentric(L, ka, kd, ca, cb, cg, x, y, c);
+                        target.write(x, y, pass, z, depth, c);
+                    }
+                }
+                alpha += da_dx; beta += db_dx; gamma += dg_dx;
+                depth += dDepth_dx;
+            }
+        }
+    }
+
+    // Evaluate lighting at one point, used for shading blocks and multisampled pixels
+    // The point is clamped onto the triangle so edge blocks do not extrapolate the normal.
+    // Input Variables:
+    // - L: Light object for shading calculations
+    // - ka, kd: Ambient and diffuse lighting coefficients
+    // - cx, cy: Point to shade in pixels
+    // Output Variables:
+    // - out: Shaded RGB colour, 3 bytes
+    void shadePoint(Light& L, float ka, float kd, float cx, float cy, unsigned char* out) {
+        float alpha, beta, gamma;
+        getCoordinates(vec2D(cx, cy), alpha, beta, gamma);
+        alpha = std::max(alpha, 0.f);
+        beta = std::max(beta, 0.f);
+        gamma = std::max(gamma, 0.f);
+        float inv = 1.0f / (alpha + beta + gamma);
+        alpha *= inv; beta *= inv; gamma *= inv;
+        shadeBarycentric(L, ka, kd, alpha, beta, gamma, (int)cx, (int)cy, out);
+    }
+
+    // Evaluate lighting at a point given by its barycentric coordinates
+    // Input Variables:
+    // - L: Light object for shading calculations
+    // - ka, kd: Ambient and diffuse lighting coefficients
+    // - alpha, beta, gamma: Barycentric coordinates of the point, inside the triangle
+    // - x, y: Pixel containing the point, used to find its light tile
+    // Output Variables:
+    // - out: Shaded RGB colour, 3 bytes
+    void shadeBarycentric(Light& L, float ka, float kd, float alpha, float beta, float gamma, int x, int y, unsigned char* out) {
+        vec4 normal = (v[0].normal * beta) + (v[1].normal * gamma) + (v[2].normal * alpha);
+        if (fastNormals) normal.normaliseFast();
+        else normal.normalise();
+        float dot = std::max(vec4::dot(L.omega_i, normal), 0.0f);
+        colour local;
+        if ((shadow && dot > 0.f) || lights) {
+            vec4 world = worldPosition(alpha, beta, gamma);
+            if (shadow && dot > 0.f) dot *= shadow->visibility(world);
+            if (lights) local = lights->shade(x, y, world, normal);
+        }
+
+        colour c = interpolate(beta, gamma, alpha, v[0].rgb, v[1].rgb, v[2].rgb);
+        out[0] = static_cast<unsigned char>(std::min((c[colour::RED] * kd * (dot + local[colour::RED]) + L.ambient[colour::RED] * ka), 1.0f) * 255);
+        out[1] = static_cast<unsigned char>(std::min((c[colour::GREEN] * kd * (dot + local[colour::GREEN]) + L.ambient[colour::GREEN] * ka), 1.0f) * 255);
+        out[2] = static_cast<unsigned char>(std::min((c[colour::BLUE] * kd * (dot + local[colour::BLUE]) + L.ambient[colour::BLUE] * ka), 1.0f) * 255);
+    }
+
     // Compute the 2D bounds of the triangle
     // Output Variables:
     // - minV, maxV: Minimum and maximum bounds in 2D space
@@ -1,17 +1,34 @@
 #pragma once
 
 #include <iostream>
+#include <cmath>
+#include "simd.h"
 
 // The `vec4` class represents a 4D vector and provides operations such as scaling, addition, subtraction, 
 // normalization, and vector products (dot and cross).
-class vec4 {
+// With RASTER_SIMD the four components share one 16-byte aligned SSE register.
+class alignas(16) vec4 {
     union {
         struct {
             float x, y, z, w; // Components of the vector
         };
         float v[4];           // Array representation of the vector components
+#if RASTER_SIMD
+        __m128 m;             // SSE register view of the components
+#endif
     };
 
+#if RASTER_SIMD
+    // Mask clearing the W lane, used by operations that return directions
+    static __m128 xyzMask() { return _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0)); }
+
+    // Sum of the X, Y and Z lanes, added in the same order as the scalar code
+    static float sum3(__m128 p) {
+        __m128 s = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+        return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(p, p)));
+    }
+#endif
+
 public:
     // Constructor to initialize the vector with specified values.
     // Default values: x = 0, y = 0, z = 0, w = 1.
@@ -20,8 +37,22 @@ public:
     // - _y: Y component of the vector
     // - _z: Z component of the vector
     // - _w: W component of the vector (default is 1.0)
+#if RASTER_SIMD
+    // Built in a register so a following SIMD operation does not wait on four scalar stores
+    vec4(float _x = 0.f, float _y = 0.f, float _z = 0.f, float _w = 1.f)
+        : m(_mm_setr_ps(_x, _y, _z, _w)) {}
+#else
     vec4(float _x = 0.f, float _y = 0.f, float _z = 0.f, float _w = 1.f)
         : x(_x), y(_y), z(_z), w(_w) {}
+#endif
+
+#if RASTER_SIMD
+    // Constructor wrapping an SSE register
+    explicit vec4(__m128 _m) : m(_m) {}
+
+    // Returns the SSE register holding the components
+    __m128 simd() const { return m; }
+#endif
 
     // Displays the components of the vector in a readable format.
     void display() {
@@ -33,16 +64,25 @@ public:
     // - scalar: Value to scale the vector by
     // Returns a new scaled `vec4`.
     vec4 operator*(float scalar) const {
+#if RASTER_SIMD
+        return vec4(_mm_mul_ps(m, _mm_set1_ps(scalar)));
+#else
         return { x * scalar, y * scalar, z * scalar, w * scalar };
+#endif
     }
 
     // Divides the vector by its W component and sets W to 1.
     // Useful for normalizing the W component after transformations.
     void W() {
+#if RASTER_SIMD
+        __m128 d = _mm_div_ps(m, RASTER_SPLAT(m, 3));
+        m = _mm_or_ps(_mm_and_ps(d, xyzMask()), _mm_setr_ps(0.f, 0.f, 0.f, 1.f));
+#else
         x /= w;
         y /= w;
         z /= w;
         w = 1.f;
+#endif
     }
 
     // Accesses a vector component by index.
@@ -66,7 +106,11 @@ public:
     // - other: The vector to subtract
     // Returns a new `vec4` resulting from the subtraction.
     vec4 operator-(const vec4& other) const {
+#if RASTER_SIMD
+        return vec4(_mm_and_ps(_mm_sub_ps(m, other.m), xyzMask()));
+#else
         return vec4(x - other.x, y - other.y, z - other.z, 0.0f);
+#endif
     }
 
     // Adds another vector to this vector.
@@ -74,7 +118,11 @@ public:
     // - other: The vector to add
     // Returns a new `vec4` resulting from the addition.
     vec4 operator+(const vec4& other) const {
+#if RASTER_SIMD
+        return vec4(_mm_and_ps(_mm_add_ps(m, other.m), xyzMask()));
+#else
         return vec4(x + other.x, y + other.y, z + other.z, 0.0f);
+#endif
     }
 
     // Computes the cross product of two vectors.
@@ -83,12 +131,20 @@ public:
     // - v2: The second vector
     // Returns a new `vec4` representing the cross product.
     static vec4 cross(const vec4& v1, const vec4& v2) {
+#if RASTER_SIMD
+        __m128 a_yzx = _mm_shuffle_ps(v1.m, v1.m, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 a_zxy = _mm_shuffle_ps(v1.m, v1.m, _MM_SHUFFLE(3, 1, 0, 2));
+        __m128 b_yzx = _mm_shuffle_ps(v2.m, v2.m, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 b_zxy = _mm_shuffle_ps(v2.m, v2.m, _MM_SHUFFLE(3, 1, 0, 2));
+        return vec4(_mm_and_ps(_mm_sub_ps(_mm_mul_ps(a_yzx, b_zxy), _mm_mul_ps(a_zxy, b_yzx)), xyzMask()));
+#else
         return vec4(
             v1.y * v2.z - v1.z * v2.y,
             v1.z * v2.x - v1.x * v2.z,
             v1.x * v2.y - v1.y * v2.x,
             0.0f // The W component is set to 0 for cross products
         );
+#endif
     }
 
     // Computes the dot product of two vectors.
@@ -97,15 +153,43 @@ public:
     // - v2: The second vector
     // Returns the dot product as a float.
     static float dot(const vec4& v1, const vec4& v2) {
+#if RASTER_SIMD
+        return sum3(_mm_mul_ps(v1.m, v2.m));
+#else
         return (v1.x * v2.x) + (v1.y * v2.y) + (v1.z * v2.z);
+#endif
     }
 
     // Normalizes the vector to make its length equal to 1.
     // This operation does not affect the W component.
     void normalise() {
+#if RASTER_SIMD
+        float length = std::sqrt(sum3(_mm_mul_ps(m, m)));
+        __m128 d = _mm_div_ps(m, _mm_set1_ps(length));
+        m = _mm_or_ps(_mm_and_ps(d, xyzMask()), _mm_andnot_ps(xyzMask(), m));
+#else
         float length = std::sqrt(x * x + y * y + z * z);
         x /= length;
         y /= length;
         z /= length;
+#endif
+    }
+
+    // Normalizes the vector using an approximate reciprocal square root refined by one
+    // Newton-Raphson step (relative error around 1e-6 with SIMD), avoiding the sqrt and divides.
+    // This operation does not affect the W component.
+    void normaliseFast() {
+#if RASTER_SIMD
+        __m128 len2 = _mm_set1_ps(sum3(_mm_mul_ps(m, m)));
+        __m128 r = _mm_rsqrt_ps(len2);
+        // r' = r * (1.5 - 0.5 * len2 * r * r)
+        r = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), len2), _mm_mul_ps(r, r))));
+        m = _mm_or_ps(_mm_and_ps(_mm_mul_ps(m, r), xyzMask()), _mm_andnot_ps(xyzMask(), m));
+#else
+        float invLength = 1.0f / std::sqrt(x * x + y * y + z * z);
+        x *= invLength;
+        y *= invLength;
+        z *= invLength;
+#endif
     }
 };
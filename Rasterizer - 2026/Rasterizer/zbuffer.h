@@ -21,7 +21,7 @@ public:
     }
 
     // Default constructor for creating an uninitialized Z-buffer.
-    Zbuffer() {
+    Zbuffer() : buffer(nullptr), width(0), height(0) {
     }
 
     // Creates or reinitialies the Z-buffer with the given width and height.
@@ -45,6 +45,17 @@ public:
         return buffer[(y * width) + x]; // Convert 2D coordinates to 1D index
     }
 
+    // Reads the depth value at the specified (x, y) coordinate (const version).
+    T operator () (unsigned int x, unsigned int y) const {
+        return buffer[(y * width) + x];
+    }
+
+    // Returns the width of the Z-buffer in pixels.
+    unsigned int getWidth() const { return width; }
+
+    // Returns the height of the Z-buffer in pixels.
+    unsigned int getHeight() const { return height; }
+
     // Clears the Z-buffer by setting all depth values to 1.0f,
     // which represents the farthest possible depth.
     void clear() {